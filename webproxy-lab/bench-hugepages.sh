@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+#
+# bench-hugepages.sh - 캐시 블록 아레나를 큰 페이지로 잡았을 때와 일반 페이지로 잡았을 때의
+#     캐시 히트 처리량 비교. tiny를 원 서버로 띄우고 같은 객체 목록을 hitbench로 요청한다.
+#
+#     usage: ./bench-hugepages.sh [seconds] [threads] [extra proxy options...]
+#
+
+SECONDS_PER_RUN=${1:-10}
+THREADS=${2:-8}
+if [ $# -ge 2 ]; then shift 2; else shift $#; fi
+EXTRA_OPTS="$@"
+
+HOME_DIR=`pwd`
+FILES="home.html csapp.c tiny.c godzilla.jpg godzilla.gif"
+PORT_START=4500
+MAX_RAND=60000
+
+#
+# free_port - print an unused TCP port (same approach as driver.sh)
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+    while netstat --numeric-ports --numeric-hosts -a --protocol=tcpip | grep tcp | \
+        cut -c21- | cut -d':' -f2 | cut -d' ' -f1 | grep -wq "${port}"
+    do
+        port=`expr ${port} + 1`
+    done
+    echo "${port}"
+}
+
+make -s proxy hitbench || exit 1
+(cd tiny && make -s) || exit 1
+
+TINY_PORT=`free_port`
+cd tiny
+./tiny ${TINY_PORT} > /dev/null 2>&1 &
+TINY_PID=$!
+cd ${HOME_DIR}
+trap 'kill ${TINY_PID} 2> /dev/null; [ -n "${PROXY_PID}" ] && kill ${PROXY_PID} 2> /dev/null' EXIT
+
+URLS=""
+for file in ${FILES}; do
+    URLS="${URLS} http://localhost:${TINY_PORT}/${file}"
+done
+
+# run_bench <label> <proxy options...>
+function run_bench {
+    local label=$1
+    shift
+    PROXY_PORT=`free_port`
+    ./proxy ${PROXY_PORT} "$@" > /dev/null 2>&1 &
+    PROXY_PID=$!
+    sleep 1
+
+    echo "== ${label} (proxy $@)"
+    ./hitbench localhost ${PROXY_PORT} ${SECONDS_PER_RUN} ${THREADS} ${URLS}
+    curl --silent http://localhost:${PROXY_PORT}/proxy-stats | grep -E "^arena_"
+    grep -E "AnonHugePages" /proc/${PROXY_PID}/smaps_rollup 2> /dev/null
+    kill ${PROXY_PID}
+    wait ${PROXY_PID} 2> /dev/null
+    PROXY_PID=""
+}
+
+run_bench "huge pages" ${EXTRA_OPTS}
+run_bench "normal pages" -N ${EXTRA_OPTS}
@@ -0,0 +1,117 @@
+/*
+ * hitbench.c - 프록시 캐시 히트 처리량 측정
+ *
+ * 스레드 여러 개가 정해진 시간 동안 같은 URL 목록을 프록시에 계속 요청하고
+ * 초당 요청 수와 전송량을 출력한다. URL은 미리 한 번씩 요청해 캐시에 올려 둔다.
+ *
+ *     usage: ./hitbench <proxy-host> <proxy-port> <seconds> <threads> <url>...
+ */
+#include "csapp.h"
+
+typedef struct {
+    char *host;            /* 프록시 호스트 */
+    char *port;            /* 프록시 포트 */
+    char **urls;           /* 요청할 URL 목록 */
+    int num_urls;
+    double deadline;       /* 측정 종료 시각 */
+    int start;             /* URL 목록에서 시작할 위치 (스레드마다 다르게) */
+    unsigned long requests; /* 완료한 요청 수 */
+    unsigned long bytes;    /* 받은 바이트 수 */
+    unsigned long errors;   /* 실패한 요청 수 */
+} bench_t;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* url을 프록시로 한 번 요청하고 받은 바이트 수 (실패하면 -1) */
+static long fetch(const char *host, const char *port, const char *url) {
+    char buf[MAXBUF];
+    long total = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open_clientfd((char *)host, (char *)port)) < 0) return -1;
+    n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\nConnection: close\r\n\r\n", url);
+    if (rio_writen(fd, buf, n) != n) {
+        close(fd);
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) total += n;
+    close(fd);
+    return n < 0 ? -1 : total;
+}
+
+static void *bench_thread(void *vargp) {
+    bench_t *b = (bench_t *)vargp;
+
+    for (int i = b->start; now_sec() < b->deadline; i++) {
+        long n = fetch(b->host, b->port, b->urls[i % b->num_urls]);
+        if (n <= 0) {
+            b->errors++;
+            continue;
+        }
+        b->requests++;
+        b->bytes += n;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    unsigned long requests = 0, bytes = 0, errors = 0;
+    double seconds, elapsed;
+    int threads;
+    bench_t *b;
+    pthread_t *tids;
+
+    if (argc < 6) {
+        fprintf(stderr, "usage: %s <proxy-host> <proxy-port> <seconds> <threads> <url>...\n", argv[0]);
+        exit(1);
+    }
+    seconds = atof(argv[3]);
+    threads = atoi(argv[4]);
+    if (seconds <= 0 || threads < 1) {
+        fprintf(stderr, "seconds and threads must be positive\n");
+        exit(1);
+    }
+    Signal(SIGPIPE, SIG_IGN);
+
+    // 모든 URL을 한 번씩 요청해 캐시에 올림 (캐시 적재는 비동기라 잠깐 기다림)
+    for (int i = 5; i < argc; i++) {
+        if (fetch(argv[1], argv[2], argv[i]) <= 0) {
+            fprintf(stderr, "warm-up fetch failed: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    usleep(200000);
+
+    b = Calloc(threads, sizeof(bench_t));
+    tids = Malloc(threads * sizeof(pthread_t));
+    elapsed = now_sec();
+    for (int t = 0; t < threads; t++) {
+        b[t].host = argv[1];
+        b[t].port = argv[2];
+        b[t].urls = argv + 5;
+        b[t].num_urls = argc - 5;
+        b[t].deadline = elapsed + seconds;
+        b[t].start = t;
+        Pthread_create(&tids[t], NULL, bench_thread, &b[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        Pthread_join(tids[t], NULL);
+        requests += b[t].requests;
+        bytes += b[t].bytes;
+        errors += b[t].errors;
+    }
+    elapsed = now_sec() - elapsed;
+
+    printf("requests: %lu\n", requests);
+    printf("errors: %lu\n", errors);
+    printf("requests_per_sec: %.1f\n", requests / elapsed);
+    printf("mb_per_sec: %.2f\n", bytes / elapsed / (1024 * 1024));
+    Free(b);
+    Free(tids);
+    return 0;
+}
@@ -1,37 +1,618 @@
 #include "csapp.h"
 #include <limits.h>  /* ULONG_MAX 정의를 위해 추가 */
+#include <time.h>    /* clock_gettime (압축 CPU 시간 측정) */
+#include <getopt.h>  /* 실행 옵션 파싱 */
+#include <ctype.h>   /* tolower (Vary 헤더 이름 정규화) */
+#include <fnmatch.h> /* 우선순위 클래스 URL 패턴 */
+#include <sys/syscall.h> /* SYS_sched_setaffinity (분할 워커 코어 고정) */
+#include <sys/mman.h>    /* 워커 프로세스가 함께 쓰는 공유 메모리 캐시 */
+#include <sys/prctl.h>   /* PR_SET_PDEATHSIG (감시 프로세스와 함께 종료) */
+#include <linux/mempolicy.h> /* MPOL_PREFERRED (노드별 캐시 아레나) */
+#include <poll.h>        /* hedge: 두 연결 중 먼저 응답하는 쪽 기다림 */
 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define CACHE_BLOCK_SIZE 16384  /* 본문을 나눠 저장하는 블록 크기 (Range 요청의 단위) */
+#define GZIP_MIN_SIZE 128       /* 이보다 작은 본문은 gzip으로 압축하지 않음 */
+#define LZB_KEEP_LIMIT(len) ((len) * 7 / 8) /* 캐시 압축 결과가 이 크기 이하일 때만 압축해서 저장 */
+#define BODY_TABLE_SIZE 256     /* 공유 본문 해시 테이블 버킷 수 */
+#define CHAIN_BLOCKS ((MAX_OBJECT_SIZE + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE) /* 객체 하나의 최대 블록 수 */
+#define BLOCK_POOL_SIZE 64      /* 재사용하려고 남겨 두는 빈 블록 수 */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024) /* 큰 페이지 크기 (x86-64 기본) */
+#define ARENA_SIZE (2 * HUGE_PAGE_SIZE)  /* 캐시 블록 아레나 크기 (캐시 예산과 응답 중인 블록을 담을 만큼) */
+#define ARENA_BLOCKS (ARENA_SIZE / CACHE_BLOCK_SIZE)
+#define NUMA_MAX_NODES 8        /* 아레나를 따로 두는 NUMA 노드 최대 수 */
+#define NUMA_MAX_CPUS 1024      /* CPU 번호 → 노드 표 크기 (코어 고정 마스크와 같은 크기) */
+#define POPULATE_QUEUE_MAX 64   /* 적재 대기열 길이 한도 (넘으면 새 객체는 캐싱하지 않음) */
+#define MAX_PARTITIONS 16       /* 캐시 분할 최대 수 (-w) */
+#define HOT_MAX 16              /* 코어별로 복제하는 핫 객체 최대 수 (-H) */
+#define HOT_MAX_CPUS 64         /* 코어별 사본 테이블 수 (코어 번호를 이 값으로 나눈 나머지 사용) */
+#define HOT_SAMPLE 8            /* 히트 몇 번에 한 번 빈도 스케치에 기록할지 */
+#define HOT_THRESHOLD 4         /* 핫 객체로 올릴 최소 스케치 추정치 */
+#define HOT_AGE 1024            /* 이만큼 기록할 때마다 스케치와 점수를 반으로 줄임 */
+#define HOT_ROWS 4              /* count-min 스케치 행 수 */
+#define HOT_WIDTH 1024          /* count-min 스케치 행 너비 */
+#define MAX_PROCS 16            /* 워커 프로세스 최대 수 (-P) */
+#define SHM_ENTRIES 64          /* 공유 메모리 캐시 항목 수 */
+#define SHM_BLOCKS (MAX_CACHE_SIZE / CACHE_BLOCK_SIZE) /* 공유 메모리 캐시 본문 블록 수 */
+#define SHM_LOG 32              /* 워커 프로세스에 알리는 무효화 기록 수 */
+#define MAX_PEERS 16            /* 피어 프록시 최대 수 (-r, 자신 포함) */
+#define PEER_VNODES 64          /* 피어 하나가 해시 링에 올리는 가상 노드 수 */
+#define PEER_RETRY_MS 5000      /* 연결에 실패한 피어를 건너뛰는 시간 (밀리초) */
+#define PEER_HDR "X-Proxy-Peer" /* 피어가 넘긴 요청 표시 (받은 쪽은 다시 넘기지 않음) */
+#define PEER_HOST_MAX 255       /* 피어 주소와 피어에 넘기는 호스트 이름의 최대 길이 */
+#define PEER_PATH_MAX 7900      /* 피어에 넘기는 경로의 최대 길이 (절대 URI가 요청 줄에 들어가도록) */
+#define MAX_POOLS 8             /* 백엔드 묶음 최대 수 (-B) */
+#define MAX_BACKENDS 8          /* 묶음 하나의 백엔드 최대 수 */
+#define BACKEND_EWMA_SHIFT 3    /* 지연 평균에 새 값을 1/8만큼 반영 */
+#define HEALTH_INTERVAL_MS 1000 /* 열린 회로와 백엔드를 확인하는 주기 (밀리초) */
+#define MAX_PROBES 64           /* 한 번에 확인하는 대상 최대 수 */
+#define MAX_BREAKERS 1024       /* 회로 차단기 최대 수 (차면 쉬고 있는 닫힌 차단기를 지움) */
+#define BREAKER_OPEN_RC (-3)    /* 회로가 열려 연결하지 않았을 때 connect_origin 반환값 */
+#define TIMEOUT_RC (-4)         /* 연결 시간 제한을 넘었을 때 open_clientfd_timeout / connect_origin 반환값 */
+#define ANSWERED_RC (-5)        /* 연결하는 사이 지켜보던 연결에 응답이 와서 그만두었을 때 반환값 (hedge) */
+#define LATENCY_BUCKETS 25      /* 응답 시간 분포 구간 수 (k번째 구간은 2^k ~ 2^(k+1) 마이크로초) */
+#define LATENCY_AGE 1024        /* 이만큼 기록할 때마다 분포를 반으로 줄임 */
+#define HEDGE_MIN_SAMPLES 20    /* 분포에 이만큼 쌓이기 전에는 hedge하지 않음 */
+#define URL_TABLE_SIZE 256      /* URL 색인 해시 테이블 버킷 수 */
+#define MAX_VARIANTS 8          /* URL 하나당 캐시할 수 있는 Vary 변형 수 */
+#define WHEEL_TICK_MS 100       /* 타이머 휠 한 틱 (밀리초) */
+#define WHEEL_BITS 6            /* 단마다 2^WHEEL_BITS개 슬롯 */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4          /* 휠 단 수 (최대 64^4 틱, 약 19일) */
+#define STATS_PATH "/proxy-stats" /* 프록시에 직접 요청하면 통계를 돌려주는 경로 */
+#define ORIGIN_TABLE_SIZE 64    /* 원 서버별 기록 해시 테이블 버킷 수 */
+#define BLOOM_SIZE 4096         /* 카운팅 블룸 필터 카운터 수 */
+#define BLOOM_HASHES 3          /* 키 하나가 올리는 카운터 수 */
 
-/* 캐시 구조체 및 관련 데이터 정의 */
+/* 캐시 우선순위 클래스 (낮은 클래스부터 제거, 고정 항목은 LRU로 제거하지 않음) */
+#define PRIO_LOW 0
+#define PRIO_NORMAL 1
+#define PRIO_PINNED 2
+
+/* 타이머 휠에 거는 타이머 */
+typedef struct wheel_timer {
+    unsigned long expires;  /* 만료 틱 */
+    void (*fn)(struct wheel_timer *); /* 만료 때 휠 스레드에서 호출 */
+    void *arg;              /* 콜백 인자 */
+    struct wheel_timer *next, *prev; /* 슬롯 리스트 (등록되지 않았으면 NULL) */
+} wheel_timer_t;
+
+/* 계층형 타이머 휠 */
+typedef struct {
+    wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SLOTS]; /* 단별 슬롯 (리스트 머리) */
+    unsigned long start;    /* 휠을 시작한 시각 (밀리초) */
+    unsigned long now;      /* 현재 틱 */
+    int pending;            /* 등록된 타이머 수 */
+    wheel_timer_t *running; /* 콜백 실행 중인 타이머 */
+    pthread_mutex_t mutex;
+    pthread_cond_t done;    /* 콜백 실행이 끝나면 알림 */
+} wheel_t;
+
+/* 소켓 유휴 시간 제한 */
+typedef struct {
+    wheel_timer_t timer;
+    int fd;
+    unsigned long timeout;  /* 유휴 제한 (밀리초, 0이면 없음) */
+    unsigned long last;     /* 마지막 활동 시각 (밀리초) */
+    unsigned long *counter; /* 시간 초과 때 올릴 통계 */
+    int fired;              /* 시간 초과로 끊었는지 */
+} deadline_t;
+
+/*
+ * 캐시 키. 정규화된 URL (Vary 변형이면 뒤에 " 이름=값;...")과 요청마다 한 번만
+ * 계산해 두는 해시. 캐시 조회와 URL 색인은 문자열을 다시 해시하지 않고 이 값을 쓴다.
+ */
+typedef struct {
+    char str[MAXLINE];      /* 키 문자열 (만들 수 없으면 빈 문자열, 캐싱 안 함) */
+    size_t url_len;         /* 키에서 URL 부분의 길이 */
+    unsigned long url_hash; /* URL 부분의 해시 (URL 색인 조회용) */
+    unsigned long hash;     /* 키 전체의 해시 (변형 조회용) */
+    unsigned long raw_hash; /* 정규화 전 URL의 해시 (정규화로 얻은 히트 집계용) */
+} cache_key_t;
+
+/* URL 기수 트리 노드 */
+typedef struct radix_node {
+    char *label;        /* 부모에서 이 노드로 오는 간선의 문자열 */
+    size_t len;         /* label 길이 */
+    struct url_index *value; /* 이 노드에서 끝나는 URL의 색인 (없으면 NULL) */
+    struct radix_node *child;   /* 첫 자식 */
+    struct radix_node *sibling; /* 다음 형제 */
+} radix_node_t;
+
+/* 최근 연결에 실패한 원 서버 */
+typedef struct origin_failure {
+    char host[MAXLINE];     /* 호스트 이름 */
+    char port[10];          /* 포트 */
+    int rc;                 /* open_clientfd 결과 (-1 연결 실패, -2 이름 해석 실패) */
+    unsigned long expires;  /* 이 시각 (밀리초)까지는 다시 연결하지 않음 */
+    wheel_timer_t timer;    /* 만료 때 기록을 지우는 타이머 */
+    struct origin_failure *next;
+} origin_failure_t;
+
+/* 원 서버별 캐시 점유량과 히트율 (할당량 -b / -e 적용 단위) */
+typedef struct cache_origin {
+    char *name;             /* 캐시 키의 호스트[:포트] 부분 */
+    unsigned long hash;     /* name의 해시 */
+    size_t bytes;           /* 이 원 서버 항목들이 차지하는 바이트 (공유 본문도 각자 계산) */
+    int entries;            /* 이 원 서버의 항목 수 */
+    unsigned long hits;     /* 전체 객체 히트 수 */
+    unsigned long misses;   /* 캐시 미스 수 */
+    struct cache_origin *next; /* 해시 버킷 체인 */
+} cache_origin_t;
+
+/* 캐시 본문. 내용이 같으면 여러 캐시 항목이 하나를 공유한다 */
+typedef struct cache_body {
+    char **blocks;      /* CACHE_BLOCK_SIZE 단위 본문 블록, NULL이면 아직 받지 않은 구간 */
+    unsigned int *block_sizes; /* 블록별 저장 크기 (원래 길이보다 작으면 LZ 압축된 블록) */
+    int num_blocks;     /* 블록 개수 */
+    int lz_mode;        /* 본문 저장 방식: -1 미정, 0 원본, 1 LZ 압축 (첫 블록으로 결정) */
+    size_t size;        /* 원 서버 객체의 전체 길이 */
+    size_t content_size; /* 캐시에 실제로 적재된 본문 크기 */
+    size_t stored_size; /* 블록이 실제로 차지하는 메모리 크기 */
+    unsigned long hash; /* 내용 해시 (완성된 본문만) */
+    int shared;         /* 공유 테이블에 등록되었는지 (등록된 본문은 읽기 전용) */
+    int refcnt;         /* 이 본문을 가리키는 캐시 항목 수 */
+    int pins;           /* 캐시(1)와 락 밖에서 본문을 보내는 중인 스레드 수. 0이 되면 해제 */
+    struct cache_body *next; /* 공유 테이블 버킷 체인 */
+} cache_body_t;
+
+/* 항목에 붙인 gzip 변형 (한 번만 압축해 두고 재사용). 붙인 뒤에는 읽기 전용 */
+typedef struct {
+    char *headers;      /* gzip 변형의 응답 헤더 */
+    size_t headers_size; /* 헤더 크기 */
+    char *content;      /* gzip으로 압축한 본문 */
+    size_t size;        /* 압축된 본문 크기 */
+    int pins;           /* 항목(1)과 락 밖에서 변형을 보내는 중인 스레드 수. 0이 되면 해제 */
+} cache_gzip_t;
+
+/*
+ * 원 서버 응답을 받는 블록 체인. 응답을 CACHE_BLOCK_SIZE 블록에 바로 읽어 들여 클라이언트에
+ * 보내고, 캐싱에 성공하면 블록을 그대로 캐시 본문으로 넘긴다. 캐싱하지 않으면 블록 풀로 돌려준다.
+ */
+typedef struct {
+    char *blocks[CHAIN_BLOCKS + 1]; /* 받은 블록 (마지막 블록은 덜 찼을 수 있음) */
+    int num_blocks;     /* 블록 수 */
+    size_t size;        /* 받은 바이트 수 */
+    int capture;        /* 캐싱하려고 모으는 중인지 (0이면 첫 블록만 중계 버퍼로 씀) */
+} chain_t;
+
+/* 분할 워커가 찾아 요청 스레드에 넘기는 히트. 요청 스레드가 보내고 고정을 놓아줌 */
+typedef struct {
+    char headers[MAXBUF];   /* 본문과 함께 보낼 응답 헤더 사본 */
+    size_t headers_size;    /* 헤더 크기 */
+    cache_body_t *body;     /* 고정한 본문 (gzip 변형을 보내면 NULL) */
+    cache_gzip_t *gz;       /* 고정한 gzip 변형 (본문을 보내면 NULL) */
+} cache_hit_t;
+
+#define HIT_MISS 0      /* 히트가 아님 */
+#define HIT_READY 1     /* 보낼 내용을 cache_hit_t에 담아 둠 */
+#define HIT_DIRECT 2    /* gzip 변형을 처음 만들어야 하므로 요청 스레드가 직접 처리 */
+
+/* 분할 워커에 넘기는 작업 */
+#define JOB_INSERT 0    /* 완성된 객체를 캐시에 넣음 */
+#define JOB_SERVE 1     /* 캐시 히트를 찾아 넘김 (분할 모드) */
+
+typedef struct cache_job {
+    struct cache_job *next; /* 대기열 연결 */
+    int type;               /* JOB_INSERT / JOB_SERVE */
+    cache_key_t key;        /* 캐시 키 (JOB_INSERT) */
+    char *headers;          /* 저장할 헤더 (JOB_INSERT) */
+    cache_body_t *body;     /* 블록 정리와 압축, 해시까지 끝난 본문 (JOB_INSERT) */
+    struct request *req;    /* 요청 (JOB_SERVE) */
+    const char *vary;       /* 요청에 적용한 Vary 헤더 이름 목록 (JOB_SERVE) */
+    int served;             /* 조회 결과 HIT_MISS / HIT_READY / HIT_DIRECT (JOB_SERVE) */
+    cache_hit_t hit;        /* 찾은 히트 (HIT_READY일 때, JOB_SERVE) */
+    sem_t done;             /* 워커가 처리를 끝내면 올림 (JOB_SERVE) */
+} cache_job_t;
+
+/*
+ * 적재 대기열. 여러 요청 스레드가 넣고 적재 스레드 하나만 꺼내는 락 없는 큐
+ * (head를 원자적으로 바꿔 붙이고, 소비자는 stub 노드부터 tail을 따라감)
+ */
 typedef struct {
-    char *url;          /* 캐시된 URL */
-    char *content;      /* 캐시된 웹 객체 내용 */
-    size_t content_size; /* 객체 크기 */
+    cache_job_t *head;      /* 마지막으로 넣은 작업 (생산자들이 원자적으로 교환) */
+    cache_job_t *tail;      /* 다음에 꺼낼 작업 (소비자만 접근) */
+    cache_job_t stub;       /* 빈 큐를 나타내는 노드 */
+    int length;             /* 대기 중인 작업 수 */
+    sem_t items;            /* 넣은 작업 수만큼 올림 (적재 스레드가 기다림) */
+} job_queue_t;
+
+/* 캐시 구조체 및 관련 데이터 정의 */
+typedef struct cache_entry {
+    char *url;          /* 캐시 키 문자열 */
+    unsigned long url_hash; /* 키의 URL 부분 해시 */
+    unsigned long key_hash; /* 키 전체의 해시 */
+    unsigned long raw_hash; /* 항목을 채운 요청의 정규화 전 URL 해시 */
+    char *headers;      /* 상태줄 + 응답 헤더 (항상 200 OK 형태로 저장) */
+    size_t headers_size; /* 헤더 크기 */
+    cache_body_t *body; /* 본문 (같은 내용이면 다른 항목과 공유) */
+    int is_complete;    /* 모든 블록이 채워졌는지 여부 */
+    int negative;       /* 짧게 캐싱한 오류 응답 (404/5xx, 상태줄을 그대로 저장) */
+    int stale;          /* 만료되어 유예 구간에 있음 (원 서버 장애 때만 제공) */
+    cache_origin_t *origin; /* 이 항목의 원 서버 */
+    struct cache *part; /* 이 항목이 속한 캐시 분할 */
+    int priority;       /* 우선순위 클래스 (PRIO_LOW / PRIO_NORMAL / PRIO_PINNED) */
+    size_t charge;      /* 원 서버 점유량에 더한 바이트 */
+    unsigned long expires; /* 만료 시각 (now_msec 기준 밀리초) */
+    wheel_timer_t ttl_timer; /* 만료 때 항목을 회수하는 타이머 */
+    cache_gzip_t *gz;   /* gzip 변형 (아직 압축하지 않았거나 효과가 없으면 NULL) */
+    int gz_checked;     /* 압축을 시도했는지 여부 (압축 효과가 없으면 gz는 NULL) */
     unsigned long timestamp; /* LRU를 위한 타임스탬프 */
     int is_valid;       /* 유효한 캐시 항목인지 여부 */
     int readers;        /* 현재 읽고 있는 스레드 수 */
     pthread_rwlock_t rwlock; /* 읽기/쓰기 락 */
 } cache_entry_t;
 
-/* 캐시 구조체 */
-typedef struct {
+/*
+ * URL별 변형 색인. 원 서버가 알려준 Vary 헤더 이름 목록과 그 URL의 변형 항목들을
+ * 모아 두어, 요청이 오면 URL 해시로 바로 찾은 뒤 몇 개 안 되는 변형 중에서 고른다.
+ */
+typedef struct url_index {
+    char *url;          /* 변형 구분이 없는 URL */
+    unsigned long hash; /* url의 해시 */
+    char *vary;         /* 소문자 Vary 헤더 이름 목록 ("a,b", 없으면 빈 문자열) */
+    int num_variants;   /* 변형 항목 수 */
+    cache_entry_t *variants[MAX_VARIANTS]; /* 변형 항목 */
+    unsigned long variant_hashes[MAX_VARIANTS]; /* 변형 항목 캐시 키의 해시 */
+    struct url_index *next; /* 해시 버킷 체인 */
+} url_index_t;
+
+/* 캐시 구조체 (분할 모드에서는 분할 하나) */
+typedef struct cache {
     cache_entry_t *entries; /* 캐시 항목 배열 */
     int num_entries;       /* 총 항목 수 */
     int max_entries;       /* 최대 허용 항목 수 */
+    size_t max_size;       /* 최대 캐시 크기 (바이트) */
     size_t current_size;   /* 현재 캐시 크기 (바이트) */
+    size_t content_bytes;  /* 적재된 본문의 원래 크기 합 */
+    size_t stored_bytes;   /* 적재된 본문이 실제로 차지하는 크기 합 (압축 반영) */
+    cache_body_t *bodies[BODY_TABLE_SIZE]; /* 내용 해시로 찾는 공유 본문 테이블 */
+    struct url_index *urls[URL_TABLE_SIZE]; /* URL별 변형 색인 */
+    int num_urls;          /* 색인에 있는 URL 수 */
+    radix_node_t *radix;   /* URL 색인을 URL 문자열로 모은 기수 트리 (PURGE / BAN) */
+    int radix_nodes;       /* 기수 트리 노드 수 */
+    size_t dedup_saved;    /* 본문 공유로 아낀 바이트 수 */
+    cache_origin_t *origins[ORIGIN_TABLE_SIZE]; /* 원 서버별 점유량 (한 번 생기면 유지) */
+    unsigned char bloom[BLOOM_SIZE]; /* 캐시 키 해시와 URL 색인 해시의 카운팅 블룸 필터 */
+    job_queue_t queue;     /* 이 분할을 맡은 워커의 작업 대기열 */
+    int node;              /* 이 분할의 본문 블록과 워커를 두는 NUMA 노드 */
     pthread_mutex_t mutex; /* 캐시 전체 락 */
 } cache_t;
 
-/* 전역 캐시 변수 */
-cache_t cache;
+/* 캐시 분할 (분할하지 않으면 cache_parts[0] 하나만 씀) */
+cache_t cache_parts[MAX_PARTITIONS];
+
+/* 이 스레드가 지금 다루는 캐시 분할 (요청 URL, 워커, 만료 항목에 따라 정함) */
+__thread cache_t *cache = &cache_parts[0];
+
+/* 코어별 핫 객체 사본 (읽기 전용, 채우고 지우는 것은 hot.mutex를 잡고) */
+typedef struct {
+    unsigned long hash;  /* 캐시 키 해시 */
+    char *key;           /* 캐시 키 */
+    char *data;          /* 헤더와 본문을 이어 붙인 응답 */
+    size_t len;          /* data 길이 */
+    int gzip;            /* gzip을 받는 클라이언트에는 쓰지 않음 (압축 변형으로 응답해야 함) */
+    int dead;            /* 무효화되었거나 채우는 중 */
+    int refs;            /* 이 사본으로 보내는 중인 요청 수 (이 코어에서만 올림) */
+    unsigned long hits;  /* 마지막 노화 이후 이 사본으로 보낸 히트 수 */
+    cache_origin_t *origin; /* 원본 항목의 원 서버 (원 서버별 히트 수에 더함) */
+} hot_replica_t;
+
+/* 코어 하나의 사본 테이블 (다른 코어와 캐시 라인을 나눠 쓰지 않게 정렬) */
+typedef struct {
+    hot_replica_t slots[HOT_MAX]; /* i번 칸은 핫 집합의 i번 키 */
+} __attribute__((aligned(64))) hot_core_t;
+
+/* 핫 객체 선정 상태 */
+typedef struct {
+    unsigned sketch[HOT_ROWS][HOT_WIDTH]; /* 표본 히트의 count-min 빈도 스케치 */
+    unsigned long samples;                /* 스케치에 기록한 표본 수 */
+    unsigned long keys[HOT_MAX];          /* 핫 집합 (캐시 키 해시, 0이면 빈 자리) */
+    unsigned long score[HOT_MAX];         /* 핫 집합 키의 빈도 점수 (표본 단위) */
+    pthread_mutex_t mutex;                /* 핫 집합과 사본 교체 */
+} hot_t;
+
+hot_core_t hot_cores[HOT_MAX_CPUS];
+hot_t hot = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/* 표본 추출용 스레드별 난수 상태 (연결마다 새 스레드이므로 카운터로는 표본이 뽑히지 않음) */
+__thread unsigned hot_tick;
+
+/* <sched.h>의 GNU 확장 (_GNU_SOURCE는 csapp.h와 충돌하므로 직접 선언) */
+int sched_getcpu(void);
+
+/* 공유 메모리 캐시 항목 상태 */
+#define SHM_FREE 0
+#define SHM_FILLING 1   /* 자리와 블록을 잡고 본문을 복사하는 중 */
+#define SHM_READY 2
+#define SHM_DEAD 3      /* 지워졌지만 아직 보내는 프로세스가 있음 */
+
+/* 공유 메모리 캐시 항목. 포인터 대신 블록 번호로 본문을 잇는다 */
+typedef struct {
+    int state;              /* SHM_FREE / FILLING / READY / DEAD */
+    unsigned long hash;     /* 캐시 키 해시 */
+    char key[MAXLINE];      /* 캐시 키 */
+    size_t url_len;         /* 키에서 URL 부분의 길이 */
+    char headers[MAXBUF];   /* 응답 헤더 */
+    size_t headers_size;    /* 헤더 길이 */
+    size_t size;            /* 본문 크기 */
+    int first;              /* 첫 본문 블록 번호 (-1이면 없음) */
+    int num_blocks;         /* 본문 블록 수 */
+    unsigned long expires;  /* 만료 시각 (now_msec, 모든 프로세스가 같은 시계) */
+    unsigned long last_used; /* 마지막 사용 시각 (LRU) */
+    int refs;               /* 이 항목을 보내는 중인 요청 수 (모든 프로세스 합) */
+    unsigned short worker_refs[MAX_PROCS]; /* refs 중 워커 프로세스별 몫 (죽은 워커의 몫은 감시 프로세스가 풂) */
+} shm_entry_t;
+
+/* 다른 워커 프로세스의 로컬 캐시에도 반영할 PURGE / BAN */
+typedef struct {
+    unsigned long seq;      /* 기록 번호 */
+    int ban;                /* 1이면 url 접두사, 0이면 url 하나 */
+    char url[MAXLINE];      /* 정규화된 URL */
+} shm_inval_t;
+
+/* 워커 프로세스가 함께 쓰는 캐시 (fork 전에 MAP_SHARED로 잡음) */
+typedef struct {
+    pthread_mutex_t mutex;            /* 프로세스 공유 robust 뮤텍스 (표 전체) */
+    shm_entry_t entries[SHM_ENTRIES];
+    int next[SHM_BLOCKS];             /* 다음 블록 번호 (-1이면 끝) */
+    int free_block;                   /* 빈 블록 목록의 첫 번호 */
+    int free_blocks;                  /* 빈 블록 수 */
+    unsigned long inval_seq;          /* 마지막 무효화 기록 번호 */
+    shm_inval_t log[SHM_LOG];         /* 무효화 기록 (seq % SHM_LOG 칸) */
+    unsigned long hits;               /* 공유 캐시 히트 */
+    unsigned long stores;             /* 공유 캐시에 넣은 객체 수 */
+    unsigned long evictions;          /* LRU로 밀려난 객체 수 */
+    unsigned long restarts;           /* 다시 띄운 워커 프로세스 수 */
+    unsigned long recoveries;         /* 락을 잡은 채 죽은 워커 뒤에 락을 되살린 수 */
+    unsigned long released_refs;      /* 죽은 워커가 남긴 참조를 감시 프로세스가 푼 수 */
+    char data[SHM_BLOCKS][CACHE_BLOCK_SIZE]; /* 본문 블록 */
+} shm_cache_t;
+
+/* 공유 메모리 캐시 (워커 프로세스 모드가 아니면 NULL) */
+shm_cache_t *shm;
+
+/* 이 프로세스가 로컬 캐시에 반영한 마지막 무효화 기록 */
+unsigned long shm_seen;
+
+/* 이 워커 프로세스의 번호 (0 ~ procs-1, 공유 캐시 참조를 워커별로 기록) */
+int worker_slot;
+pthread_mutex_t shm_seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* URL 공간을 나눠 맡는 형제 프록시 */
+typedef struct {
+    char host[MAXLINE];
+    char port[10];
+    unsigned long down_until; /* 연결에 실패하면 이 시각(now_msec)까지 건너뜀 */
+} peer_t;
+
+/* 해시 링의 가상 노드 */
+typedef struct {
+    unsigned long hash;
+    int peer;               /* peers 번호 */
+} ring_point_t;
+
+/* 피어 목록과 해시 링 (피어가 없으면 num_peers가 0) */
+peer_t peers[MAX_PEERS];
+int num_peers;
+int peer_self;              /* peers에서 이 프록시의 번호 */
+ring_point_t peer_ring[MAX_PEERS * PEER_VNODES];
+int peer_ring_size;
+
+/* 회로 차단기 상태 */
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1      /* 연결하지 않고 바로 실패 (상태 확인 스레드가 살아났는지 확인) */
+#define BREAKER_HALF_OPEN 2 /* 확인에 성공: 요청 하나만 보내 보고 결과로 닫거나 다시 엶 */
+#define BREAKER_TRIAL 2     /* breaker_allow 반환값: 반쯤 열린 회로의 시험 요청으로 통과 */
+
+/*
+ * 연결 대상(원 서버나 백엔드의 host:port)별 회로 차단기. 표가 MAX_BREAKERS만큼 차면 닫혀 있고
+ * 실패도 쓰는 요청도 없는 원 서버 차단기 중 가장 오래 쓰지 않은 것을 지움 (백엔드 것은 지우지 않음)
+ */
+typedef struct breaker {
+    char host[MAXLINE];
+    char port[10];
+    int state;                  /* BREAKER_CLOSED / OPEN / HALF_OPEN */
+    int users;                  /* breaker_get으로 받아 아직 breaker_put하지 않은 요청 수 */
+    unsigned long last_used;    /* 마지막으로 breaker_get한 시각 (now_msec) */
+    int failures;               /* 연속 실패 수 (연결·응답 실패, 5xx, 느린 응답) */
+    int trial;                  /* 반쯤 열린 상태에서 시험 요청을 보냈는지 */
+    int always_probe;           /* 닫혀 있어도 주기적으로 확인 (백엔드) */
+    unsigned long trips;        /* 회로가 열린 횟수 */
+    unsigned long rejected;     /* 회로가 열려 바로 실패시킨 연결 수 */
+    unsigned long probes;       /* 상태 확인 수 */
+    unsigned long probe_failures; /* 실패한 상태 확인 수 */
+    unsigned latency_hist[LATENCY_BUCKETS]; /* 응답 헤더까지 걸린 시간 분포 (hedge 지연 계산) */
+    unsigned latency_count;     /* 분포에 든 표본 수 */
+    struct breaker *next;
+} breaker_t;
+
+breaker_t *breakers[ORIGIN_TABLE_SIZE];
+int num_breakers;
+pthread_mutex_t breakers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* 원 서버 하나를 대신하는 복제 백엔드 */
+typedef struct {
+    char host[MAXLINE];
+    char port[10];
+    breaker_t *breaker;         /* 이 백엔드의 회로 차단기 */
+    int inflight;               /* 지금 응답을 받고 있는 요청 수 */
+    unsigned long requests;     /* 연결을 시도한 요청 수 */
+    unsigned long failures;     /* 연결 실패 수 */
+    unsigned long ewma_usec;    /* 연결부터 응답 헤더까지 걸린 시간의 지수 이동 평균 (마이크로초) */
+} backend_t;
+
+/* URL의 host:port 하나를 나눠 받는 백엔드 묶음 (-B) */
+typedef struct {
+    char host[MAXLINE];
+    char port[10];
+    backend_t backends[MAX_BACKENDS];
+    int num_backends;
+} backend_pool_t;
+
+backend_pool_t pools[MAX_POOLS];
+int num_pools;
+
+/*
+ * 이 스레드가 응답을 받고 있는 연결 대상의 회로 차단기, 백엔드, 연결 시각, 이 연결이 반쯤 열린
+ * 회로의 시험 요청인지 (close_origin에서 정리)
+ */
+__thread breaker_t *upstream_breaker;
+__thread backend_t *upstream_backend;
+__thread unsigned long upstream_start;
+__thread int upstream_trial;
+__thread unsigned backend_seed;
+
+/* 위 추적 상태를 담아 두는 곳 (hedge 때 두 연결을 번갈아 추적) */
+typedef struct {
+    breaker_t *breaker;
+    backend_t *backend;
+    unsigned long start;
+    int trial;
+} upstream_t;
+
+/* 빈 블록 풀 (응답 캡처에서 캐싱하지 않은 블록 재사용) */
+char *block_pool[BLOCK_POOL_SIZE];
+int block_pool_count;
+pthread_mutex_t block_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* NUMA 노드 하나의 캐시 블록 아레나 (빈 블록 목록은 block_pool_mutex로 보호) */
+typedef struct {
+    char *base;                 /* 아레나 시작 (NULL이면 아레나 없음) */
+    char *free[ARENA_BLOCKS];   /* 빈 블록 */
+    int free_count;
+    const char *mode;           /* hugetlb / thp / 4k */
+    int bound;                  /* mbind로 노드에 묶였는지 */
+} arena_t;
+
+arena_t arenas[NUMA_MAX_NODES];
+
+/* NUMA 배치 (/sys/devices/system/node에서 읽음, 정보가 없으면 노드 0 하나) */
+int num_nodes = 1;
+unsigned char cpu_node[NUMA_MAX_CPUS]; /* CPU 번호 → 노드 */
+
+/* 타이머 휠 */
+wheel_t wheel;
+
+/* 스레드마다 하나씩: 클라이언트 요청 대기, 원 서버 응답 대기 시간 제한 */
+__thread deadline_t client_deadline, upstream_deadline;
+
+/* 실행 옵션 */
+typedef struct {
+    int cache_compress;    /* 캐시 본문을 LZ로 압축해 저장 (-z) */
+    int sort_query;        /* 캐시 키에서 쿼리 파라미터를 이름순으로 정렬 (-q) */
+    char strip_query[MAXLINE]; /* 캐시 키에서 뺄 쿼리 파라미터 이름 목록 (-x, "a,utm_*") */
+    long default_ttl;      /* 만료 정보가 없는 응답의 TTL (초, -t) */
+    long client_timeout;   /* 클라이언트 요청을 기다리는 시간 (초, -c, 0이면 무제한) */
+    long upstream_timeout; /* 원 서버 응답이 멈춰 있을 수 있는 시간 (초, -u, 0이면 무제한) */
+    long connect_timeout;  /* 원 서버 연결을 기다리는 시간 (초, -C, 0이면 무제한) */
+    long first_byte_timeout; /* 요청 뒤 응답 헤더를 기다리는 시간 (초, -T, 0이면 무제한) */
+    long negative_ttl;     /* 오류 응답과 연결 실패를 캐싱하는 시간 (초, -n, 0이면 안 함) */
+    long grace;            /* 만료된 항목을 장애 대비로 남겨 두는 시간 (초, -g, 0이면 바로 제거) */
+    size_t origin_bytes;   /* 원 서버 하나가 차지할 수 있는 바이트 (-b, 0이면 제한 없음) */
+    int origin_entries;    /* 원 서버 하나가 차지할 수 있는 항목 수 (-e, 0이면 제한 없음) */
+    char pin_urls[MAXLINE]; /* 제거하지 않을 URL 패턴 목록 (-p, fnmatch 패턴을 쉼표로 구분) */
+    char low_urls[MAXLINE]; /* 먼저 제거할 URL 패턴 목록 (-l) */
+    int partitions;        /* 캐시 분할 수 (-w, 1이면 분할하지 않음) */
+    int hot;               /* 코어별로 복제할 핫 객체 수 (-H, 0이면 끔) */
+    int procs;             /* 워커 프로세스 수 (-P, 0이면 한 프로세스) */
+    int no_huge_pages;     /* 캐시 블록 아레나에 큰 페이지를 쓰지 않음 (-N, 비교 측정용) */
+    char peer_list[MAXLINE]; /* URL을 나눠 맡는 피어 프록시 목록 (-r, "host:port,...") */
+    char self[MAXLINE];    /* 피어 목록에서 이 프록시의 주소 (-s, 기본 localhost:<port>) */
+    int breaker_failures;  /* 회로를 여는 연속 실패 수 (-f, 0이면 회로 차단기를 쓰지 않음) */
+    long breaker_latency;  /* 이보다 늦은 응답 헤더는 실패로 셈 (밀리초, -L, 0이면 안 셈) */
+    int hedge;             /* 응답 시간이 이 백분위를 넘으면 요청을 한 번 더 보냄 (-D, 0이면 안 함) */
+} config_t;
+
+config_t config = {.default_ttl = 300, .client_timeout = 30, .upstream_timeout = 30,
+                   .connect_timeout = 10, .first_byte_timeout = 30,
+                   .negative_ttl = 10, .grace = 60, .partitions = 1, .breaker_failures = 5};
+
+/* 프록시 통계 (STATS_PATH 요청으로 조회) */
+typedef struct {
+    unsigned long requests;       /* 처리한 요청 수 */
+    unsigned long cache_hits;     /* 전체 객체 캐시 히트 */
+    unsigned long cache_misses;   /* 캐시 미스 */
+    unsigned long range_hits;     /* 캐시에서 시작한 Range 응답 */
+    unsigned long gzip_compressed; /* gzip 변형을 만든 객체 수 */
+    unsigned long gzip_served;    /* gzip으로 보낸 히트 수 */
+    unsigned long gzip_in_bytes;  /* 압축 전 본문 바이트 합 */
+    unsigned long gzip_out_bytes; /* 압축 후 본문 바이트 합 */
+    unsigned long gzip_cpu_usec;  /* 압축에 쓴 CPU 시간 (마이크로초) */
+    unsigned long lz_objects;     /* LZ 압축해 저장한 객체 수 */
+    unsigned long lz_raw_objects; /* 압축 효과가 없어 원본으로 저장한 객체 수 */
+    unsigned long lz_hits;        /* 압축 해제가 필요했던 히트 수 */
+    unsigned long lz_decompress_nsec; /* 히트 때 압축 해제에 쓴 시간 (나노초) */
+    unsigned long dedup_hits;     /* 이미 있는 본문을 공유한 횟수 */
+    unsigned long vary_hits;      /* Vary 변형 항목에서 나간 히트 수 */
+    unsigned long norm_rewrites;  /* 정규화로 캐시 키가 바뀐 요청 수 */
+    unsigned long norm_hits;      /* 다른 표기의 URL로 채워진 항목에서 나간 히트 수 */
+    unsigned long ttl_expired;    /* 만료되어 타이머가 회수한 항목 수 */
+    unsigned long client_timeouts; /* 요청을 보내지 않아 끊은 클라이언트 수 */
+    unsigned long upstream_timeouts; /* 응답 본문이 멈춰 끊은 원 서버 연결 수 */
+    unsigned long connect_timeouts; /* 연결 시간 제한을 넘은 원 서버 연결 수 */
+    unsigned long first_byte_timeouts; /* 응답 헤더가 오지 않아 끊은 원 서버 연결 수 */
+    unsigned long gateway_timeouts; /* 시간 초과로 보낸 504 응답 수 */
+    unsigned long wheel_cascades; /* 타이머 휠 위 단 슬롯을 내린 횟수 */
+    unsigned long purges;         /* PURGE 요청 수 */
+    unsigned long bans;           /* BAN 요청 수 */
+    unsigned long invalidated;    /* PURGE / BAN으로 제거한 항목 수 */
+    unsigned long negative_hits;  /* 캐싱된 오류 응답으로 나간 히트 수 */
+    unsigned long origin_failures; /* 원 서버 연결 실패 수 */
+    unsigned long origin_fail_hits; /* 연결 실패 기록 때문에 바로 실패시킨 요청 수 */
+    unsigned long stale_served;   /* 원 서버 장애로 만료 사본을 대신 보낸 수 */
+    unsigned long quota_evictions; /* 원 서버 할당량 때문에 제거한 항목 수 */
+    unsigned long quota_rejects;  /* 할당량보다 커서 캐싱하지 않은 객체 수 */
+    unsigned long evictions[PRIO_PINNED + 1]; /* 클래스별 LRU 제거 수 (유예 구간 항목 포함) */
+    unsigned long populate_queued; /* 적재 스레드에 넘긴 객체 수 */
+    unsigned long populate_dropped; /* 대기열이 가득 차 캐싱하지 않은 객체 수 */
+    unsigned long routed_requests; /* 분할 워커에 넘겨 처리한 조회 수 */
+    unsigned long hot_hits;        /* 코어별 사본으로 보낸 히트 수 (노화 때 옮겨 담음) */
+    unsigned long hot_promotions;  /* 핫 집합에 들어간 키 수 */
+    unsigned long hot_replicas;    /* 만든 코어별 사본 수 */
+    unsigned long arena_fallbacks; /* 아레나가 비어 malloc으로 잡은 블록 수 */
+    unsigned long numa_local_hits;  /* 본문이 요청을 보낸 CPU와 같은 노드에 있던 히트 */
+    unsigned long numa_remote_hits; /* 본문이 다른 노드에 있던 히트 */
+    unsigned long peer_requests;  /* 미스를 맡은 피어에게 넘긴 요청 수 */
+    unsigned long peer_failures;  /* 피어가 응답하지 않아 원 서버로 돌린 요청 수 */
+    unsigned long peer_served;    /* 다른 피어가 넘겨 처리한 요청 수 */
+    unsigned long breaker_trips;  /* 회로가 열린 횟수 (모든 대상 합) */
+    unsigned long breaker_rejects; /* 회로가 열려 바로 실패시킨 연결 수 */
+    unsigned long breaker_evictions; /* 표가 차서 지운 회로 차단기 수 */
+    unsigned long hedge_checked;  /* hedge 대상이던 원 서버 요청 수 */
+    unsigned long hedged;         /* 두 번째 요청을 보낸 수 */
+    unsigned long hedge_wins;     /* 두 번째 요청이 먼저 응답한 수 */
+    unsigned long bloom_skips;    /* 블룸 필터로 락 없이 끝낸 확실한 미스 */
+    unsigned long bloom_false_positives; /* 필터는 있을 수 있다고 했지만 실제로 없던 조회 */
+} stats_t;
+
+stats_t stats;
+
+/* 여러 스레드가 동시에 갱신하므로 원자적으로 더함 */
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
 
 /* 스레드 함수 인자를 위한 구조체 정의 */
 typedef struct {
     int connfd;
 } thread_args;
 
+/* 파싱된 클라이언트 요청 */
+typedef struct request {
+    char hostname[MAXLINE];
+    char path[MAXLINE];
+    char port[10];
+    char url_key[MAXLINE];   /* 정규화된 전체 URL */
+    cache_key_t key;         /* 캐시 키 (url_key + Vary 헤더 값) */
+    char host_hdr[MAXLINE];  /* 클라이언트가 보낸 Host 헤더 (없으면 빈 문자열) */
+    char other_hdrs[MAXLINE]; /* 그대로 전달할 나머지 헤더 */
+    char range[MAXLINE];     /* Range 헤더 값 (없으면 빈 문자열) */
+    char if_range[MAXLINE];  /* If-Range 헤더 값 (없으면 빈 문자열) */
+    char accept_encoding[MAXLINE]; /* Accept-Encoding 헤더 값 (없으면 빈 문자열) */
+    int from_peer;           /* 다른 피어가 넘긴 요청인지 (PEER_HDR) */
+    int peer;                /* 이 요청을 넘긴 피어 번호 (-1이면 원 서버에 직접) */
+} request_t;
+
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
@@ -39,17 +620,248 @@ static const char *user_agent_hdr =
 /* 함수 프로토타입 */
 void doit(int connfd);
 int parse_uri(char *uri, char *hostname, char *path, char *port);
-void build_http_header(char *http_header, char *hostname, char *path);
+void build_http_header(char *http_header, request_t *req, const char *range);
+void read_request_headers(rio_t *rp, request_t *req);
+void forward_request(int connfd, request_t *req);
+void send_cached_entry(int connfd, cache_entry_t *entry);
+void send_cached_body(int connfd, cache_body_t *body, const char *hdrs, size_t hdrs_size);
+int connect_origin(request_t *req);
+int connect_origin_watch(request_t *req, backend_t *skip, int watchfd, long timeout_ms);
+int open_clientfd_timeout(char *hostname, char *port, long timeout_ms);
+int open_clientfd_watch(char *hostname, char *port, long timeout_ms, int watchfd);
 void *thread(void *vargp);
 
+/* 응답 헤더 처리 함수 프로토타입 */
+ssize_t read_response_headers(rio_t *rp, char *hdrs, size_t cap, int *status);
+int hdr_get(const char *hdrs, const char *name, char *val, size_t vlen);
+void hdr_del(char *hdrs, const char *name);
+void hdr_set(char *hdrs, size_t cap, const char *name, const char *val);
+void hdr_set_status(char *hdrs, size_t cap, const char *status_line);
+void hdr_add_vary(char *hdrs, size_t cap, const char *name);
+
+/* Vary 변형 함수 프로토타입 */
+int vary_names(const char *hdrs, char *names, size_t cap);
+int req_hdr_get(request_t *req, const char *name, char *val, size_t vlen);
+void make_cache_key(request_t *req, const char *names);
+
+/* 캐시 키 정규화 함수 프로토타입 */
+void canonicalize_url(request_t *req);
+void normalize_escapes(char *s);
+void remove_dot_segments(char *path);
+void normalize_query(char *query);
+int query_param_stripped(const char *param);
+
+/* Range 요청 처리 함수 프로토타입 */
+int serve_range(int connfd, request_t *req);
+int parse_range(const char *val, long long *first, long long *last);
+int resolve_range(long long first, long long last, size_t size, size_t *start, size_t *end);
+int if_range_matches(const char *if_range, const char *hdrs);
+int same_object(const char *hdrs_a, size_t size_a, const char *hdrs_b, size_t size_b);
+int range_fetch(int connfd, request_t *req, const char *range, rio_t *rp,
+                char *hdrs, size_t cap, ssize_t *hdr_len, int *status);
+int range_miss(int connfd, request_t *req, long long first, long long last);
+int stream_range(int connfd, request_t *req, const char *entry_hdrs, size_t size,
+                 size_t start, size_t end);
+int relay_blocks(int connfd, rio_t *rp, request_t *req, const char *entry_hdrs,
+                 size_t size, size_t body_start, size_t body_end, size_t *pos, size_t end);
+int send_range_headers(int connfd, const char *entry_hdrs, size_t size, size_t start, size_t end);
+int parse_content_range(const char *hdrs, size_t *first, size_t *last, size_t *size);
+void make_entry_headers(char *hdrs, size_t cap, size_t size);
+
+/* gzip 인코딩 함수 프로토타입 */
+int accepts_gzip(const char *accept_encoding);
+int gzip_compressible(const char *hdrs, size_t size);
+size_t gzip_compress(const char *in, size_t len, char **out);
+void make_gzip_headers(char *hdrs, size_t cap, size_t gz_size);
+void serve_gzip_hit(int connfd, cache_entry_t *entry, request_t *req);
+void gzip_unpin(cache_gzip_t *gz);
+unsigned long thread_cpu_usec(void);
+
+/* 타이머 휠 함수 프로토타입 */
+unsigned long now_msec(void);
+void wheel_init(void);
+void wheel_timer_init(wheel_timer_t *t, void (*fn)(wheel_timer_t *), void *arg);
+void wheel_timer_add(wheel_timer_t *t, unsigned long msec);
+int wheel_timer_del(wheel_timer_t *t, int sync);
+void deadline_start(deadline_t *d, int fd, unsigned long timeout_ms, unsigned long *counter);
+void deadline_touch(deadline_t *d);
+int deadline_stop(deadline_t *d);
+void deadline_phase(deadline_t *d, unsigned long timeout_ms, unsigned long *counter);
+time_t parse_http_date(const char *val);
+long entry_ttl(const char *hdrs);
+int close_origin(int serverfd);
+
+/* 네거티브 캐싱 함수 프로토타입 */
+int negative_status(int status);
+int hdr_status(const char *hdrs);
+int origin_failure_find(request_t *req);
+void origin_failure_add(request_t *req, int rc);
+void send_origin_error(int connfd, request_t *req, int rc);
+int serve_stale(int connfd, request_t *req);
+
+/* 통계 함수 프로토타입 */
+void serve_stats(int connfd);
+void stats_printf(char *body, size_t cap, size_t *len, const char *fmt, ...);
+void send_text(int connfd, const char *status, const char *body);
+
+/* 캐시 무효화 함수 프로토타입 */
+int client_is_local(int connfd);
+void serve_invalidate(int connfd, rio_t *rp, char *method, char *uri);
+radix_node_t *radix_new(const char *label, size_t len);
+void radix_insert(const char *key, url_index_t *value);
+void radix_remove(const char *key);
+radix_node_t *radix_find_prefix(const char *prefix);
+void radix_collect(radix_node_t *node, url_index_t ***out, int *n, int *cap);
+int url_index_drop(url_index_t *u);
+int cache_purge(cache_key_t *key);
+int cache_ban(const char *prefix);
+
+/* 캐시 본문 압축 함수 프로토타입 */
+size_t lzb_compress(const char *src, size_t len, char *dst, size_t cap);
+ssize_t lzb_decompress(const char *src, size_t len, char *dst, size_t cap);
+char *lzb_pack(const char *data, size_t len, size_t *packed_len);
+unsigned long now_nsec(void);
+
+/* 옵션 파싱 */
+void usage(char *prog);
+
 /* 캐시 관련 함수 프로토타입 */
-void cache_init(int max_entries);
+void cache_init(int max_entries, size_t max_size);
 void cache_free(void);
-cache_entry_t *cache_find(char *url);
-void cache_add(char *url, char *content, size_t content_size);
-void cache_evict_lru(size_t required_size);
+cache_entry_t *cache_find(cache_key_t *key);
+cache_entry_t *cache_find_stale(cache_key_t *key);
+cache_entry_t *cache_lookup(cache_key_t *key);
+void cache_read_complete(cache_entry_t *entry);
+void cache_add(cache_key_t *key, char *headers, chain_t *chain);
+void cache_store_block(cache_key_t *key, const char *headers, size_t object_size, int idx,
+                       const char *data, size_t len);
+void cache_attach_gzip(cache_key_t *key, const char *headers, char *gz_headers, char *gz,
+                       size_t gz_size);
+void cache_remove_entry(cache_entry_t *entry);
+void cache_expire_entry(wheel_timer_t *t);
+int entry_cacheable(cache_key_t *key, const char *headers);
+cache_entry_t *cache_new_entry(cache_key_t *key, const char *headers, cache_body_t *body);
+int cache_make_room(size_t required_size, int need_slot);
+int cache_evict_lru(size_t required_size);
+size_t cache_block_len(size_t object_size, int idx);
+const char *cache_block_data(cache_body_t *body, int idx, char *tmp, unsigned long *nsec);
+
+/* 원 서버별 할당량 함수 프로토타입 */
+cache_origin_t *cache_origin_get(const char *url);
+cache_origin_t *cache_origin_find(const char *url);
+void cache_origin_miss(cache_key_t *key);
+void cache_origin_charge(cache_entry_t *entry, size_t bytes);
+int cache_origin_make_room(cache_origin_t *origin, size_t required_size, int need_slot);
+
+/* 우선순위 클래스 함수 프로토타입 */
+int url_priority(const char *url, size_t len);
+int url_matches(const char *list, const char *url);
+
+/* 비동기 캐시 적재 함수 프로토타입 */
+void populate_init(void);
+void job_push(job_queue_t *q, cache_job_t *job);
+cache_job_t *job_pop(job_queue_t *q);
+void cache_insert(cache_key_t *key, char *headers, cache_body_t *body);
+
+/* 캐시 분할 함수 프로토타입 */
+cache_t *cache_part(unsigned long url_hash);
+int cache_serve(int connfd, request_t *req, const char *vary);
+int serve_hit(int connfd, request_t *req, const char *vary);
+void count_hit(cache_entry_t *entry, request_t *req, const char *vary);
+void count_numa_hit(cache_body_t *body);
+int hit_take(request_t *req, const char *vary, cache_hit_t *hit);
+void hit_send(int connfd, cache_hit_t *hit);
+
+/* 핫 객체 복제 함수 프로토타입 */
+int hot_serve(int connfd, request_t *req);
+void hot_note(cache_entry_t *entry, request_t *req);
+void hot_drop(unsigned long hash);
+
+/* 워커 프로세스와 공유 메모리 캐시 함수 프로토타입 */
+void prefork(int procs);
+void shm_init(void);
+void shm_lock(void);
+void shm_unlock(void);
+int shm_serve(int connfd, request_t *req);
+void shm_store(cache_key_t *key, const char *headers, cache_body_t *body);
+int shm_invalidate(const char *url, int ban);
+void shm_sync(void);
+
+/* 피어 캐시 함수 프로토타입 */
+void peer_init(const char *list, const char *self);
+int peer_owner(unsigned long hash);
+int connect_peer(request_t *req);
+void peer_failed(request_t *req);
+
+/* 백엔드 부하 분산 함수 프로토타입 */
+void pool_add(const char *spec);
+backend_pool_t *pool_find(request_t *req);
+backend_t *backend_pick(backend_pool_t *pool, unsigned tried);
+int backend_connect(backend_pool_t *pool, unsigned tried, int watchfd, long timeout_ms);
+void upstream_track(breaker_t *breaker, backend_t *backend, int trial);
+void upstream_response(int status);
+void upstream_done(void);
+void upstream_save(upstream_t *u);
+void upstream_restore(upstream_t *u);
+
+/* 회로 차단기 함수 프로토타입 */
+breaker_t *breaker_get(const char *host, const char *port);
+void breaker_put(breaker_t *b);
+int breaker_evict(void);
+int breaker_ready(breaker_t *b);
+int breaker_allow(breaker_t *b);
+void breaker_result(breaker_t *b, int ok, int trial);
+void breaker_cancel(breaker_t *b, int trial);
+void health_init(void);
+void *health_thread(void *vargp);
+
+/* 요청 hedging 함수 프로토타입 */
+void latency_record(breaker_t *b, unsigned long usec);
+int latency_percentile(breaker_t *b, int pct);
+int hedge_delay(breaker_t *b);
+int hedge_request(request_t *req, int serverfd, const char *request_hdrs);
+
+/* 캐시 블록 아레나 함수 프로토타입 */
+void numa_init(void);
+int numa_current_node(void);
+void arena_init(void);
+void numa_arena_pages(long pages[NUMA_MAX_NODES][NUMA_MAX_NODES]);
+int block_arena(const char *block);
+int block_in_arena(const char *block);
+char *block_get(void);
+void block_put(char *block);
+void block_free(char *block);
+
+/* 응답 캡처 함수 프로토타입 */
+void chain_init(chain_t *chain, int capture);
+char *chain_space(chain_t *chain, size_t *avail);
+void chain_commit(chain_t *chain, size_t n);
+void chain_release(chain_t *chain);
+
+/* 본문 공유 함수 프로토타입 */
+cache_body_t *body_new(size_t size);
+void body_destroy(cache_body_t *body);
+unsigned long body_hash(cache_body_t *body);
+int body_equal(cache_body_t *a, cache_body_t *b);
+cache_body_t *body_intern(cache_body_t *body);
+void body_release(cache_body_t *body);
+void body_unpin(cache_body_t *body);
 unsigned long get_timestamp(void);
 
+/* 블룸 필터 함수 프로토타입 */
+void bloom_add(unsigned long hash);
+void bloom_del(unsigned long hash);
+int bloom_maybe(unsigned long hash);
+unsigned long url_vary_hash(unsigned long url_hash);
+
+/* URL 색인 함수 프로토타입 */
+unsigned long str_hash(const char *s, size_t n);
+url_index_t *url_index_find(const char *url, size_t len, unsigned long hash);
+void url_index_link(cache_entry_t *entry, const char *names);
+void url_index_unlink(cache_entry_t *entry);
+void url_index_prepare(cache_key_t *key, const char *names);
+void cache_url_vary(cache_key_t *key, char *names, size_t cap);
+
 int main(int argc, char **argv) {
     int listenfd, connfd;
     socklen_t clientlen;
@@ -57,45 +869,216 @@ int main(int argc, char **argv) {
     char port[10], host[MAXLINE];
     pthread_t tid;
     thread_args *args;
+    int opt;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(1);
+    static struct option long_options[] = {
+        {"cache-compress", no_argument, NULL, 'z'},
+        {"sort-query", no_argument, NULL, 'q'},
+        {"strip-query", required_argument, NULL, 'x'},
+        {"ttl", required_argument, NULL, 't'},
+        {"client-timeout", required_argument, NULL, 'c'},
+        {"upstream-timeout", required_argument, NULL, 'u'},
+        {"negative-ttl", required_argument, NULL, 'n'},
+        {"grace", required_argument, NULL, 'g'},
+        {"origin-bytes", required_argument, NULL, 'b'},
+        {"origin-entries", required_argument, NULL, 'e'},
+        {"pin", required_argument, NULL, 'p'},
+        {"low", required_argument, NULL, 'l'},
+        {"workers", required_argument, NULL, 'w'},
+        {"hot", required_argument, NULL, 'H'},
+        {"procs", required_argument, NULL, 'P'},
+        {"no-huge-pages", no_argument, NULL, 'N'},
+        {"peers", required_argument, NULL, 'r'},
+        {"self", required_argument, NULL, 's'},
+        {"backends", required_argument, NULL, 'B'},
+        {"breaker-failures", required_argument, NULL, 'f'},
+        {"breaker-latency", required_argument, NULL, 'L'},
+        {"hedge", required_argument, NULL, 'D'},
+        {"connect-timeout", required_argument, NULL, 'C'},
+        {"first-byte-timeout", required_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0}};
+
+    while ((opt = getopt_long(argc, argv, "zqx:t:c:u:n:g:b:e:p:l:w:H:P:Nr:s:B:f:L:D:C:T:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'z':
+            config.cache_compress = 1;
+            break;
+        case 'q':
+            config.sort_query = 1;
+            break;
+        case 'x':
+            snprintf(config.strip_query, sizeof(config.strip_query), "%s", optarg);
+            break;
+        case 't':
+            config.default_ttl = atol(optarg);
+            break;
+        case 'c':
+            config.client_timeout = atol(optarg);
+            break;
+        case 'u':
+            config.upstream_timeout = atol(optarg);
+            break;
+        case 'C':
+            config.connect_timeout = atol(optarg);
+            break;
+        case 'T':
+            config.first_byte_timeout = atol(optarg);
+            break;
+        case 'n':
+            config.negative_ttl = atol(optarg);
+            break;
+        case 'g':
+            config.grace = atol(optarg);
+            break;
+        case 'b':
+            config.origin_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'e':
+            config.origin_entries = atoi(optarg);
+            break;
+        case 'p':
+            snprintf(config.pin_urls, sizeof(config.pin_urls), "%s", optarg);
+            break;
+        case 'l':
+            snprintf(config.low_urls, sizeof(config.low_urls), "%s", optarg);
+            break;
+        case 'w':
+            config.partitions = atoi(optarg);
+            if (config.partitions < 1 || config.partitions > MAX_PARTITIONS) usage(argv[0]);
+            break;
+        case 'H':
+            config.hot = atoi(optarg);
+            if (config.hot < 0 || config.hot > HOT_MAX) usage(argv[0]);
+            break;
+        case 'P':
+            config.procs = atoi(optarg);
+            if (config.procs < 0 || config.procs > MAX_PROCS) usage(argv[0]);
+            break;
+        case 'N':
+            config.no_huge_pages = 1;
+            break;
+        case 'r':
+            snprintf(config.peer_list, sizeof(config.peer_list), "%s", optarg);
+            break;
+        case 's':
+            snprintf(config.self, sizeof(config.self), "%s", optarg);
+            break;
+        case 'B':
+            pool_add(optarg);
+            break;
+        case 'f':
+            config.breaker_failures = atoi(optarg);
+            break;
+        case 'L':
+            config.breaker_latency = atol(optarg);
+            break;
+        case 'D':
+            config.hedge = atoi(optarg);
+            if (config.hedge < 0 || config.hedge > 99) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    // 피어 해시 링 (자기 주소를 주지 않으면 localhost:<port>)
+    if (config.peer_list[0]) {
+        if (!config.self[0]) snprintf(config.self, sizeof(config.self), "localhost:%s", argv[optind]);
+        peer_init(config.peer_list, config.self);
     }
 
     // SIGPIPE 신호 무시 설정 (연결이 끊어진 소켓에 쓰기 시도할 때 발생)
     Signal(SIGPIPE, SIG_IGN);
-    
-    // 캐시 초기화 (MAX_CACHE_SIZE / MAX_OBJECT_SIZE 객체의 10배)
-    cache_init(100);
-    printf("Cache initialized with max size %d bytes\n", MAX_CACHE_SIZE);
 
-    listenfd = Open_listenfd(argv[1]);
+    // 워커 프로세스 모드: 이 프로세스는 감시만 하고 아래부터는 워커 프로세스마다 실행 (스레드는 fork 뒤에 시작)
+    listenfd = Open_listenfd(argv[optind]);
+    if (config.procs > 0) prefork(config.procs);
+
+    // 만료와 유휴 시간 제한을 처리하는 타이머 휠 시작
+    wheel_init();
+
+    // NUMA 노드마다 캐시 본문 블록을 담을 아레나 (가능하면 큰 페이지)
+    numa_init();
+    arena_init();
+
+    // 캐시 초기화 (MAX_CACHE_SIZE / MAX_OBJECT_SIZE 객체의 10배). 분할하면 예산을 똑같이 나눔
+    for (int i = 0; i < config.partitions; i++) {
+        cache = &cache_parts[i];
+        cache_init(100 / config.partitions, MAX_CACHE_SIZE / config.partitions);
+    }
+    cache = &cache_parts[0];
+    printf("Cache initialized with max size %d bytes (%d partitions)\n", MAX_CACHE_SIZE,
+           config.partitions);
+
+    // 분할마다 그 분할을 맡는 워커 시작 (완성된 객체 적재, 분할 모드에서는 히트 응답까지)
+    populate_init();
+
+    // 열린 회로와 백엔드를 주기적으로 확인하는 스레드
+    if (config.breaker_failures > 0) health_init();
+
     while (1) {
         clientlen = sizeof(clientaddr);
         connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
         Getnameinfo((SA *)&clientaddr, clientlen, host, MAXLINE, port, MAXLINE, 0);
         printf("Accepted connection from (%s, %s)\n", host, port);
-        
+
         // 스레드 인자 구조체 할당
         args = (thread_args *)Malloc(sizeof(thread_args));
         args->connfd = connfd;
-        
+
         // 새 스레드 생성하여 클라이언트 요청 처리
         Pthread_create(&tid, NULL, thread, args);
         // 메인 스레드는 바로 다음 연결을 기다림 (connfd를 닫지 않음)
     }
-    
+
     // 여기에 도달하지 않지만 안전을 위해 추가
-    cache_free();
+    for (int i = 0; i < config.partitions; i++) {
+        cache = &cache_parts[i];
+        cache_free();
+    }
     return 0;
 }
 
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [options] <port>\n", prog);
+    fprintf(stderr, "  -z, --cache-compress   store cached bodies LZ-compressed when they shrink\n");
+    fprintf(stderr, "  -q, --sort-query       sort query parameters in cache keys\n");
+    fprintf(stderr, "  -x, --strip-query=LIST drop query parameters (e.g. utm_*,fbclid) from cache keys\n");
+    fprintf(stderr, "  -t, --ttl=SEC          TTL for responses without freshness info (default 300)\n");
+    fprintf(stderr, "  -c, --client-timeout=SEC  wait this long for a client request (default 30, 0 = off)\n");
+    fprintf(stderr, "  -u, --upstream-timeout=SEC  drop a stalled origin response (default 30, 0 = off)\n");
+    fprintf(stderr, "  -C, --connect-timeout=SEC  give up connecting to an origin, reply 504 (default 10, 0 = off)\n");
+    fprintf(stderr, "  -T, --first-byte-timeout=SEC  wait this long for response headers, then 504 (default 30, 0 = off)\n");
+    fprintf(stderr, "  -n, --negative-ttl=SEC cache 404/5xx and connect failures this long (default 10)\n");
+    fprintf(stderr, "  -g, --grace=SEC        keep expired objects to serve while the origin is down (default 60)\n");
+    fprintf(stderr, "  -b, --origin-bytes=N   cache bytes one origin host may use (default 0 = no limit)\n");
+    fprintf(stderr, "  -e, --origin-entries=N cache entries one origin host may use (default 0 = no limit)\n");
+    fprintf(stderr, "  -p, --pin=LIST         URL patterns never evicted by LRU (e.g. '*/home.html')\n");
+    fprintf(stderr, "  -l, --low=LIST         URL patterns evicted before normal entries (e.g. '*.mp4')\n");
+    fprintf(stderr, "  -w, --workers=N        split the cache into N partitions, each owned by a pinned worker (max %d)\n",
+            MAX_PARTITIONS);
+    fprintf(stderr, "  -H, --hot=N            replicate the N hottest objects into per-core copies (max %d)\n",
+            HOT_MAX);
+    fprintf(stderr, "  -P, --procs=N          run N worker processes sharing a shared-memory cache (max %d)\n",
+            MAX_PROCS);
+    fprintf(stderr, "  -N, --no-huge-pages    back the cache block arena with normal pages (for comparison)\n");
+    fprintf(stderr, "  -r, --peers=LIST       sibling proxies (host:port,...) sharing the URL space on a hash ring (max %d)\n",
+            MAX_PEERS);
+    fprintf(stderr, "  -s, --self=HOST:PORT   this proxy's address in the peer list (default localhost:<port>)\n");
+    fprintf(stderr, "  -B, --backends=HOST[:PORT]=LIST  spread misses for an origin over replicas (host:port,...),\n"
+                    "                         repeat for up to %d origins\n", MAX_POOLS);
+    fprintf(stderr, "  -f, --breaker-failures=N  open an origin's circuit after N failures in a row (default 5, 0 = off)\n");
+    fprintf(stderr, "  -L, --breaker-latency=MS  count responses slower than this as failures (default 0 = off)\n");
+    fprintf(stderr, "  -D, --hedge=PCT        resend a GET elsewhere once it is slower than the origin's PCT-th\n"
+                    "                         percentile response time, keep the first answer (default 0 = off)\n");
+    exit(1);
+}
+
 void doit(int connfd) {
   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  char hostname[MAXLINE], path[MAXLINE], port[10];
   rio_t rio_client;
-  int serverfd;
+  request_t req;
 
   // 클라이언트 요청 라인 읽기
   Rio_readinitb(&rio_client, connfd);
@@ -105,349 +1088,5106 @@ void doit(int connfd) {
   // 요청 라인 파싱
   sscanf(buf, "%s %s %s", method, uri, version);
 
+  // 캐시 무효화 요청
+  if (!strcasecmp(method, "PURGE") || !strcasecmp(method, "BAN")) {
+      serve_invalidate(connfd, &rio_client, method, uri);
+      return;
+  }
+
   // GET 요청만 처리
   if (strcasecmp(method, "GET")) {
       printf("Proxy does not implement the method %s\n", method);
       return;
   }
 
-  // URI 파싱하여 hostname, path, port 추출
-  if (parse_uri(uri, hostname, path, port) < 0) {
-      printf("URI parsing failed: %s\n", uri);
-      return;
-  }
-  
-  // 전체 URL을 캐시 키로 사용
-  char url_key[MAXLINE];
-  sprintf(url_key, "http://%s:%s%s", hostname, port, path);
-  
-  // 캐시에서 URL 검색
-  cache_entry_t *entry = cache_find(url_key);
-  if (entry) {
-      // 캐시 히트: 캐시된 내용을 클라이언트에게 전송
-      printf("Cache hit for %s\n", url_key);
-      Rio_writen(connfd, entry->content, entry->content_size);
-      cache_read_complete(entry);
+  // 프록시 자신에게 온 통계 요청
+  if (!strcmp(uri, STATS_PATH)) {
+      serve_stats(connfd);
       return;
   }
-  
-  // 캐시 미스: 서버에 요청
-  printf("Cache miss for %s\n", url_key);
-  
-  // 서버 연결
-  serverfd = Open_clientfd(hostname, port);
-  if (serverfd < 0) {
-      printf("Connection to server %s:%s failed.\n", hostname, port);
+  STAT_ADD(requests, 1);
+
+  // URI 파싱하여 hostname, path, port 추출
+  if (parse_uri(uri, req.hostname, req.path, req.port) < 0) {
+      printf("URI parsing failed: %s\n", uri);
       return;
   }
-  
-  // 서버에 보낼 HTTP 요청 헤더 작성
-  char request_hdrs[MAXLINE], host_hdr[MAXLINE], other_hdrs[MAXLINE];
-  sprintf(request_hdrs, "GET %s HTTP/1.0\r\n", path);
-  
-  // 클라이언트 헤더 읽기 및 필요한 헤더 수정 또는 추가
-  int is_host_hdr_seen = 0;
-  other_hdrs[0] = '\0';
-  
-  while (Rio_readlineb(&rio_client, buf, MAXLINE) > 0) {
-      // 헤더의 끝 확인 (빈 줄)
-      if (!strcmp(buf, "\r\n")) break;
-      
-      // Host 헤더 확인
-      if (!strncasecmp(buf, "Host:", 5)) {
-          is_host_hdr_seen = 1;
-          strcpy(host_hdr, buf);
-      }
-      // Connection 또는 Proxy-Connection 헤더는 건너뜀
-      else if (!strncasecmp(buf, "Connection:", 11) || 
-               !strncasecmp(buf, "Proxy-Connection:", 17)) {
-          continue;
-      }
-      // User-Agent 헤더는 건너뜀 (나중에 추가됨)
-      else if (!strncasecmp(buf, "User-Agent:", 11)) {
-          continue;
-      }
-      // 그 외 헤더는 그대로 전달
-      else {
-          strcat(other_hdrs, buf);
-      }
-  }
-  
-  // HTTP 요청 헤더 완성
-  if (!is_host_hdr_seen) {
-      sprintf(host_hdr, "Host: %s\r\n", hostname);
-  }
-  
-  // 최종 HTTP 요청 헤더 조합
-  strcat(request_hdrs, host_hdr);
-  strcat(request_hdrs, user_agent_hdr);
-  strcat(request_hdrs, "Connection: close\r\n");
-  strcat(request_hdrs, "Proxy-Connection: close\r\n");
-  strcat(request_hdrs, other_hdrs);
-  strcat(request_hdrs, "\r\n");  // 헤더의 끝
-  
-  printf("Forwarding request to server %s:%s\n%s", hostname, port, request_hdrs);
-  
-  // 서버에 요청 전송
-  rio_t rio_server;
-  Rio_readinitb(&rio_server, serverfd);
-  Rio_writen(serverfd, request_hdrs, strlen(request_hdrs));
-  
-  // 서버로부터 응답을 받아 클라이언트에게 전달하고 캐싱
-  size_t n;
-  size_t total_size = 0;
-  char cache_buf[MAX_OBJECT_SIZE];
-  int cacheable = 1;  // 객체가 캐시 가능한지 여부
-  
-  // 응답을 버퍼 단위로 읽어 전달
-  while ((n = Rio_readnb(&rio_server, buf, MAXLINE)) > 0) {
-      // 클라이언트에게 전송
-      Rio_writen(connfd, buf, n);
-      
-      // 캐시 가능한 크기이면 응답을 캐시 버퍼에 저장
-      if (cacheable && total_size + n <= MAX_OBJECT_SIZE) {
-          memcpy(cache_buf + total_size, buf, n);
-          total_size += n;
-      } else if (total_size + n > MAX_OBJECT_SIZE) {
-          cacheable = 0;  // 최대 객체 크기를 초과하여 캐시 불가능
-      }
-  }
-  
-  // 모든 응답을 받았으면 캐시에 저장
-  if (cacheable && total_size > 0) {
-      cache_add(url_key, cache_buf, total_size);
-      printf("Cached %zu bytes for %s\n", total_size, url_key);
-  }
-  
-  Close(serverfd);
-}
-
-int parse_uri(char *uri, char *hostname, char *path, char *port) {
-    char *hostbegin, *hostend, *pathbegin;
-    
-    // URI에 http:// 접두사가 없는 경우 (driver.sh는 완전한 URL을 요구함)
-    if (strncasecmp(uri, "http://", 7) != 0) {
-        // 이미 경로만 있는 경우 (예: /home.html)
-        if (uri[0] == '/') {
-            // localhost로 간주하고 기본 경로 사용
-            strcpy(hostname, "localhost");
-            strcpy(path, uri);
-            strcpy(port, "80");
-            return 0;
-        }
-        fprintf(stderr, "Error: Invalid URI format (no http://): %s\n", uri);
-        return -1;
-    }
-
-    // http:// 이후의 호스트 시작 위치
-    hostbegin = uri + 7;
-    
-    // 경로 부분 찾기 (첫 번째 '/')
-    pathbegin = strchr(hostbegin, '/');
-    
-    if (pathbegin) {
-        // 호스트 부분의 마지막 위치
-        hostend = pathbegin;
-        // 경로 복사
-        strcpy(path, pathbegin);
-    } else {
-        // 경로가 없으면 루트 경로로 설정
-        hostend = hostbegin + strlen(hostbegin);
-        strcpy(path, "/");
-    }
 
-    // 임시 호스트 문자열 생성 및 복사
-    char hostcopy[MAXLINE];
-    strncpy(hostcopy, hostbegin, hostend - hostbegin);
-    hostcopy[hostend - hostbegin] = '\0';
+  // 같은 자원을 가리키는 다른 표기가 같은 캐시 키가 되도록 URL 정규화
+  canonicalize_url(&req);
+  if (shm) shm_sync();  // 다른 워커 프로세스가 받은 PURGE / BAN 반영
+  cache = cache_part(req.key.url_hash);  // 이 URL을 맡은 캐시 분할
 
-    // 호스트에서 포트 번호 분리
-    char *portPos = strchr(hostcopy, ':');
-    if (portPos) {
-        *portPos = '\0';
-        strcpy(hostname, hostcopy);
-        strcpy(port, portPos + 1);
-    } else {
-        strcpy(hostname, hostcopy);
-        strcpy(port, "80");
-    }
+  // 클라이언트 헤더는 캐시 조회 전에 모두 읽음 (Range, Vary 처리에 필요)
+  read_request_headers(&rio_client, &req);
+  if (deadline_stop(&client_deadline)) return;  // 요청을 다 보내기 전에 시간 초과
+  if (req.from_peer) STAT_ADD(peer_served, 1);
 
-    printf("Parsed URI - Host: '%s', Path: '%s', Port: '%s'\n", hostname, path, port);
-    return 0;
-}
+  // 원 서버가 이 URL에 대해 Vary로 알려준 요청 헤더가 있으면 그 값까지 캐시 키에 넣음
+  char vary[MAXLINE];
+  cache_url_vary(&req.key, vary, sizeof(vary));
+  make_cache_key(&req, vary);
 
-void build_http_header(char *http_header, char *hostname, char *path) {
-    char buf[MAXLINE];
+  // Range 요청은 캐시된 블록과 원 서버에서 받은 빈 구간을 이어 붙여 206으로 응답
+  if (req.range[0] && serve_range(connfd, &req)) return;
 
-    sprintf(http_header, "GET %s HTTP/1.0\r\n", path);
-    sprintf(buf, "Host: %s\r\n", hostname);
-    strcat(http_header, buf);
-    strcat(http_header, user_agent_hdr);
-    strcat(http_header, "Connection: close\r\n");
-    strcat(http_header, "Proxy-Connection: close\r\n\r\n");
-}
+  // 캐시에서 URL 검색 (히트면 캐시된 응답을 보내고 끝)
+  if (cache_serve(connfd, &req, vary)) return;
 
-/* 스레드 함수 구현 */
-void *thread(void *vargp) {
-    thread_args *args = (thread_args *)vargp;
-    int connfd = args->connfd;
-    
-    // 스레드를 detach 상태로 만들어 자원을 자동으로 반환하도록 함
-    Pthread_detach(pthread_self());
-    
-    // 메모리 누수 방지를 위해 할당된 인자 구조체 해제
-    Free(vargp);
-    
-    // 클라이언트 요청 처리
-    doit(connfd);
-    
-    // 연결 종료
-    Close(connfd);
-    
-    return NULL;
+  // 캐시 미스: 서버에 요청
+  printf("Cache miss for %s\n", req.url_key);
+  STAT_ADD(cache_misses, 1);
+  cache_origin_miss(&req.key);
+  forward_request(connfd, &req);
 }
 
-/* 캐시 초기화 함수 */
-void cache_init(int max_entries) {
-    cache.entries = (cache_entry_t *)Calloc(max_entries, sizeof(cache_entry_t));
-    cache.num_entries = 0;
-    cache.max_entries = max_entries;
-    cache.current_size = 0;
-    pthread_mutex_init(&cache.mutex, NULL);
-    
-    for (int i = 0; i < max_entries; i++) {
-        cache.entries[i].is_valid = 0;
-        cache.entries[i].url = NULL;
-        cache.entries[i].content = NULL;
-        cache.entries[i].content_size = 0;
-        cache.entries[i].timestamp = 0;
-        cache.entries[i].readers = 0;
-        pthread_rwlock_init(&cache.entries[i].rwlock, NULL);
-    }
-}
+/* 캐시 히트면 캐시된 헤더와 본문 블록을 클라이언트에게 보내고 1, 미스면 0 */
+int serve_hit(int connfd, request_t *req, const char *vary) {
+    cache_entry_t *entry = cache_find(&req->key);
+    if (entry && entry->is_complete) {
+        count_hit(entry, req, vary);
+        count_numa_hit(entry->body);
 
-/* 캐시 해제 함수 */
-void cache_free(void) {
-    pthread_mutex_lock(&cache.mutex);
-    for (int i = 0; i < cache.max_entries; i++) {
-        if (cache.entries[i].is_valid) {
-            Free(cache.entries[i].url);
-            Free(cache.entries[i].content);
+        // gzip을 받는 클라이언트에는 압축 변형을 보냄 (처음 한 번만 압축)
+        if (!entry->negative && accepts_gzip(req->accept_encoding) &&
+            (entry->gz ||
+             (!entry->gz_checked && gzip_compressible(entry->headers, entry->body->size)))) {
+            serve_gzip_hit(connfd, entry, req);
+            return 1;
         }
-        pthread_rwlock_destroy(&cache.entries[i].rwlock);
+        send_cached_entry(connfd, entry);
+        if (config.hot && !entry->negative) hot_note(entry, req);
+        cache_read_complete(entry);
+        return 1;
     }
-    Free(cache.entries);
-    pthread_mutex_unlock(&cache.mutex);
-    pthread_mutex_destroy(&cache.mutex);
+    // 일부 블록만 있는 항목은 전체 요청에 쓸 수 없으므로 미스로 처리
+    if (entry) cache_read_complete(entry);
+
+    // 다른 워커 프로세스가 공유 메모리 캐시에 넣어 둔 객체
+    if (shm && shm_serve(connfd, req)) return 1;
+    return 0;
 }
 
-/* 현재 시간 반환 */
-unsigned long get_timestamp(void) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000000 + tv.tv_usec;
+/* 히트 통계 (entry는 읽기 락을 잡은 상태) */
+void count_hit(cache_entry_t *entry, request_t *req, const char *vary) {
+    printf("Cache hit for %s\n", req->key.str);
+    STAT_ADD(cache_hits, 1);
+    if (vary[0]) STAT_ADD(vary_hits, 1);
+    // 정규화 없이는 키가 달라 미스였을 히트
+    if (entry->raw_hash != req->key.raw_hash) STAT_ADD(norm_hits, 1);
+    if (entry->negative) STAT_ADD(negative_hits, 1);
+    __atomic_fetch_add(&entry->origin->hits, 1, __ATOMIC_RELAXED);
 }
 
-/* 캐시에서 URL에 해당하는 항목 찾기 */
-cache_entry_t *cache_find(char *url) {
-    pthread_mutex_lock(&cache.mutex);
-    for (int i = 0; i < cache.max_entries; i++) {
-        if (cache.entries[i].is_valid && strcmp(cache.entries[i].url, url) == 0) {
-            // 읽기 락 획득
-            pthread_rwlock_rdlock(&cache.entries[i].rwlock);
-            // 타임스탬프 갱신
-            cache.entries[i].timestamp = get_timestamp();
-            pthread_mutex_unlock(&cache.mutex);
-            return &cache.entries[i];
+/* 본문 블록이 보내는 스레드와 같은 노드에 있는지 기록 */
+void count_numa_hit(cache_body_t *body) {
+    if (body->num_blocks > 0 && block_in_arena(body->blocks[0])) {
+        if (block_arena(body->blocks[0]) == numa_current_node()) {
+            STAT_ADD(numa_local_hits, 1);
+        } else {
+            STAT_ADD(numa_remote_hits, 1);
         }
     }
-    pthread_mutex_unlock(&cache.mutex);
-    return NULL;
 }
 
-/* 캐시 항목 읽기 완료 */
-void cache_read_complete(cache_entry_t *entry) {
-    pthread_rwlock_unlock(&entry->rwlock);
-}
+/*
+ * 분할 워커의 히트 조회. 보낼 헤더를 복사하고 본문을 고정해 hit에 담으면 HIT_READY,
+ * gzip 변형을 처음 만들어야 하면 HIT_DIRECT, 미스면 HIT_MISS. 소켓에는 쓰지 않는다.
+ */
+int hit_take(request_t *req, const char *vary, cache_hit_t *hit) {
+    cache_entry_t *entry = cache_find(&req->key);
+    int gzip;
 
-/* LRU 정책에 따라 캐시에서 항목 제거 */
-void cache_evict_lru(size_t required_size) {
-    unsigned long min_timestamp = ULONG_MAX;
-    int lru_index = -1;
-
-    // 가장 오래 사용되지 않은 항목 찾기
-    for (int i = 0; i < cache.max_entries; i++) {
-        if (cache.entries[i].is_valid && cache.entries[i].timestamp < min_timestamp) {
-            min_timestamp = cache.entries[i].timestamp;
-            lru_index = i;
-        }
+    if (!entry) return HIT_MISS;
+    if (!entry->is_complete) {
+        cache_read_complete(entry);
+        return HIT_MISS;
     }
-
-    if (lru_index != -1) {
-        // 쓰기 락 획득
-        pthread_rwlock_wrlock(&cache.entries[lru_index].rwlock);
-        
-        // 해당 항목의 메모리 해제
-        Free(cache.entries[lru_index].url);
-        Free(cache.entries[lru_index].content);
-        
-        // 캐시 항목 무효화
-        cache.entries[lru_index].url = NULL;
-        cache.entries[lru_index].content = NULL;
-        cache.entries[lru_index].is_valid = 0;
-        
-        // 캐시 크기 갱신
-        cache.current_size -= cache.entries[lru_index].content_size;
-        cache.num_entries--;
-        
-        // 쓰기 락 해제
-        pthread_rwlock_unlock(&cache.entries[lru_index].rwlock);
-    }
-}
-
-/* 캐시에 새로운 항목 추가 */
-void cache_add(char *url, char *content, size_t content_size) {
-    if (content_size > MAX_OBJECT_SIZE) {
-        return; // 최대 객체 크기 초과하면 캐시하지 않음
+    gzip = !entry->negative && accepts_gzip(req->accept_encoding);
+    if (gzip && !entry->gz && !entry->gz_checked &&
+        gzip_compressible(entry->headers, entry->body->size)) {
+        cache_read_complete(entry);
+        return HIT_DIRECT;
     }
 
-    pthread_mutex_lock(&cache.mutex);
-
-    // 필요한 경우 공간 확보
-    while (cache.current_size + content_size > MAX_CACHE_SIZE || cache.num_entries >= cache.max_entries) {
-        cache_evict_lru(content_size);
+    count_hit(entry, req, vary);
+    if (gzip && entry->gz) {
+        // 압축 변형도 붙인 뒤에는 바뀌지 않으므로 헤더까지 고정만 해서 넘김
+        hit->body = NULL;
+        hit->gz = entry->gz;
+        __atomic_add_fetch(&entry->gz->pins, 1, __ATOMIC_RELAXED);
+        STAT_ADD(gzip_served, 1);
+    } else {
+        // 완성된 본문은 읽기 전용이므로 고정만 해 두면 항목이 지워져도 보낼 수 있음
+        hit->headers_size = entry->headers_size;
+        memcpy(hit->headers, entry->headers, entry->headers_size);
+        hit->gz = NULL;
+        hit->body = entry->body;
+        __atomic_add_fetch(&entry->body->pins, 1, __ATOMIC_RELAXED);
+        if (config.hot && !entry->negative) hot_note(entry, req);
     }
+    cache_read_complete(entry);
+    return HIT_READY;
+}
 
-    // 빈 슬롯 찾기
-    int empty_slot = -1;
-    for (int i = 0; i < cache.max_entries; i++) {
-        if (!cache.entries[i].is_valid) {
-            empty_slot = i;
-            break;
+/* 분할 워커가 넘긴 히트를 보내고 본문이나 gzip 변형의 고정을 놓아줌 (요청 스레드) */
+void hit_send(int connfd, cache_hit_t *hit) {
+    if (hit->body) {
+        count_numa_hit(hit->body);
+        send_cached_body(connfd, hit->body, hit->headers, hit->headers_size);
+        body_unpin(hit->body);
+    } else {
+        if (rio_writen(connfd, hit->gz->headers, hit->gz->headers_size) == hit->gz->headers_size) {
+            rio_writen(connfd, hit->gz->content, hit->gz->size);
         }
+        gzip_unpin(hit->gz);
     }
+}
 
-    if (empty_slot == -1) {
-        pthread_mutex_unlock(&cache.mutex);
+/* 클라이언트 요청 헤더를 읽어 전달할 헤더와 Range 관련 헤더로 분류 */
+void read_request_headers(rio_t *rp, request_t *req) {
+    char buf[MAXLINE];
+
+    req->host_hdr[0] = '\0';
+    req->other_hdrs[0] = '\0';
+    req->range[0] = '\0';
+    req->if_range[0] = '\0';
+    req->accept_encoding[0] = '\0';
+    req->from_peer = 0;
+    req->peer = -1;
+
+    while (Rio_readlineb(rp, buf, MAXLINE) > 0) {
+        // 헤더의 끝 확인 (빈 줄)
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) break;
+
+        // Host 헤더 확인
+        if (!strncasecmp(buf, "Host:", 5)) {
+            strcpy(req->host_hdr, buf);
+        }
+        // Connection 또는 Proxy-Connection 헤더는 건너뜀
+        else if (!strncasecmp(buf, "Connection:", 11) ||
+                 !strncasecmp(buf, "Proxy-Connection:", 17)) {
+            continue;
+        }
+        // User-Agent 헤더는 건너뜀 (나중에 추가됨)
+        else if (!strncasecmp(buf, "User-Agent:", 11)) {
+            continue;
+        }
+        // 피어가 넘긴 요청은 다시 다른 피어로 넘기지 않음 (헤더는 원 서버에 보내지 않음)
+        else if (!strncasecmp(buf, PEER_HDR ":", sizeof(PEER_HDR))) {
+            req->from_peer = 1;
+        }
+        // Range / If-Range는 프록시가 직접 처리하므로 원 서버에 그대로 넘기지 않음
+        else if (!strncasecmp(buf, "Range:", 6) || !strncasecmp(buf, "If-Range:", 9)) {
+            char *dst = (buf[0] == 'R' || buf[0] == 'r') ? req->range : req->if_range;
+            char *val = strchr(buf, ':') + 1;
+            while (*val == ' ' || *val == '\t') val++;
+            strcpy(dst, val);
+            dst[strcspn(dst, "\r\n")] = '\0';
+        }
+        // Accept-Encoding은 프록시가 직접 협상 (원 서버에는 항상 압축 안 된 본문을 요청)
+        else if (!strncasecmp(buf, "Accept-Encoding:", 16)) {
+            char *val = buf + 16;
+            while (*val == ' ' || *val == '\t') val++;
+            strcpy(req->accept_encoding, val);
+            req->accept_encoding[strcspn(req->accept_encoding, "\r\n")] = '\0';
+        }
+        // 그 외 헤더는 그대로 전달
+        else if (strlen(req->other_hdrs) + strlen(buf) < MAXLINE) {
+            strcat(req->other_hdrs, buf);
+        }
+    }
+}
+
+/*
+ * open_clientfd와 같지만 비차단 connect로 timeout_ms 안에 연결하지 못하면 포기 (0이면 open_clientfd).
+ * 실패하면 -1 (연결 실패), -2 (이름 해석 실패), TIMEOUT_RC (시간 초과)
+ */
+int open_clientfd_timeout(char *hostname, char *port, long timeout_ms) {
+    return open_clientfd_watch(hostname, port, timeout_ms, -1);
+}
+
+/*
+ * open_clientfd_timeout과 같지만 연결을 기다리는 사이 watchfd(-1이면 없음)에 읽을 것이 생기면
+ * 연결을 그만두고 ANSWERED_RC (timeout_ms가 0이면 시간 제한 없이 기다림)
+ */
+int open_clientfd_watch(char *hostname, char *port, long timeout_ms, int watchfd) {
+    struct addrinfo hints, *listp, *p;
+    unsigned long deadline = now_msec() + timeout_ms;
+    int fd, flags, rc;
+
+    if (timeout_ms <= 0 && watchfd < 0) return open_clientfd(hostname, port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+        return -2;
+    }
+
+    // 주소마다 남은 시간 안에서 연결 시도
+    rc = -1;
+    for (p = listp; p; p = p->ai_next) {
+        long left = timeout_ms > 0 ? (long)(deadline - now_msec()) : -1;
+        struct pollfd pfd[2];
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (timeout_ms > 0 && left <= 0) {
+            rc = TIMEOUT_RC;
+            break;
+        }
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+        flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+            if (errno != EINPROGRESS) {
+                close(fd);
+                rc = -1;
+                continue;
+            }
+            pfd[0].fd = fd;
+            pfd[0].events = POLLOUT;
+            pfd[1].fd = watchfd;  // 음수면 poll이 건너뜀
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            if ((rc = poll(pfd, 2, left)) > 0 && pfd[1].revents) {
+                close(fd);
+                rc = ANSWERED_RC;
+                break;
+            }
+            if (rc <= 0) {
+                close(fd);
+                rc = rc == 0 ? TIMEOUT_RC : -1;
+                continue;
+            }
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                close(fd);
+                rc = -1;
+                continue;
+            }
+        }
+        fcntl(fd, F_SETFL, flags);
+        freeaddrinfo(listp);
+        return fd;
+    }
+    freeaddrinfo(listp);
+    return rc;
+}
+
+/*
+ * 원 서버에 연결 (응답 헤더가 늦거나 응답이 멈추면 끊도록 시간 제한을 검).
+ * 실패하면 open_clientfd처럼 -1 (연결 실패) 또는 -2 (이름 해석 실패),
+ * 연결 시간 제한을 넘으면 TIMEOUT_RC, 회로가 열려 연결하지 않았으면 BREAKER_OPEN_RC
+ */
+int connect_origin(request_t *req) {
+    return connect_origin_watch(req, NULL, -1, config.connect_timeout * 1000);
+}
+
+/*
+ * connect_origin과 같지만 연결 시간 제한이 timeout_ms이고, hedge용으로 묶음이면 skip 백엔드는
+ * 고르지 않으며 연결하는 사이 watchfd(첫 연결)에 응답이 오면 그만두고 ANSWERED_RC.
+ * watchfd가 있으면 첫 연결이 살아 있으므로 연결 실패를 원 서버 실패로 기록하지 않음
+ */
+int connect_origin_watch(request_t *req, backend_t *skip, int watchfd, long timeout_ms) {
+    int serverfd;
+
+    // 최근에 연결하지 못한 원 서버면 다시 시도하지 않고 바로 실패
+    if ((serverfd = origin_failure_find(req)) < 0) {
+        STAT_ADD(origin_fail_hits, 1);
+        return serverfd;
+    }
+
+    // 복제 백엔드가 있는 원 서버면 회로가 닫힌 백엔드 중 하나로 (Host 헤더는 그대로)
+    backend_pool_t *pool = pool_find(req);
+    if (pool) {
+        serverfd = backend_connect(pool, skip ? 1u << (skip - pool->backends) : 0, watchfd, timeout_ms);
+    } else {
+        breaker_t *br = breaker_get(req->hostname, req->port);  // 표가 차 있으면 NULL (회로 없이 연결)
+        int allow = br ? breaker_allow(br) : 1;
+        if (!allow) {
+            serverfd = BREAKER_OPEN_RC;
+            breaker_put(br);
+        } else if ((serverfd = open_clientfd_watch(req->hostname, req->port, timeout_ms, watchfd)) < 0) {
+            if (serverfd == ANSWERED_RC) breaker_cancel(br, allow == BREAKER_TRIAL);
+            else breaker_result(br, 0, allow == BREAKER_TRIAL);
+            breaker_put(br);
+        } else {
+            upstream_track(br, NULL, allow == BREAKER_TRIAL);
+        }
+    }
+    if (serverfd == ANSWERED_RC) return serverfd;
+    if (serverfd == BREAKER_OPEN_RC) {
+        if (watchfd < 0) printf("Circuit open for %s:%s, failing fast.\n", req->hostname, req->port);
+        return serverfd;
+    }
+    if (serverfd < 0) {
+        printf("Connection to server %s:%s failed.\n", req->hostname, req->port);
+        if (serverfd == TIMEOUT_RC) STAT_ADD(connect_timeouts, 1);
+        if (watchfd >= 0) return serverfd;
+        STAT_ADD(origin_failures, 1);
+        // 시간 초과는 이 요청에서만 504로 답하고, 기록에는 연결 실패로 남김 (이후 요청은 502)
+        origin_failure_add(req, serverfd == TIMEOUT_RC ? -1 : serverfd);
+        return serverfd;
+    }
+    // 응답 헤더가 올 때까지는 첫 바이트 시간 제한, 그 뒤로는 유휴 시간 제한 (read_response_headers)
+    deadline_start(&upstream_deadline, serverfd, config.first_byte_timeout * 1000,
+                   &stats.first_byte_timeouts);
+    return serverfd;
+}
+
+/* 원 서버에 연결하지 못했을 때 클라이언트에 502 응답 */
+void send_origin_error(int connfd, request_t *req, int rc) {
+    char body[MAXLINE];
+
+    if (rc == TIMEOUT_RC) {
+        snprintf(body, sizeof(body), "Timed out waiting for origin %.255s:%s\n", req->hostname, req->port);
+        send_text(connfd, "504 Gateway Timeout", body);
+        STAT_ADD(gateway_timeouts, 1);
+        return;
+    }
+    if (rc == BREAKER_OPEN_RC) {
+        snprintf(body, sizeof(body), "Circuit open for origin %.255s:%s\n", req->hostname, req->port);
+        send_text(connfd, "503 Service Unavailable", body);
+        return;
+    }
+    // 호스트 이름은 DNS 이름 최대 길이까지만 표시
+    snprintf(body, sizeof(body), "%s %.255s:%s\n",
+             rc == -2 ? "Cannot resolve origin" : "Cannot connect to origin", req->hostname, req->port);
+    send_text(connfd, "502 Bad Gateway", body);
+}
+
+/* 원 서버 연결 종료 */
+int close_origin(int serverfd) {
+    int fired = deadline_stop(&upstream_deadline);
+
+    if (fired) printf("Origin response stalled, connection dropped.\n");
+    upstream_done();
+    Close(serverfd);
+    return fired;
+}
+
+/* 캐시 미스: 원 서버의 응답을 클라이언트에게 전달하면서 캐싱 */
+void forward_request(int connfd, request_t *req) {
+    char buf[MAXLINE], request_hdrs[MAXLINE];
+    char hdrs[MAXBUF], vary[MAXLINE];
+    int serverfd, status;
+    ssize_t hdr_len;
+
+    // 이 URL을 맡은 피어가 따로 있으면 그 피어에게 먼저 물음.
+    // 서버 연결 (실패하면 유예 중인 만료 사본, 그것도 없으면 502)
+    if ((serverfd = connect_peer(req)) < 0) serverfd = connect_origin(req);
+    if (serverfd < 0) {
+        if (!serve_stale(connfd, req)) send_origin_error(connfd, req, serverfd);
+        return;
+    }
+
+    // 서버에 보낼 HTTP 요청 헤더 작성
+    build_http_header(request_hdrs, req, NULL);
+    printf("Forwarding request to %s %s:%s\n%s", req->peer >= 0 ? "peer" : "server",
+           req->peer >= 0 ? peers[req->peer].host : req->hostname,
+           req->peer >= 0 ? peers[req->peer].port : req->port, request_hdrs);
+
+    // 서버에 요청 전송 (피어가 응답하지 않으면 원 서버로 다시 시도)
+    rio_t rio_server;
+    if (rio_writen(serverfd, request_hdrs, strlen(request_hdrs)) < 0) {
+        hdr_len = -1;
+    } else {
+        // 응답이 늦으면 다른 백엔드나 연결에 같은 요청을 한 번 더 보내 먼저 오는 쪽을 씀
+        serverfd = hedge_request(req, serverfd, request_hdrs);
+        Rio_readinitb(&rio_server, serverfd);
+        hdr_len = read_response_headers(&rio_server, hdrs, sizeof(hdrs), &status);
+    }
+    if (hdr_len < 0) {
+        int timed_out = close_origin(serverfd);
+        if (req->peer >= 0) {
+            peer_failed(req);
+            forward_request(connfd, req);
+            return;
+        }
+        // 시간 제한 안에 응답 헤더가 오지 않았으면 504
+        if (!serve_stale(connfd, req) && timed_out) send_origin_error(connfd, req, TIMEOUT_RC);
+        return;
+    }
+
+    // 원 서버 오류(5xx)도 만료 사본이 있으면 그것으로 대신함
+    if (status >= 500 && serve_stale(connfd, req)) {
+        close_origin(serverfd);
+        return;
+    }
+
+    // 응답 헤더를 그대로 전달
+    if (rio_writen(connfd, hdrs, hdr_len) != hdr_len) {
+        close_origin(serverfd);
+        return;
+    }
+
+    // 서버로부터 응답을 받아 클라이언트에게 전달하고 캐싱
+    ssize_t n = 0;
+    size_t total_size, avail;
+    chain_t chain;
+    char *p;
+    // 객체가 캐시 가능한지 여부 (200 응답과, 짧게 캐싱하는 404/5xx 오류 응답)
+    int negative = negative_status(status);
+    int cacheable = (status == 200 || negative);
+
+    // 피어가 보낸 응답은 그 피어의 캐시에 있으므로 여기에는 두지 않음 (클러스터 전체에 한 벌)
+    if (req->peer >= 0) cacheable = 0;
+
+    // 응답의 Vary에 맞춰 캐시 키를 다시 만듦 (Vary: *이면 캐싱하지 않음)
+    if (vary_names(hdrs, vary, sizeof(vary)) < 0) {
+        cacheable = 0;
+    } else {
+        make_cache_key(req, vary);
+    }
+
+    // 응답을 캐시 블록에 바로 읽어 그 블록에서 전달 (최대 객체 크기를 넘으면 체인이 캡처를 멈춤)
+    chain_init(&chain, cacheable);
+    while ((p = chain_space(&chain, &avail)) && (n = rio_readnb(&rio_server, p, avail)) > 0) {
+        deadline_touch(&upstream_deadline);
+        // 클라이언트에게 전송 (클라이언트가 끊으면 중단)
+        if (rio_writen(connfd, p, n) != n) {
+            cacheable = 0;
+            break;
+        }
+        chain_commit(&chain, n);
+    }
+    if (n < 0 || !chain.capture) cacheable = 0;
+    total_size = chain.size;
+
+    // Content-Length와 실제 받은 크기가 다르면 잘린 응답이므로 캐싱하지 않음
+    if (hdr_get(hdrs, "Content-Length", buf, sizeof(buf)) && strtoull(buf, NULL, 10) != total_size) {
+        cacheable = 0;
+    }
+
+    // 모든 응답을 받았으면 캐시에 저장 (오류 응답은 상태줄을 그대로 둠)
+    if (cacheable && (total_size > 0 || negative)) {
+        if (negative) {
+            snprintf(buf, sizeof(buf), "%zu", total_size);
+            hdr_set(hdrs, sizeof(hdrs), "Content-length", buf);
+        } else {
+            make_entry_headers(hdrs, sizeof(hdrs), total_size);
+        }
+        cache_add(&req->key, hdrs, &chain);
+        printf("Cached %zu bytes for %s\n", total_size, req->key.str);
+    }
+    chain_release(&chain);
+
+    close_origin(serverfd);
+}
+
+/* 캐시된 헤더와 본문 블록 전송 (entry는 읽기 락을 잡은 상태) */
+void send_cached_entry(int connfd, cache_entry_t *entry) {
+    send_cached_body(connfd, entry->body, entry->headers, entry->headers_size);
+}
+
+/* 주어진 헤더 뒤에 캐시된 본문 블록 전송 (본문의 항목 읽기 락을 잡았거나 본문을 고정한 상태) */
+void send_cached_body(int connfd, cache_body_t *body, const char *hdrs, size_t hdrs_size) {
+    char tmp[CACHE_BLOCK_SIZE];
+    unsigned long nsec = 0;
+
+    if (rio_writen(connfd, (void *)hdrs, hdrs_size) == hdrs_size) {
+        // 압축된 블록은 하나씩 풀면서 전송
+        for (int i = 0; i < body->num_blocks; i++) {
+            size_t len = cache_block_len(body->size, i);
+            if (rio_writen(connfd, (void *)cache_block_data(body, i, tmp, &nsec), len) != len) break;
+        }
+    }
+    if (body->lz_mode == 1) {
+        STAT_ADD(lz_hits, 1);
+        STAT_ADD(lz_decompress_nsec, nsec);
+    }
+}
+
+int parse_uri(char *uri, char *hostname, char *path, char *port) {
+    char *hostbegin, *hostend, *pathbegin;
+
+    // URI에 http:// 접두사가 없는 경우 (driver.sh는 완전한 URL을 요구함)
+    if (strncasecmp(uri, "http://", 7) != 0) {
+        // 이미 경로만 있는 경우 (예: /home.html)
+        if (uri[0] == '/') {
+            // localhost로 간주하고 기본 경로 사용
+            strcpy(hostname, "localhost");
+            strcpy(path, uri);
+            strcpy(port, "80");
+            return 0;
+        }
+        fprintf(stderr, "Error: Invalid URI format (no http://): %s\n", uri);
+        return -1;
+    }
+
+    // http:// 이후의 호스트 시작 위치
+    hostbegin = uri + 7;
+
+    // 경로 부분 찾기 (첫 번째 '/')
+    pathbegin = strchr(hostbegin, '/');
+
+    if (pathbegin) {
+        // 호스트 부분의 마지막 위치
+        hostend = pathbegin;
+        // 경로 복사
+        strcpy(path, pathbegin);
+    } else {
+        // 경로가 없으면 루트 경로로 설정
+        hostend = hostbegin + strlen(hostbegin);
+        strcpy(path, "/");
+    }
+
+    // 임시 호스트 문자열 생성 및 복사
+    char hostcopy[MAXLINE];
+    strncpy(hostcopy, hostbegin, hostend - hostbegin);
+    hostcopy[hostend - hostbegin] = '\0';
+
+    // 호스트에서 포트 번호 분리
+    char *portPos = strchr(hostcopy, ':');
+    if (portPos) {
+        *portPos = '\0';
+        strcpy(hostname, hostcopy);
+        strcpy(port, portPos + 1);
+    } else {
+        strcpy(hostname, hostcopy);
+        strcpy(port, "80");
+    }
+
+    printf("Parsed URI - Host: '%s', Path: '%s', Port: '%s'\n", hostname, path, port);
+    return 0;
+}
+
+/* 원 서버로 보낼 요청 헤더 작성 (range가 NULL이 아니면 Range 헤더 추가) */
+void build_http_header(char *http_header, request_t *req, const char *range) {
+    char buf[MAXLINE];
+
+    // 피어 프록시에는 절대 URI로 요청
+    if (req->peer >= 0) {
+        snprintf(http_header, MAXLINE, "GET http://%.*s:%s%.*s HTTP/1.0\r\n", PEER_HOST_MAX, req->hostname,
+                 req->port, PEER_PATH_MAX, req->path);
+    } else {
+        snprintf(http_header, MAXLINE, "GET %.*s HTTP/1.0\r\n", MAXLINE - 16, req->path);
+    }
+    if (req->host_hdr[0]) {
+        strcat(http_header, req->host_hdr);
+    } else {
+        snprintf(buf, MAXLINE, "Host: %.*s\r\n", MAXLINE - 9, req->hostname);
+        strcat(http_header, buf);
+    }
+    strcat(http_header, user_agent_hdr);
+    strcat(http_header, "Connection: close\r\n");
+    strcat(http_header, "Proxy-Connection: close\r\n");
+    if (range) {
+        snprintf(buf, MAXLINE, "Range: bytes=%s\r\n", range);
+        strcat(http_header, buf);
+    }
+    if (req->peer >= 0) {
+        snprintf(buf, MAXLINE, PEER_HDR ": %.*s:%s\r\n", PEER_HOST_MAX, peers[peer_self].host,
+                 peers[peer_self].port);
+        strcat(http_header, buf);
+    }
+    if (strlen(http_header) + strlen(req->other_hdrs) + 2 < MAXLINE) {
+        strcat(http_header, req->other_hdrs);
+    }
+    strcat(http_header, "\r\n");  // 헤더의 끝
+}
+
+/* 스레드 함수 구현 */
+void *thread(void *vargp) {
+    thread_args *args = (thread_args *)vargp;
+    int connfd = args->connfd;
+
+    // 스레드를 detach 상태로 만들어 자원을 자동으로 반환하도록 함
+    Pthread_detach(pthread_self());
+
+    // 메모리 누수 방지를 위해 할당된 인자 구조체 해제
+    Free(vargp);
+
+    // 클라이언트 요청 처리 (요청을 다 읽을 때까지 유휴 시간 제한)
+    deadline_start(&client_deadline, connfd, config.client_timeout * 1000, &stats.client_timeouts);
+    doit(connfd);
+    deadline_stop(&client_deadline);
+
+    // 연결 종료
+    Close(connfd);
+
+    return NULL;
+}
+
+/*
+ * 응답 헤더 처리
+ *
+ * 헤더 블록은 "상태줄\r\n헤더: 값\r\n...\r\n\r\n" 형태의 NUL 종료 문자열이다.
+ */
+
+/* 서버 응답의 상태줄과 헤더를 읽어 CRLF 형태로 모은다. 헤더 길이 반환, 실패 시 -1 */
+ssize_t read_response_headers(rio_t *rp, char *hdrs, size_t cap, int *status) {
+    char line[MAXLINE];
+    size_t len = 0, n;
+    int first = 1;
+
+    hdrs[0] = '\0';
+    while (rio_readlineb(rp, line, MAXLINE) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        n = strlen(line);
+        if (len + n + 3 > cap) return -1;  // 헤더가 너무 큼
+        memcpy(hdrs + len, line, n);
+        memcpy(hdrs + len + n, "\r\n", 3);
+        len += n + 2;
+
+        if (first) {
+            if (sscanf(line, "HTTP/%*s %d", status) != 1) return -1;
+            first = 0;
+        } else if (n == 0) {
+            upstream_response(*status);
+            // 응답이 오기 시작했으므로 이제부터는 본문 중계의 유휴 시간 제한
+            deadline_phase(&upstream_deadline, config.upstream_timeout * 1000, &stats.upstream_timeouts);
+            return len;  // 빈 줄: 헤더 끝
+        }
+    }
+    return -1;
+}
+
+/* 헤더 블록에서 name 헤더의 값을 찾아 val에 복사. 찾으면 1, 없으면 0 */
+int hdr_get(const char *hdrs, const char *name, char *val, size_t vlen) {
+    size_t nlen = strlen(name);
+    const char *p = strstr(hdrs, "\r\n");  // 상태줄 건너뜀
+
+    while (p && p[2] != '\r' && p[2] != '\0') {
+        p += 2;
+        const char *eol = strstr(p, "\r\n");
+        if (!eol) break;
+        if (!strncasecmp(p, name, nlen) && p[nlen] == ':') {
+            const char *v = p + nlen + 1;
+            while (*v == ' ' || *v == '\t') v++;
+            size_t n = eol - v;
+            while (n > 0 && (v[n - 1] == ' ' || v[n - 1] == '\t')) n--;
+            if (n >= vlen) n = vlen - 1;
+            memcpy(val, v, n);
+            val[n] = '\0';
+            return 1;
+        }
+        p = eol;
+    }
+    return 0;
+}
+
+/* 헤더 블록에서 name 헤더 줄을 모두 삭제 */
+void hdr_del(char *hdrs, const char *name) {
+    size_t nlen = strlen(name);
+    char *p = strstr(hdrs, "\r\n");
+
+    while (p && p[2] != '\r' && p[2] != '\0') {
+        char *line = p + 2;
+        char *eol = strstr(line, "\r\n");
+        if (!eol) break;
+        if (!strncasecmp(line, name, nlen) && line[nlen] == ':') {
+            memmove(line, eol + 2, strlen(eol + 2) + 1);
+            continue;  // 같은 위치에서 다시 검사
+        }
+        p = eol;
+    }
+}
+
+/* name 헤더를 val로 설정 (기존 값은 삭제하고 헤더 끝에 추가) */
+void hdr_set(char *hdrs, size_t cap, const char *name, const char *val) {
+    char line[MAXLINE];
+    size_t len, llen;
+
+    hdr_del(hdrs, name);
+    llen = snprintf(line, sizeof(line), "%s: %s\r\n", name, val);
+    len = strlen(hdrs);
+    if (len < 2 || len + llen + 1 > cap) return;
+    // 마지막 빈 줄("\r\n") 앞에 삽입
+    memcpy(hdrs + len - 2, line, llen);
+    memcpy(hdrs + len - 2 + llen, "\r\n", 3);
+}
+
+/* 상태줄을 status_line으로 교체 */
+void hdr_set_status(char *hdrs, size_t cap, const char *status_line) {
+    char *eol = strstr(hdrs, "\r\n");
+    size_t slen = strlen(status_line);
+
+    if (!eol || strlen(hdrs) - (eol - hdrs) + slen + 1 > cap) return;
+    memmove(hdrs + slen, eol, strlen(eol) + 1);
+    memcpy(hdrs, status_line, slen);
+}
+
+/* 캐시에 저장할 헤더로 정리 (200 OK, 전체 길이, Range 지원 표시) */
+void make_entry_headers(char *hdrs, size_t cap, size_t size) {
+    char buf[32];
+
+    hdr_set_status(hdrs, cap, "HTTP/1.0 200 OK");
+    hdr_del(hdrs, "Content-Range");
+    snprintf(buf, sizeof(buf), "%zu", size);
+    hdr_set(hdrs, cap, "Content-length", buf);
+    hdr_set(hdrs, cap, "Accept-Ranges", "bytes");
+    // 압축 협상 대상이면 캐시가 Accept-Encoding에 따라 다른 응답을 준다고 표시
+    if (gzip_compressible(hdrs, size)) hdr_add_vary(hdrs, cap, "Accept-Encoding");
+}
+
+/* Vary 헤더에 name이 없으면 추가 */
+void hdr_add_vary(char *hdrs, size_t cap, const char *name) {
+    char val[MAXLINE], buf[MAXLINE];
+    size_t nlen = strlen(name);
+
+    if (!hdr_get(hdrs, "Vary", val, sizeof(val)) || !val[0]) {
+        hdr_set(hdrs, cap, "Vary", name);
+        return;
+    }
+    for (char *p = val; *p; p++) {
+        if (!strncasecmp(p, name, nlen) && (p == val || p[-1] == ' ' || p[-1] == ',') &&
+            (p[nlen] == '\0' || p[nlen] == ',' || p[nlen] == ' ')) {
+            return;  // 이미 있음
+        }
+    }
+    if (snprintf(buf, sizeof(buf), "%s, %s", val, name) >= (int)sizeof(buf)) return;  // 들어가지 않음
+    hdr_set(hdrs, cap, "Vary", buf);
+}
+
+/*
+ * Vary 변형
+ *
+ * 원 서버가 Vary로 알려준 요청 헤더의 값을 URL 뒤에 붙여 캐시 키를 만들고, 변형마다
+ * 다른 항목으로 저장한다. 키는 "URL 이름=값;이름=값;" 형태이고, URL별 Vary 목록은
+ * 캐시의 URL 색인에 기록된다. Accept-Encoding은 프록시가 직접 협상하고 원 서버에는
+ * 보내지 않으므로 키에 넣지 않는다.
+ */
+
+/* 헤더 블록의 Vary 값을 소문자 이름 목록("a,b")으로 정리. Vary: *이면 -1 */
+int vary_names(const char *hdrs, char *names, size_t cap) {
+    char val[MAXLINE], *tok, *save;
+    size_t len = 0, n;
+
+    names[0] = '\0';
+    if (!hdr_get(hdrs, "Vary", val, sizeof(val))) return 0;
+    for (tok = strtok_r(val, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save)) {
+        if (!strcmp(tok, "*")) return -1;
+        if (!strcasecmp(tok, "Accept-Encoding")) continue;
+        n = strlen(tok);
+        if (len + n + 2 > cap) return -1;  // 너무 길면 캐싱하지 않음
+        if (len) names[len++] = ',';
+        for (size_t i = 0; i < n; i++) names[len++] = tolower((unsigned char)tok[i]);
+        names[len] = '\0';
+    }
+    return 0;
+}
+
+/* 전달할 클라이언트 헤더(other_hdrs)에서 name 헤더의 값을 찾음. 찾으면 1, 없으면 0 */
+int req_hdr_get(request_t *req, const char *name, char *val, size_t vlen) {
+    size_t nlen = strlen(name);
+
+    for (char *p = req->other_hdrs; *p; ) {
+        char *eol = strchr(p, '\n');
+        size_t llen = eol ? (size_t)(eol - p) : strlen(p);
+        if (!strncasecmp(p, name, nlen) && p[nlen] == ':') {
+            char *v = p + nlen + 1;
+            size_t n = llen - nlen - 1;
+            while (n > 0 && (*v == ' ' || *v == '\t')) v++, n--;
+            while (n > 0 && (v[n - 1] == ' ' || v[n - 1] == '\t' || v[n - 1] == '\r')) n--;
+            if (n >= vlen) n = vlen - 1;
+            memcpy(val, v, n);
+            val[n] = '\0';
+            return 1;
+        }
+        if (!eol) break;
+        p = eol + 1;
+    }
+    return 0;
+}
+
+/*
+ * names 목록의 요청 헤더 값으로 캐시 키 작성 (url_key와 URL 해시는 canonicalize_url에서
+ * 이미 정해짐). 키가 너무 길면 빈 문자열 (캐싱 안 함)
+ */
+void make_cache_key(request_t *req, const char *names) {
+    cache_key_t *key = &req->key;
+    char list[MAXLINE], val[MAXLINE], *tok, *save;
+    size_t len = key->url_len;
+
+    strcpy(key->str, req->url_key);
+    if (names[0]) {
+        key->str[len++] = ' ';
+        strcpy(list, names);
+        for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+            if (!req_hdr_get(req, tok, val, sizeof(val))) val[0] = '\0';
+            len += snprintf(key->str + len, MAXLINE - len, "%s=%s;", tok, val);
+            if (len >= MAXLINE) {
+                key->str[0] = '\0';
+                return;
+            }
+        }
+    }
+    key->hash = names[0] ? str_hash(key->str, len) : key->url_hash;
+}
+
+/*
+ * 캐시 키 정규화
+ *
+ * 같은 자원을 가리키는 URL 표기를 하나로 모은다: 스킴과 호스트는 소문자, 기본 포트(80)는
+ * 생략, 퍼센트 인코딩은 대문자 16진수로 (안전 문자는 디코딩), 경로의 "."/".." 세그먼트는
+ * 풀고, 설정에 따라 쿼리 파라미터를 빼거나 정렬한다. 정규화는 캐시 키에만 쓰이고 원 서버에는
+ * 클라이언트가 보낸 경로 그대로 요청한다.
+ */
+
+/* req의 호스트, 포트, 경로로 정규화된 url_key와 키 해시 계산 */
+void canonicalize_url(request_t *req) {
+    char raw[MAXLINE], host[MAXLINE], path[MAXLINE], *query;
+    size_t n;
+
+    // 정규화 전 키 (정규화 효과 측정용)
+    n = snprintf(raw, sizeof(raw), "http://%s:%s%s", req->hostname, req->port, req->path);
+    req->key.raw_hash = str_hash(raw, n < sizeof(raw) ? n : sizeof(raw) - 1);
+
+    // 호스트: 소문자, 끝의 '.' 제거
+    n = 0;
+    for (char *p = req->hostname; *p && n < sizeof(host) - 1; p++) host[n++] = tolower((unsigned char)*p);
+    while (n > 0 && host[n - 1] == '.') n--;
+    host[n] = '\0';
+
+    // 경로: 조각(#) 제거, 퍼센트 인코딩 정리, 점 세그먼트 제거, 쿼리 정리
+    snprintf(path, sizeof(path), "%s", req->path);
+    path[strcspn(path, "#")] = '\0';
+    normalize_escapes(path);
+    if ((query = strchr(path, '?'))) *query++ = '\0';
+    remove_dot_segments(path);
+    if (!path[0]) strcpy(path, "/");
+
+    if (!strcmp(req->port, "80") || !req->port[0]) {
+        n = snprintf(req->url_key, MAXLINE, "http://%s%s", host, path);
+    } else {
+        n = snprintf(req->url_key, MAXLINE, "http://%s:%s%s", host, req->port, path);
+    }
+    if (query && n < MAXLINE) {
+        normalize_query(query);
+        if (query[0]) snprintf(req->url_key + n, MAXLINE - n, "?%s", query);
+    }
+
+    // Vary 변형을 모르는 동안은 URL 자체가 캐시 키
+    strcpy(req->key.str, req->url_key);
+    req->key.url_len = strlen(req->url_key);
+    req->key.url_hash = req->key.hash = str_hash(req->url_key, req->key.url_len);
+    if (strcmp(raw, req->url_key)) STAT_ADD(norm_rewrites, 1);
+}
+
+/* 퍼센트 인코딩을 대문자 16진수로 맞추고, 인코딩할 필요 없는 문자는 디코딩 (제자리) */
+void normalize_escapes(char *s) {
+    char *out = s;
+
+    for (char *p = s; *p; ) {
+        if (p[0] == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            char hex[3] = {p[1], p[2], '\0'};
+            int c = strtol(hex, NULL, 16);
+            if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+                *out++ = c;
+            } else {
+                *out++ = '%';
+                *out++ = toupper((unsigned char)p[1]);
+                *out++ = toupper((unsigned char)p[2]);
+            }
+            p += 3;
+        } else {
+            *out++ = *p++;
+        }
+    }
+    *out = '\0';
+}
+
+/* RFC 3986 5.2.4의 점 세그먼트 제거 (제자리) */
+void remove_dot_segments(char *path) {
+    char out[MAXLINE], *in = path;
+    size_t len = 0;
+
+    while (*in) {
+        if (!strncmp(in, "../", 3)) {
+            in += 3;
+        } else if (!strncmp(in, "./", 2) || !strncmp(in, "/./", 3)) {
+            in += 2;
+        } else if (!strcmp(in, "/.")) {
+            in[1] = '\0';  // "/"로 바꿔 다음 반복에서 출력
+        } else if (!strncmp(in, "/../", 4) || !strcmp(in, "/..")) {
+            // "/"로 바꾸고 출력의 마지막 세그먼트 제거
+            if (in[3]) {
+                in += 3;
+            } else {
+                in += 2;
+                *in = '/';
+            }
+            while (len > 0 && out[len - 1] != '/') len--;
+            if (len > 0) len--;
+        } else if (!strcmp(in, ".") || !strcmp(in, "..")) {
+            in += strlen(in);
+        } else {
+            // 첫 세그먼트 ("/" 포함)를 출력으로 옮김
+            do {
+                out[len++] = *in++;
+            } while (*in && *in != '/');
+        }
+    }
+    memcpy(path, out, len);
+    path[len] = '\0';
+}
+
+/* 쿼리 파라미터가 -x 목록에 있는지 ("utm_*"처럼 끝의 *는 접두사 일치) */
+int query_param_stripped(const char *param) {
+    char list[MAXLINE], *tok, *save;
+    size_t nlen = strcspn(param, "=");
+
+    if (!config.strip_query[0]) return 0;
+    strcpy(list, config.strip_query);
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        size_t tlen = strlen(tok);
+        if (tlen > 0 && tok[tlen - 1] == '*') {
+            if (!strncmp(param, tok, tlen - 1)) return 1;
+        } else if (tlen == nlen && !strncmp(param, tok, nlen)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int cmp_param(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* 설정된 파라미터를 빼고 (-x) 필요하면 이름순으로 정렬 (-q). 제자리에서 고침 */
+void normalize_query(char *query) {
+    char copy[MAXLINE], *params[MAXLINE / 2], *tok, *save;
+    int n = 0;
+    size_t len = 0;
+
+    if (!config.sort_query && !config.strip_query[0]) return;
+    strcpy(copy, query);
+    for (tok = strtok_r(copy, "&", &save); tok; tok = strtok_r(NULL, "&", &save)) {
+        if (!query_param_stripped(tok)) params[n++] = tok;
+    }
+    if (config.sort_query) qsort(params, n, sizeof(char *), cmp_param);
+    for (int i = 0; i < n; i++) {
+        len += sprintf(query + len, "%s%s", i ? "&" : "", params[i]);
+    }
+    query[len] = '\0';
+}
+
+/*
+ * Range 요청 처리
+ *
+ * 본문은 CACHE_BLOCK_SIZE 블록 단위로 캐싱된다. 요청 구간 중 캐시에 있는 블록은
+ * 바로 보내고, 없는 블록 구간만 원 서버에 블록 경계로 맞춘 Range 요청을 보내
+ * 받아온 뒤 캐시에 채워 넣는다. 단일 구간(bytes=a-b, a-, -n)만 지원하며,
+ * 그 외의 형식은 Range를 무시하고 전체 응답(200)으로 처리한다.
+ */
+
+/* Range 요청 처리. 응답을 보냈으면 1, 일반 요청으로 처리해야 하면 0 */
+int serve_range(int connfd, request_t *req) {
+    long long first, last;
+    size_t size, start, end;
+    char hdrs[MAXBUF];
+
+    if (!parse_range(req->range, &first, &last)) return 0;
+
+    cache_entry_t *entry = cache_find(&req->key);
+    if (!entry) return range_miss(connfd, req, first, last);
+
+    // 캐싱된 오류 응답은 Range와 관계없이 그대로 보냄
+    if (entry->negative) {
+        STAT_ADD(negative_hits, 1);
+        send_cached_entry(connfd, entry);
+        cache_read_complete(entry);
+        return 1;
+    }
+
+    // If-Range 검증자가 다르면 Range를 무시하고 전체 응답
+    if (req->if_range[0] && !if_range_matches(req->if_range, entry->headers)) {
+        cache_read_complete(entry);
+        return 0;
+    }
+    size = entry->body->size;
+    strcpy(hdrs, entry->headers);
+    cache_read_complete(entry);
+
+    if (resolve_range(first, last, size, &start, &end) < 0) {
+        char resp[MAXLINE];
+        snprintf(resp, sizeof(resp), "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                 "Content-Range: bytes */%zu\r\nContent-length: 0\r\n\r\n", size);
+        rio_writen(connfd, resp, strlen(resp));
+        return 1;
+    }
+
+    printf("Range hit for %s (%zu-%zu/%zu)\n", req->url_key, start, end, size);
+    STAT_ADD(range_hits, 1);
+    if (send_range_headers(connfd, hdrs, size, start, end) == 0) {
+        stream_range(connfd, req, hdrs, size, start, end);
+    }
+    return 1;
+}
+
+/* "bytes=a-b" 형태의 단일 구간 파싱. first < 0 이면 끝에서 last 바이트 (suffix) */
+int parse_range(const char *val, long long *first, long long *last) {
+    char *end;
+
+    if (strncasecmp(val, "bytes=", 6)) return 0;
+    val += 6;
+    if (strchr(val, ',')) return 0;  // 다중 구간은 지원하지 않음
+
+    if (*val == '-') {
+        *first = -1;
+        *last = strtoll(val + 1, &end, 10);
+        return end != val + 1 && *end == '\0' && *last > 0;
+    }
+    *first = strtoll(val, &end, 10);
+    if (end == val || *end != '-' || *first < 0) return 0;
+    val = end + 1;
+    if (*val == '\0') {
+        *last = -1;  // 끝까지
+        return 1;
+    }
+    *last = strtoll(val, &end, 10);
+    return *end == '\0' && *last >= *first;
+}
+
+/* 객체 크기에 맞춰 실제 구간 [start, end] 계산. 만족할 수 없으면 -1 */
+int resolve_range(long long first, long long last, size_t size, size_t *start, size_t *end) {
+    if (size == 0) return -1;
+    if (first < 0) {
+        *start = (size_t)last >= size ? 0 : size - last;
+        *end = size - 1;
+        return 0;
+    }
+    if ((size_t)first >= size) return -1;
+    *start = first;
+    *end = (last < 0 || (size_t)last >= size) ? size - 1 : (size_t)last;
+    return 0;
+}
+
+/* If-Range 값이 캐시된 객체의 ETag(강한 비교) 또는 Last-Modified와 같은지 확인 */
+int if_range_matches(const char *if_range, const char *hdrs) {
+    char val[MAXLINE];
+
+    if (if_range[0] == '"') {
+        return hdr_get(hdrs, "ETag", val, sizeof(val)) && !strcmp(val, if_range);
+    }
+    if (!strncmp(if_range, "W/", 2)) return 0;  // 약한 검증자는 사용할 수 없음
+    return hdr_get(hdrs, "Last-Modified", val, sizeof(val)) && !strcmp(val, if_range);
+}
+
+/* 두 헤더가 같은 객체를 가리키는지 (크기와 검증자 비교) */
+int same_object(const char *hdrs_a, size_t size_a, const char *hdrs_b, size_t size_b) {
+    char a[MAXLINE], b[MAXLINE];
+
+    if (size_a != size_b) return 0;
+    if (hdr_get(hdrs_a, "ETag", a, sizeof(a)) && hdr_get(hdrs_b, "ETag", b, sizeof(b))) {
+        return !strcmp(a, b);
+    }
+    if (hdr_get(hdrs_a, "Last-Modified", a, sizeof(a)) &&
+        hdr_get(hdrs_b, "Last-Modified", b, sizeof(b))) {
+        return !strcmp(a, b);
+    }
+    return 1;
+}
+
+/* 206 응답 헤더 전송 */
+int send_range_headers(int connfd, const char *entry_hdrs, size_t size, size_t start, size_t end) {
+    char hdrs[MAXBUF], buf[MAXLINE];
+    size_t len;
+
+    strcpy(hdrs, entry_hdrs);
+    hdr_set_status(hdrs, sizeof(hdrs), "HTTP/1.0 206 Partial Content");
+    snprintf(buf, sizeof(buf), "%zu", end - start + 1);
+    hdr_set(hdrs, sizeof(hdrs), "Content-length", buf);
+    snprintf(buf, sizeof(buf), "bytes %zu-%zu/%zu", start, end, size);
+    hdr_set(hdrs, sizeof(hdrs), "Content-Range", buf);
+    len = strlen(hdrs);
+    return rio_writen(connfd, hdrs, len) == len ? 0 : -1;
+}
+
+/* "Content-Range: bytes a-b/size" 파싱 */
+int parse_content_range(const char *hdrs, size_t *first, size_t *last, size_t *size) {
+    char val[MAXLINE];
+
+    if (!hdr_get(hdrs, "Content-Range", val, sizeof(val))) return -1;
+    if (sscanf(val, "bytes %zu-%zu/%zu", first, last, size) != 3) return -1;
+    if (*first > *last || *last >= *size) return -1;
+    return 0;
+}
+
+/*
+ * range가 NULL이 아니면 그 구간으로 원 서버에 요청하고 응답 헤더까지 읽음.
+ * 연결 실패나 원 서버 오류로 클라이언트에 이미 응답했으면 -1, 아니면 서버 소켓
+ */
+int range_fetch(int connfd, request_t *req, const char *range, rio_t *rp,
+                char *hdrs, size_t cap, ssize_t *hdr_len, int *status) {
+    char request_hdrs[MAXLINE], vary[MAXLINE];
+    int serverfd;
+
+    serverfd = connect_origin(req);
+    if (serverfd < 0) {
+        if (!serve_stale(connfd, req)) send_origin_error(connfd, req, serverfd);
+        return -1;
+    }
+
+    build_http_header(request_hdrs, req, range);
+    Rio_readinitb(rp, serverfd);
+    if (rio_writen(serverfd, request_hdrs, strlen(request_hdrs)) < 0 ||
+        (*hdr_len = read_response_headers(rp, hdrs, cap, status)) < 0) {
+        int timed_out = close_origin(serverfd);
+        if (!serve_stale(connfd, req) && timed_out) send_origin_error(connfd, req, TIMEOUT_RC);
+        return -1;
+    }
+    // 원 서버 오류면 만료 사본 전체로 응답 (Range는 무시)
+    if (*status >= 500 && serve_stale(connfd, req)) {
+        close_origin(serverfd);
+        return -1;
+    }
+    // 응답의 Vary에 맞춰 캐시 키를 다시 만듦 (Vary: *인 응답은 캐시가 받지 않음)
+    if (vary_names(hdrs, vary, sizeof(vary)) == 0) make_cache_key(req, vary);
+    return serverfd;
+}
+
+/* 캐시에 항목이 없는 Range 요청: 블록 경계로 넓혀 원 서버에 요청 */
+int range_miss(int connfd, request_t *req, long long first, long long last) {
+    char hdrs[MAXBUF], range[64], buf[MAXLINE];
+    size_t c_first, c_last, size, start, end;
+    int serverfd, status;
+    ssize_t hdr_len;
+    rio_t rio_server;
+
+    // 끝에서부터의 구간은 전체 크기를 모르고, If-Range는 비교할 검증자가 없으므로 일반 요청으로 처리
+    if (first < 0 || req->if_range[0]) return 0;
+
+    first -= first % CACHE_BLOCK_SIZE;
+    if (last < 0) {
+        snprintf(range, sizeof(range), "%lld-", first);
+    } else {
+        last = (last / CACHE_BLOCK_SIZE + 1) * CACHE_BLOCK_SIZE - 1;
+        snprintf(range, sizeof(range), "%lld-%lld", first, last);
+    }
+
+    printf("Range miss for %s (bytes=%s)\n", req->url_key, req->range);
+    serverfd = range_fetch(connfd, req, range, &rio_server, hdrs, sizeof(hdrs), &hdr_len, &status);
+    if (serverfd < 0) return 1;
+
+    if (status == 206 && parse_content_range(hdrs, &c_first, &c_last, &size) == 0 &&
+        c_first == (size_t)first) {
+        // 원 서버가 Range를 지원: 받은 블록을 캐시에 넣으면서 요청 구간 전송
+        parse_range(req->range, &first, &last);
+        make_entry_headers(hdrs, sizeof(hdrs), size);
+        if (resolve_range(first, last, size, &start, &end) < 0 ||
+            send_range_headers(connfd, hdrs, size, start, end) < 0) {
+            close_origin(serverfd);
+            return 1;
+        }
+        size_t pos = start;
+        if (relay_blocks(connfd, &rio_server, req, hdrs, size, c_first, c_last, &pos, end) == 0 &&
+            pos <= end) {
+            // 원 서버가 요청보다 짧게 보냈으면 나머지는 이어서 받음
+            close_origin(serverfd);
+            stream_range(connfd, req, hdrs, size, pos, end);
+            return 1;
+        }
+    } else {
+        // 원 서버가 요청과 다른 구간을 보냈으면 그대로 전달할 수 없으므로 Range 없이 전체를 다시 받음
+        if (status == 206) {
+            printf("Origin sent a different range for %s, refetching whole object\n", req->url_key);
+            close_origin(serverfd);
+            serverfd = range_fetch(connfd, req, NULL, &rio_server, hdrs, sizeof(hdrs), &hdr_len, &status);
+            if (serverfd < 0) return 1;
+            if (status == 206) {
+                static const char *resp = "HTTP/1.0 502 Bad Gateway\r\nContent-length: 0\r\n\r\n";
+                close_origin(serverfd);
+                rio_writen(connfd, (void *)resp, strlen(resp));
+                return 1;
+            }
+        }
+
+        // 원 서버가 Range를 무시하고 전체(200)를 보냈거나 오류.
+        // 길이를 아는 200 응답이면 요청 구간만 잘라 206으로 보내고, 아니면 그대로 전달
+        ssize_t n = 0;
+        size_t off = 0, avail;
+        int sliced = 0, rc, negative = negative_status(status);
+        chain_t chain;
+        char *p;
+
+        chain_init(&chain, status == 200 || negative);
+
+        parse_range(req->range, &first, &last);
+        if (status == 200 && hdr_get(hdrs, "Content-Length", buf, sizeof(buf)) &&
+            resolve_range(first, last, (size = strtoull(buf, NULL, 10)), &start, &end) == 0) {
+            sliced = 1;
+            make_entry_headers(hdrs, sizeof(hdrs), size);
+            rc = send_range_headers(connfd, hdrs, size, start, end);
+        } else {
+            rc = rio_writen(connfd, hdrs, hdr_len) == hdr_len ? 0 : -1;
+        }
+
+        if (rc == 0) {
+            while ((p = chain_space(&chain, &avail)) && (n = rio_readnb(&rio_server, p, avail)) > 0) {
+                deadline_touch(&upstream_deadline);
+                if (!sliced) {
+                    if (rio_writen(connfd, p, n) != n) break;
+                } else if (off + n > start && off <= end) {
+                    // 요청 구간과 겹치는 부분만 전송
+                    size_t s = off < start ? start - off : 0;
+                    size_t e = off + n - 1 > end ? end - off : n - 1;
+                    if (rio_writen(connfd, p + s, e - s + 1) != e - s + 1) break;
+                }
+                off += n;
+                chain_commit(&chain, n);
+                if (!chain.capture && sliced && off > end) break;  // 캐싱할 수 없으면 구간 이후는 받을 필요 없음
+            }
+            if (n == 0 && chain.capture && (chain.size > 0 || negative) &&
+                (!hdr_get(hdrs, "Content-Length", buf, sizeof(buf)) ||
+                 strtoull(buf, NULL, 10) == chain.size)) {
+                size_t total = chain.size;
+                if (negative) {
+                    snprintf(buf, sizeof(buf), "%zu", total);
+                    hdr_set(hdrs, sizeof(hdrs), "Content-length", buf);
+                } else {
+                    make_entry_headers(hdrs, sizeof(hdrs), total);
+                }
+                cache_add(&req->key, hdrs, &chain);
+                printf("Cached %zu bytes for %s\n", total, req->key.str);
+            }
+        }
+        chain_release(&chain);
+    }
+    close_origin(serverfd);
+    return 1;
+}
+
+/*
+ * [start, end] 구간을 클라이언트에 전송. 캐시에 있는 블록은 바로 보내고,
+ * 비어 있는 블록 구간만 원 서버에서 받아 캐시에 채운다.
+ */
+int stream_range(int connfd, request_t *req, const char *entry_hdrs, size_t size,
+                 size_t start, size_t end) {
+    char request_hdrs[MAXLINE], hdrs[MAXBUF], range[64], tmp[CACHE_BLOCK_SIZE];
+    size_t pos = start, c_first, c_last, c_size;
+    unsigned long nsec = 0;
+    int last_blk = end / CACHE_BLOCK_SIZE;
+    int serverfd, status;
+    rio_t rio_server;
+
+    while (pos <= end) {
+        int run_end = last_blk;  // 원 서버에서 받아야 할 마지막 블록
+        cache_body_t *body = NULL;
+        size_t cached_end = pos;  // 캐시에 연속으로 있는 블록이 끝나는 위치
+
+        cache_entry_t *entry = cache_find(&req->key);
+        if (entry && same_object(entry->headers, entry->body->size, entry_hdrs, size)) {
+            // 캐시에 연속으로 있는 블록 구간. 채워진 블록은 바뀌지 않으므로 본문만 고정하고 락 밖에서 보냄
+            body = entry->body;
+            while (cached_end <= end && body->blocks[cached_end / CACHE_BLOCK_SIZE]) {
+                cached_end = (cached_end / CACHE_BLOCK_SIZE + 1) * CACHE_BLOCK_SIZE;
+            }
+            // 다음으로 캐시에 있는 블록 직전까지만 원 서버에 요청
+            if (cached_end <= end) {
+                for (int i = cached_end / CACHE_BLOCK_SIZE + 1; i <= last_blk; i++) {
+                    if (body->blocks[i]) {
+                        run_end = i - 1;
+                        break;
+                    }
+                }
+            }
+            __atomic_add_fetch(&body->pins, 1, __ATOMIC_RELAXED);
+        }
+        if (entry) cache_read_complete(entry);
+        if (body) {
+            while (pos <= end && pos < cached_end) {
+                int idx = pos / CACHE_BLOCK_SIZE;
+                size_t off = pos % CACHE_BLOCK_SIZE;
+                size_t n = cache_block_len(size, idx) - off;
+                if (n > end - pos + 1) n = end - pos + 1;
+                const char *data = cache_block_data(body, idx, tmp, &nsec);
+                if (rio_writen(connfd, (void *)(data + off), n) != n) {
+                    body_unpin(body);
+                    return -1;
+                }
+                pos += n;
+            }
+            body_unpin(body);
+        }
+        if (nsec) {
+            // 압축된 블록을 푼 비용 기록
+            STAT_ADD(lz_hits, 1);
+            STAT_ADD(lz_decompress_nsec, nsec);
+            nsec = 0;
+        }
+        if (pos > end) break;
+
+        // 빈 블록 구간 [pos 블록, run_end]을 원 서버에서 받아옴
+        size_t r_first = pos - pos % CACHE_BLOCK_SIZE;
+        size_t r_last = (size_t)(run_end + 1) * CACHE_BLOCK_SIZE - 1;
+        if (r_last >= size) r_last = size - 1;
+        snprintf(range, sizeof(range), "%zu-%zu", r_first, r_last);
+        printf("Fetching missing range %s for %s\n", range, req->url_key);
+
+        serverfd = connect_origin(req);
+        if (serverfd < 0) return -1;
+        build_http_header(request_hdrs, req, range);
+        Rio_readinitb(&rio_server, serverfd);
+        if (rio_writen(serverfd, request_hdrs, strlen(request_hdrs)) < 0 ||
+            read_response_headers(&rio_server, hdrs, sizeof(hdrs), &status) < 0 ||
+            status != 206 ||
+            parse_content_range(hdrs, &c_first, &c_last, &c_size) < 0 ||
+            c_first != r_first || c_last < pos ||
+            !same_object(hdrs, c_size, entry_hdrs, size)) {
+            // 객체가 바뀌었거나 원 서버가 Range를 지원하지 않음: 이미 헤더를 보냈으므로 연결 종료
+            close_origin(serverfd);
+            return -1;
+        }
+        int rc = relay_blocks(connfd, &rio_server, req, entry_hdrs, size, c_first, c_last, &pos, end);
+        close_origin(serverfd);
+        if (rc < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * 원 서버의 206 본문 [body_start, body_end]를 블록 단위로 읽어 캐시에 저장하고,
+ * 그중 클라이언트 구간 [*pos, end]에 해당하는 부분을 전송한다.
+ */
+int relay_blocks(int connfd, rio_t *rp, request_t *req, const char *entry_hdrs,
+                 size_t size, size_t body_start, size_t body_end, size_t *pos, size_t end) {
+    char blk[CACHE_BLOCK_SIZE];
+    size_t off = body_start;
+
+    while (off <= body_end) {
+        int idx = off / CACHE_BLOCK_SIZE;
+        size_t want = cache_block_len(size, idx);
+        if (want > body_end - off + 1) want = body_end - off + 1;
+        if (rio_readnb(rp, blk, want) != want) return -1;
+        deadline_touch(&upstream_deadline);
+
+        // 클라이언트 구간과 겹치는 부분 전송
+        if (*pos <= end && *pos >= off && *pos < off + want) {
+            size_t s = *pos - off;
+            size_t n = want - s;
+            if (n > end - *pos + 1) n = end - *pos + 1;
+            if (rio_writen(connfd, blk + s, n) != n) return -1;
+            *pos += n;
+        }
+
+        // 블록 전체를 받은 경우에만 캐시에 저장
+        if (want == cache_block_len(size, idx)) {
+            cache_store_block(&req->key, entry_hdrs, size, idx, blk, want);
+        }
+        off += want;
+    }
+    return 0;
+}
+
+/*
+ * gzip 인코딩
+ *
+ * 외부 라이브러리 없이 deflate(RFC 1951)를 직접 구현한다. LZ77 해시 체인으로
+ * 일치 구간을 찾고 고정 허프만 코드(BTYPE=01) 한 블록으로 출력한 뒤
+ * gzip(RFC 1952) 헤더와 CRC32 트레일러를 붙인다.
+ * 캐시 항목마다 처음 gzip 요청이 왔을 때 한 번만 압축하고 이후 히트는 재사용한다.
+ */
+
+#define LZ_WINDOW 32768     /* deflate 최대 거리 */
+#define LZ_HASH_BITS 15
+#define LZ_MAX_CHAIN 64     /* 해시 체인 탐색 한도 */
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH 258
+
+/* 길이 코드 257~285의 기본값과 추가 비트 수 */
+static const unsigned short len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+/* 거리 코드 0~29의 기본값과 추가 비트 수 */
+static const unsigned short dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* LSB부터 채워 나가는 비트 출력 버퍼 */
+typedef struct {
+    unsigned char *out;
+    size_t cap, len;     /* len이 cap을 넘으면 출력이 버퍼보다 큰 것 */
+    unsigned long bits;  /* 아직 바이트로 내보내지 않은 비트 */
+    int nbits;
+} bitwriter_t;
+
+static unsigned long crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void) {
+    for (unsigned long n = 0; n < 256; n++) {
+        unsigned long c = n;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+static unsigned long crc32_calc(const unsigned char *p, size_t n) {
+    unsigned long crc = 0xffffffffUL;
+
+    Pthread_once(&crc_once, crc_table_init);
+    while (n--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffUL;
+}
+
+static void put_bits(bitwriter_t *bw, unsigned long v, int n) {
+    bw->bits |= v << bw->nbits;
+    bw->nbits += n;
+    while (bw->nbits >= 8) {
+        if (bw->len < bw->cap) bw->out[bw->len] = bw->bits & 0xff;
+        bw->len++;
+        bw->bits >>= 8;
+        bw->nbits -= 8;
+    }
+}
+
+/* 허프만 코드는 MSB부터 써야 하므로 비트를 뒤집어 출력 */
+static void put_huff(bitwriter_t *bw, unsigned code, int n) {
+    unsigned r = 0;
+    for (int i = 0; i < n; i++, code >>= 1) r = (r << 1) | (code & 1);
+    put_bits(bw, r, n);
+}
+
+/* 고정 허프만 리터럴/길이 심볼 출력 */
+static void put_symbol(bitwriter_t *bw, int sym) {
+    if (sym < 144) put_huff(bw, 0x30 + sym, 8);
+    else if (sym < 256) put_huff(bw, 0x190 + sym - 144, 9);
+    else if (sym < 280) put_huff(bw, sym - 256, 7);
+    else put_huff(bw, 0xc0 + sym - 280, 8);
+}
+
+static void put_match(bitwriter_t *bw, int len, int dist) {
+    int l = 0, d = 0;
+
+    while (l < 28 && len_base[l + 1] <= len) l++;
+    put_symbol(bw, 257 + l);
+    put_bits(bw, len - len_base[l], len_extra[l]);
+    while (d < 29 && dist_base[d + 1] <= dist) d++;
+    put_huff(bw, d, 5);
+    put_bits(bw, dist - dist_base[d], dist_extra[d]);
+}
+
+static unsigned lz_hash(const unsigned char *p) {
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << LZ_HASH_BITS) - 1);
+}
+
+/* in을 gzip으로 압축해 *out에 할당. 압축된 크기 반환, 실패 시 0 */
+size_t gzip_compress(const char *in, size_t len, char **out) {
+    static const unsigned char gz_hdr[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    const unsigned char *src = (const unsigned char *)in;
+    unsigned long crc = crc32_calc(src, len);
+    bitwriter_t bw;
+    int *head, *prev;
+    size_t i = 0;
+
+    bw.cap = len + len / 8 + 64;  // 고정 허프만 최악의 경우 (리터럴당 9비트)
+    bw.out = Malloc(bw.cap);
+    memcpy(bw.out, gz_hdr, sizeof(gz_hdr));
+    bw.len = sizeof(gz_hdr);
+    bw.bits = 0;
+    bw.nbits = 0;
+
+    head = Malloc(sizeof(int) << LZ_HASH_BITS);
+    memset(head, 0xff, sizeof(int) << LZ_HASH_BITS);  // 모두 -1
+    prev = Malloc(sizeof(int) * (len ? len : 1));
+
+    put_bits(&bw, 1, 1);  // BFINAL: 마지막 블록
+    put_bits(&bw, 1, 2);  // BTYPE=01: 고정 허프만
+    while (i < len) {
+        size_t best_len = 0, best_dist = 0;
+
+        if (i + LZ_MIN_MATCH <= len) {
+            size_t max = len - i < LZ_MAX_MATCH ? len - i : LZ_MAX_MATCH;
+            int cand = head[lz_hash(src + i)];
+            for (int chain = LZ_MAX_CHAIN; cand >= 0 && i - cand <= LZ_WINDOW && chain > 0; chain--) {
+                if (src[cand + best_len] == src[i + best_len]) {
+                    size_t l = 0;
+                    while (l < max && src[cand + l] == src[i + l]) l++;
+                    if (l > best_len) {
+                        best_len = l;
+                        best_dist = i - cand;
+                        if (l == max) break;
+                    }
+                }
+                cand = prev[cand];
+            }
+        }
+
+        if (best_len < LZ_MIN_MATCH) {
+            best_len = 1;
+            put_symbol(&bw, src[i]);
+        } else {
+            put_match(&bw, best_len, best_dist);
+        }
+        // 지나간 위치를 해시 체인에 등록
+        for (size_t end = i + best_len; i < end; i++) {
+            if (i + LZ_MIN_MATCH <= len) {
+                unsigned h = lz_hash(src + i);
+                prev[i] = head[h];
+                head[h] = i;
+            }
+        }
+    }
+    put_symbol(&bw, 256);  // 블록 끝
+    if (bw.nbits > 0) put_bits(&bw, 0, 8 - bw.nbits);
+
+    // 트레일러: CRC32, 원본 크기 (리틀 엔디언)
+    put_bits(&bw, crc & 0xffff, 16);
+    put_bits(&bw, crc >> 16, 16);
+    put_bits(&bw, len & 0xffff, 16);
+    put_bits(&bw, (len >> 16) & 0xffff, 16);
+
+    Free(head);
+    Free(prev);
+    if (bw.len > bw.cap) {
+        Free(bw.out);
+        *out = NULL;
+        return 0;
+    }
+    *out = (char *)bw.out;
+    return bw.len;
+}
+
+/* Accept-Encoding이 gzip을 허용하는지 (q=0이면 거부) */
+int accepts_gzip(const char *accept_encoding) {
+    const char *p = accept_encoding;
+
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        size_t n = strcspn(p, ",;");
+        while (n > 0 && p[n - 1] == ' ') n--;
+        int match = (n == 4 && !strncasecmp(p, "gzip", 4)) ||
+                    (n == 6 && !strncasecmp(p, "x-gzip", 6)) || (n == 1 && *p == '*');
+        p += strcspn(p, ",;");
+        double q = 1.0;
+        if (*p == ';') {
+            const char *qp = strstr(p, "q=");
+            const char *next = strchr(p, ',');
+            if (qp && (!next || qp < next)) q = atof(qp + 2);
+            p = next ? next : p + strlen(p);
+        }
+        if (match) return q > 0;
+    }
+    return 0;
+}
+
+/* 압축할 가치가 있는 응답인지 (텍스트 계열 MIME, 이미 인코딩되지 않음, 최소 크기) */
+int gzip_compressible(const char *hdrs, size_t size) {
+    static const char *types[] = {
+        "text/", "application/javascript", "application/json", "application/xml",
+        "application/xhtml+xml", "image/svg+xml", NULL};
+    char val[MAXLINE];
+
+    if (size < GZIP_MIN_SIZE) return 0;
+    if (hdr_get(hdrs, "Content-Encoding", val, sizeof(val)) && strcasecmp(val, "identity")) return 0;
+    if (!hdr_get(hdrs, "Content-Type", val, sizeof(val))) return 0;
+    for (int i = 0; types[i]; i++) {
+        if (!strncasecmp(val, types[i], strlen(types[i]))) return 1;
+    }
+    return 0;
+}
+
+/* 캐시된 헤더를 gzip 변형의 헤더로 변환 */
+void make_gzip_headers(char *hdrs, size_t cap, size_t gz_size) {
+    char buf[MAXLINE + 8], etag[MAXLINE];
+
+    hdr_set(hdrs, cap, "Content-Encoding", "gzip");
+    snprintf(buf, sizeof(buf), "%zu", gz_size);
+    hdr_set(hdrs, cap, "Content-length", buf);
+    hdr_del(hdrs, "Accept-Ranges");  // Range는 압축 안 된 본문에만 적용
+    // 인코딩이 다르면 다른 표현이므로 강한 ETag도 구분
+    if (hdr_get(hdrs, "ETag", etag, sizeof(etag)) && etag[0] == '"' && strlen(etag) > 1) {
+        etag[strlen(etag) - 1] = '\0';
+        snprintf(buf, sizeof(buf), "%s-gzip\"", etag);
+        hdr_set(hdrs, cap, "ETag", buf);
+    }
+    hdr_add_vary(hdrs, cap, "Accept-Encoding");
+}
+
+/* 현재 스레드가 사용한 CPU 시간 (마이크로초) */
+unsigned long thread_cpu_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * gzip 변형으로 캐시 히트 응답. entry는 읽기 락을 잡은 상태로 넘어오며 여기서 푼다.
+ * 아직 압축한 적이 없으면 지금 압축해 보내고 캐시에 붙여 다음 히트부터 재사용한다.
+ * 압축 효과가 없으면 원본을 보내고 다시 시도하지 않도록 표시한다.
+ */
+void serve_gzip_hit(int connfd, cache_entry_t *entry, request_t *req) {
+    char hdrs[MAXBUF], gz_hdrs[MAXBUF], *body, *gz;
+    size_t size = entry->body->size, gz_size, hlen;
+    unsigned long cpu;
+
+    if (entry->gz) {
+        // 이미 압축해 둔 변형 재사용
+        hlen = entry->gz->headers_size;
+        if (rio_writen(connfd, entry->gz->headers, hlen) == hlen) {
+            rio_writen(connfd, entry->gz->content, entry->gz->size);
+        }
+        cache_read_complete(entry);
+        STAT_ADD(gzip_served, 1);
+        return;
+    }
+
+    // 블록을 이어 붙여 한 번에 압축
+    body = Malloc(size);
+    for (int i = 0; i < entry->body->num_blocks; i++) {
+        char *dst = body + (size_t)i * CACHE_BLOCK_SIZE;
+        const char *data = cache_block_data(entry->body, i, dst, NULL);
+        if (data != dst) memcpy(dst, data, cache_block_len(size, i));
+    }
+    cpu = thread_cpu_usec();
+    gz_size = gzip_compress(body, size, &gz);
+    cpu = thread_cpu_usec() - cpu;
+    Free(body);
+    STAT_ADD(gzip_cpu_usec, cpu);
+    strcpy(hdrs, entry->headers);
+
+    if (gz_size == 0 || gz_size >= size) {
+        // 압축 효과 없음: 원본 전송
+        if (gz) Free(gz);
+        send_cached_entry(connfd, entry);
+        cache_read_complete(entry);
+        cache_attach_gzip(&req->key, hdrs, NULL, NULL, 0);
+        return;
+    }
+    cache_read_complete(entry);
+
+    STAT_ADD(gzip_compressed, 1);
+    STAT_ADD(gzip_in_bytes, size);
+    STAT_ADD(gzip_out_bytes, gz_size);
+    printf("Compressed %s: %zu -> %zu bytes (%lu us)\n", req->url_key, size, gz_size, cpu);
+
+    strcpy(gz_hdrs, hdrs);
+    make_gzip_headers(gz_hdrs, sizeof(gz_hdrs), gz_size);
+    hlen = strlen(gz_hdrs);
+    if (rio_writen(connfd, gz_hdrs, hlen) == hlen) rio_writen(connfd, gz, gz_size);
+    STAT_ADD(gzip_served, 1);
+
+    // 캐시에 압축 변형 등록 (gz의 소유권은 캐시로 넘어감)
+    cache_attach_gzip(&req->key, hdrs, strdup(gz_hdrs), gz, gz_size);
+}
+
+/* gzip 변형 고정 해제. 항목도 놓았고 보내는 스레드도 없으면 메모리 반환 (락 없이 호출) */
+void gzip_unpin(cache_gzip_t *gz) {
+    if (__atomic_sub_fetch(&gz->pins, 1, __ATOMIC_ACQ_REL) == 0) {
+        Free(gz->headers);
+        Free(gz->content);
+        Free(gz);
+    }
+}
+
+/*
+ * 캐시 본문 압축 (LZ4 계열, -z 옵션)
+ *
+ * 블록마다 독립적으로 압축하므로 히트 때 필요한 블록만 풀어 바로 보낼 수 있다.
+ * 시퀀스 형식: [토큰][리터럴 길이 추가 바이트][리터럴][거리 2바이트][일치 길이 추가 바이트]
+ * 토큰 상위 4비트는 리터럴 길이, 하위 4비트는 (일치 길이 - 4)이며 15면 추가 바이트가
+ * 이어진다 (255면 계속). 마지막 시퀀스는 리터럴만 가진다.
+ */
+
+#define LZB_MIN_MATCH 4
+#define LZB_HASH_BITS 12
+#define LZB_LAST_LITERALS 5   /* 블록 끝 몇 바이트는 항상 리터럴로 남김 */
+#define LZB_MATCH_LIMIT 12    /* 블록 끝에서 이만큼 안쪽에서만 일치 구간을 시작 */
+
+static unsigned lzb_hash(const unsigned char *p) {
+    unsigned v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZB_HASH_BITS);
+}
+
+static unsigned char *lzb_put_len(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* src를 압축해 dst(용량 cap)에 쓴다. 압축 크기 반환, cap을 넘으면 0 */
+size_t lzb_compress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *end = base + len;
+    const unsigned char *mflimit = len > LZB_MATCH_LIMIT ? end - LZB_MATCH_LIMIT : base;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    unsigned short table[1 << LZB_HASH_BITS];  // 블록 안의 위치 (블록은 64KB 미만)
+    size_t lit;
+
+    memset(table, 0, sizeof(table));
+    while (ip < mflimit) {
+        unsigned h = lzb_hash(ip);
+        const unsigned char *ref = base + table[h];
+        table[h] = ip - base;
+        if (ref >= ip || memcmp(ref, ip, LZB_MIN_MATCH)) {
+            // 일치하지 않는 구간이 길어질수록 더 크게 건너뜀 (압축 안 되는 데이터를 빨리 통과)
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        // 일치 구간 확장
+        const unsigned char *mp = ip + LZB_MIN_MATCH, *rp = ref + LZB_MIN_MATCH;
+        while (mp < end - LZB_LAST_LITERALS && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+        size_t mlen = mp - ip - LZB_MIN_MATCH;
+        unsigned off = ip - ref;
+        lit = ip - anchor;
+        if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend) return 0;
+
+        unsigned char *token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+        if (lit >= 15) op = lzb_put_len(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        if (mlen >= 15) op = lzb_put_len(op, mlen - 15);
+        ip = anchor = mp;
+    }
+
+    // 남은 리터럴
+    lit = end - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > oend) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op = lzb_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - (unsigned char *)dst;
+}
+
+/* 압축 해제. 풀린 크기 반환, 형식이 잘못되었으면 -1 */
+ssize_t lzb_decompress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    unsigned b;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend) return -1;
+                lit += (b = *ip++);
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip >= iend) break;  // 마지막 시퀀스
+
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) return -1;
+                mlen += (b = *ip++);
+            } while (b == 255);
+        }
+        mlen += LZB_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - (unsigned char *)dst) || mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+        const unsigned char *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) *op++ = *ref++;  // 겹치는 복사는 바이트 단위로
+        }
+    }
+    return op - (unsigned char *)dst;
+}
+
+/* 블록을 압축해 새 버퍼로 반환. 충분히 줄지 않으면 NULL */
+char *lzb_pack(const char *data, size_t len, size_t *packed_len) {
+    size_t cap = LZB_KEEP_LIMIT(len);
+    char *buf;
+
+    if (cap == 0) return NULL;
+    buf = Malloc(cap);
+    *packed_len = lzb_compress(data, len, buf, cap);
+    if (*packed_len == 0) {
+        Free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* 단조 증가 시계 (나노초) */
+unsigned long now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * 계층형 타이머 휠
+ *
+ * WHEEL_TICK_MS 단위로 도는 WHEEL_LEVELS단 휠. 0단 슬롯 하나가 한 틱이고, 위 단의
+ * 슬롯은 아래 단 한 바퀴에 해당한다. 위 단 슬롯의 타이머는 그 구간에 들어설 때
+ * 아래 단으로 내려오므로 (cascade) 틱마다 하는 일은 만료된 타이머 수에 비례한다.
+ * 콜백은 휠 스레드에서 휠 락 없이 한 번에 하나씩 실행된다.
+ */
+
+/* 단조 증가 시계 (밀리초) */
+unsigned long now_msec(void) {
+    return now_nsec() / 1000000;
+}
+
+void wheel_timer_init(wheel_timer_t *t, void (*fn)(wheel_timer_t *), void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+    t->next = t->prev = NULL;
+}
+
+/* 만료 틱에 맞는 슬롯에 넣음 (wheel.mutex를 잡은 상태에서 호출) */
+static void wheel_insert(wheel_timer_t *t) {
+    unsigned long delta = t->expires - wheel.now;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * (level + 1))) level++;
+    wheel_timer_t *head =
+        &wheel.slots[level][(t->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+}
+
+static void wheel_unlink(wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    wheel.pending--;
+}
+
+/* msec 뒤에 만료되도록 (다시) 등록 */
+void wheel_timer_add(wheel_timer_t *t, unsigned long msec) {
+    unsigned long ticks = (msec + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    unsigned long max = (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    pthread_mutex_lock(&wheel.mutex);
+    if (t->next) wheel_unlink(t);
+    t->expires = wheel.now + (ticks == 0 ? 1 : ticks > max ? max : ticks);
+    wheel_insert(t);
+    wheel.pending++;
+    pthread_mutex_unlock(&wheel.mutex);
+}
+
+/*
+ * 타이머 해제. sync이면 콜백이 실행 중일 때 끝날 때까지 기다리고, 그 콜백이 타이머를 다시
+ * 등록했으면 그것도 해제한다 (콜백이 잡는 락을 쥔 채로 sync 해제를 부르면 안 됨).
+ * 만료 전에 해제했으면 1
+ */
+int wheel_timer_del(wheel_timer_t *t, int sync) {
+    int pending;
+
+    pthread_mutex_lock(&wheel.mutex);
+    if ((pending = (t->next != NULL))) wheel_unlink(t);
+    while (sync && wheel.running == t) {
+        pthread_cond_wait(&wheel.done, &wheel.mutex);
+        if (t->next) wheel_unlink(t);
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+    return pending;
+}
+
+/* 한 틱 진행: 필요하면 위 단 슬롯을 내리고, 0단 현재 슬롯의 타이머 실행 */
+static void wheel_tick(void) {
+    wheel.now++;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        // 아래 단이 한 바퀴를 다 돌았을 때만 이 단의 다음 슬롯을 내림
+        if (wheel.now & ((1UL << (WHEEL_BITS * level)) - 1)) break;
+        wheel_timer_t *head =
+            &wheel.slots[level][(wheel.now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            wheel_timer_t *t = head->next;
+            t->prev->next = t->next;
+            t->next->prev = t->prev;
+            wheel_insert(t);
+        }
+        STAT_ADD(wheel_cascades, 1);
+    }
+
+    wheel_timer_t *head = &wheel.slots[0][wheel.now & (WHEEL_SLOTS - 1)];
+    while (head->next != head) {
+        wheel_timer_t *t = head->next;
+        wheel_unlink(t);
+        wheel.running = t;
+        pthread_mutex_unlock(&wheel.mutex);
+        t->fn(t);  // 콜백 안에서 같은 타이머를 다시 등록할 수 있음
+        pthread_mutex_lock(&wheel.mutex);
+        wheel.running = NULL;
+        pthread_cond_broadcast(&wheel.done);
+    }
+}
+
+/* 휠 스레드: 실제 시간을 따라잡을 때까지 틱을 진행 */
+static void *wheel_thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    while (1) {
+        struct timespec ts = {0, WHEEL_TICK_MS * 1000000L};
+        nanosleep(&ts, NULL);
+
+        unsigned long target = (now_msec() - wheel.start) / WHEEL_TICK_MS;
+        pthread_mutex_lock(&wheel.mutex);
+        while (wheel.now < target) wheel_tick();
+        pthread_mutex_unlock(&wheel.mutex);
+    }
+    return NULL;
+}
+
+void wheel_init(void) {
+    pthread_t tid;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            wheel.slots[level][i].next = wheel.slots[level][i].prev = &wheel.slots[level][i];
+        }
+    }
+    wheel.start = now_msec();
+    wheel.now = 0;
+    pthread_mutex_init(&wheel.mutex, NULL);
+    pthread_cond_init(&wheel.done, NULL);
+    Pthread_create(&tid, NULL, wheel_thread, NULL);
+}
+
+/*
+ * 소켓 유휴 시간 제한. 마지막 활동 후 timeout이 지나면 소켓을 shutdown해서 막혀 있는
+ * 읽기를 깨운다. 활동 기록(deadline_touch)은 시각만 적고, 타이머가 울렸을 때 아직
+ * 시간이 남았으면 남은 만큼 다시 등록한다.
+ */
+
+static void deadline_expire(wheel_timer_t *t) {
+    deadline_t *d = (deadline_t *)t->arg;
+    unsigned long idle = now_msec() - __atomic_load_n(&d->last, __ATOMIC_RELAXED);
+
+    if (idle < d->timeout) {
+        wheel_timer_add(t, d->timeout - idle);
+        return;
+    }
+    d->fired = 1;
+    __atomic_fetch_add(d->counter, 1, __ATOMIC_RELAXED);
+    shutdown(d->fd, SHUT_RDWR);
+}
+
+/* fd에 timeout_ms 유휴 제한을 걸음 (0이면 제한 없음). 넘으면 counter 증가 */
+void deadline_start(deadline_t *d, int fd, unsigned long timeout_ms, unsigned long *counter) {
+    d->fd = fd;
+    d->timeout = timeout_ms;
+    d->counter = counter;
+    d->fired = 0;
+    d->last = now_msec();
+    wheel_timer_init(&d->timer, deadline_expire, d);
+    if (timeout_ms) wheel_timer_add(&d->timer, timeout_ms);
+}
+
+/* 읽기가 진행되었음을 기록 */
+void deadline_touch(deadline_t *d) {
+    __atomic_store_n(&d->last, now_msec(), __ATOMIC_RELAXED);
+}
+
+/* 제한 해제 (여러 번 불러도 됨). 시간 초과로 끊었으면 1 */
+int deadline_stop(deadline_t *d) {
+    if (d->timeout) wheel_timer_del(&d->timer, 1);
+    d->timeout = 0;
+    return d->fired;
+}
+
+/* 같은 소켓의 시간 제한을 다음 단계의 제한과 통계로 바꾸고 지금부터 다시 잼 */
+void deadline_phase(deadline_t *d, unsigned long timeout_ms, unsigned long *counter) {
+    if (d->fired) return;
+    deadline_stop(d);
+    deadline_start(d, d->fd, timeout_ms, counter);
+}
+
+/*
+ * 캐시 항목 만료 시간
+ *
+ * s-maxage, max-age, Expires - Date 순으로 보고 없으면 기본 TTL(-t)을 쓴다.
+ * no-store / no-cache / private 응답과 이미 만료된 응답은 0 (캐싱 안 함).
+ */
+
+/* HTTP 날짜 (IMF-fixdate) 파싱. 실패하면 -1 */
+time_t parse_http_date(const char *val) {
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    const char *m;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(val, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, mon, &tm.tm_year,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+        strlen(mon) != 3 || !(m = strstr(months, mon)) || (m - months) % 3) {
+        return -1;
+    }
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/* 응답 헤더로 정한 TTL (초) */
+long entry_ttl(const char *hdrs) {
+    char val[MAXLINE], *tok, *save;
+    long max_age = -1, s_maxage = -1, ttl;
+
+    if (hdr_get(hdrs, "Cache-Control", val, sizeof(val))) {
+        for (tok = strtok_r(val, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save)) {
+            if (!strcasecmp(tok, "no-store") || !strcasecmp(tok, "no-cache") ||
+                !strcasecmp(tok, "private")) {
+                return 0;
+            } else if (!strncasecmp(tok, "s-maxage=", 9)) {
+                s_maxage = atol(tok + 9);
+            } else if (!strncasecmp(tok, "max-age=", 8)) {
+                max_age = atol(tok + 8);
+            }
+        }
+    }
+    if (s_maxage >= 0) {
+        ttl = s_maxage;
+    } else if (max_age >= 0) {
+        ttl = max_age;
+    } else if (hdr_get(hdrs, "Expires", val, sizeof(val))) {
+        time_t expires = parse_http_date(val), date = -1;
+        if (hdr_get(hdrs, "Date", val, sizeof(val))) date = parse_http_date(val);
+        if (date < 0) date = time(NULL);
+        ttl = expires < 0 ? 0 : expires - date;  // 잘못된 Expires는 이미 만료된 것으로 봄
+    } else {
+        ttl = config.default_ttl;
+    }
+    if (hdr_get(hdrs, "Age", val, sizeof(val))) ttl -= atol(val);
+    // 오류 응답은 네거티브 TTL보다 오래 두지 않음
+    if (hdr_status(hdrs) != 200 && ttl > config.negative_ttl) ttl = config.negative_ttl;
+    return ttl > 0 ? ttl : 0;
+}
+
+/*
+ * 네거티브 캐싱
+ *
+ * 404/410/5xx 응답은 상태줄 그대로 캐시에 넣되 TTL을 -n 이하로 줄인다. 원 서버에 연결하지
+ * 못한 경우는 호스트:포트 단위로 기록해 두고, 기록이 남아 있는 동안은 연결을 시도하지 않고
+ * 바로 502로 응답한다. 기록은 타이머 휠이 만료 시각에 지운다.
+ */
+
+origin_failure_t *origin_failures[ORIGIN_TABLE_SIZE];
+pthread_mutex_t origin_failures_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* 짧게 캐싱할 오류 상태 코드인지 */
+int negative_status(int status) {
+    return config.negative_ttl > 0 && (status == 404 || status == 410 || status >= 500);
+}
+
+/* 헤더 블록의 상태 코드 */
+int hdr_status(const char *hdrs) {
+    int status = 0;
+    sscanf(hdrs, "HTTP/%*s %d", &status);
+    return status;
+}
+
+static unsigned origin_bucket(const char *host, const char *port) {
+    unsigned long h = str_hash(port, strlen(port));
+    for (const char *p = host; *p; p++) h = (h ^ tolower((unsigned char)*p)) * 1099511628211UL;
+    return h % ORIGIN_TABLE_SIZE;
+}
+
+static origin_failure_t *origin_failure_lookup(request_t *req, origin_failure_t ***link) {
+    origin_failure_t **pp = &origin_failures[origin_bucket(req->hostname, req->port)];
+
+    while (*pp && (strcasecmp((*pp)->host, req->hostname) || strcmp((*pp)->port, req->port))) {
+        pp = &(*pp)->next;
+    }
+    if (link) *link = pp;
+    return *pp;
+}
+
+/* 기록 만료 (휠 스레드). 그 사이 다시 실패해 만료 시각이 늦춰졌으면 다시 등록 */
+static void origin_failure_expire(wheel_timer_t *t) {
+    origin_failure_t *f = (origin_failure_t *)t->arg, **pp;
+    unsigned long now = now_msec();
+
+    pthread_mutex_lock(&origin_failures_mutex);
+    if (f->expires > now) {
+        wheel_timer_add(t, f->expires - now);
+    } else {
+        for (pp = &origin_failures[origin_bucket(f->host, f->port)]; *pp != f; pp = &(*pp)->next)
+            ;
+        *pp = f->next;
+        Free(f);
+    }
+    pthread_mutex_unlock(&origin_failures_mutex);
+}
+
+/* 원 서버에 최근 연결 실패 기록이 있으면 그때의 결과 (-1/-2), 없으면 0 */
+int origin_failure_find(request_t *req) {
+    int rc = 0;
+
+    pthread_mutex_lock(&origin_failures_mutex);
+    origin_failure_t *f = origin_failure_lookup(req, NULL);
+    if (f && f->expires > now_msec()) rc = f->rc;
+    pthread_mutex_unlock(&origin_failures_mutex);
+    return rc;
+}
+
+/* 원 서버 연결 실패 기록 */
+void origin_failure_add(request_t *req, int rc) {
+    origin_failure_t **pp, *f;
+
+    if (config.negative_ttl <= 0) return;
+    pthread_mutex_lock(&origin_failures_mutex);
+    if (!(f = origin_failure_lookup(req, &pp))) {
+        f = (origin_failure_t *)Calloc(1, sizeof(origin_failure_t));
+        snprintf(f->host, sizeof(f->host), "%s", req->hostname);
+        snprintf(f->port, sizeof(f->port), "%s", req->port);
+        wheel_timer_init(&f->timer, origin_failure_expire, f);
+        wheel_timer_add(&f->timer, config.negative_ttl * 1000);
+        *pp = f;
+    }
+    // 기존 기록이면 만료 시각만 늦춤 (타이머가 울렸을 때 다시 등록됨)
+    f->rc = rc;
+    f->expires = now_msec() + config.negative_ttl * 1000;
+    pthread_mutex_unlock(&origin_failures_mutex);
+}
+
+/*
+ * 원 서버에 연결하지 못했거나 응답을 받지 못했을 때, 만료되어 유예 구간(-g)에 남아 있는
+ * 사본이 있으면 Warning 헤더를 붙여 대신 보낸다. 보냈으면 1
+ */
+int serve_stale(int connfd, request_t *req) {
+    char hdrs[MAXBUF];
+
+    cache_entry_t *entry = cache_find_stale(&req->key);
+    if (!entry) return 0;
+
+    printf("Serving stale %s\n", req->key.str);
+    STAT_ADD(stale_served, 1);
+    snprintf(hdrs, sizeof(hdrs), "%s", entry->headers);
+    hdr_set(hdrs, sizeof(hdrs), "Warning", "110 - \"Response is Stale\", 111 - \"Revalidation Failed\"");
+    send_cached_body(connfd, entry->body, hdrs, strlen(hdrs));
+    cache_read_complete(entry);
+    return 1;
+}
+
+/*
+ * 캐시 무효화 요청
+ *
+ *   PURGE http://host/path HTTP/1.0   해당 URL의 모든 변형 제거
+ *   BAN http://host/static/ HTTP/1.0  URL이 이 접두사로 시작하는 항목 모두 제거 (끝에 '*'를 붙여도 됨)
+ *
+ * URL은 캐시 키와 같은 방식으로 정규화한 뒤 비교하며, 프록시와 같은 호스트(루프백)에서
+ * 온 요청만 받는다.
+ */
+
+/* 클라이언트가 루프백 주소에서 접속했는지 */
+int client_is_local(int connfd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getpeername(connfd, (SA *)&addr, &len) < 0) return 0;
+    if (addr.ss_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) ||
+               (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+/* PURGE / BAN 요청 처리 */
+void serve_invalidate(int connfd, rio_t *rp, char *method, char *uri) {
+    char body[MAXLINE + 64];
+    size_t ulen = strlen(uri);
+    int ban = !strcasecmp(method, "BAN"), n;
+    request_t *req = (request_t *)Malloc(sizeof(request_t));
+
+    read_request_headers(rp, req);
+    deadline_stop(&client_deadline);
+
+    if (!client_is_local(connfd)) {
+        send_text(connfd, "403 Forbidden", "Invalidation is only allowed from localhost\n");
+        Free(req);
+        return;
+    }
+    if (ban && ulen > 0 && uri[ulen - 1] == '*') uri[ulen - 1] = '\0';
+    if (parse_uri(uri, req->hostname, req->path, req->port) < 0) {
+        send_text(connfd, "400 Bad Request", "Invalid URL\n");
+        Free(req);
+        return;
+    }
+    canonicalize_url(req);
+
+    if (ban) {
+        // 접두사에 해당하는 URL은 여러 분할에 흩어져 있음
+        n = 0;
+        for (int i = 0; i < config.partitions; i++) {
+            cache = &cache_parts[i];
+            n += cache_ban(req->url_key);
+        }
+        if (shm) n += shm_invalidate(req->url_key, 1);
+        STAT_ADD(bans, 1);
+        snprintf(body, sizeof(body), "Banned %d entries under %s\n", n, req->url_key);
+        send_text(connfd, "200 OK", body);
+    } else {
+        cache = cache_part(req->key.url_hash);
+        n = cache_purge(&req->key);
+        if (shm) n += shm_invalidate(req->url_key, 0);
+        STAT_ADD(purges, 1);
+        snprintf(body, sizeof(body), "%s %d entries for %s\n", n ? "Purged" : "Not cached:", n,
+                 req->url_key);
+        send_text(connfd, n ? "200 OK" : "404 Not Found", body);
+    }
+    STAT_ADD(invalidated, n);
+    printf("%s %s: %d entries removed\n", method, req->url_key, n);
+    Free(req);
+}
+
+/* 프록시가 직접 만드는 text/plain 응답 */
+void send_text(int connfd, const char *status, const char *body) {
+    char hdr[MAXLINE];
+    size_t len = strlen(body);
+
+    snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\nContent-type: text/plain\r\n"
+             "Content-length: %zu\r\nCache-Control: no-store\r\n\r\n", status, len);
+    if (rio_writen(connfd, hdr, strlen(hdr)) == strlen(hdr)) rio_writen(connfd, (void *)body, len);
+}
+
+/* 프록시 통계를 text/plain으로 응답 */
+void serve_stats(int connfd) {
+    char body[MAXBUF];
+    size_t len = 0, cur_size, content_bytes, stored_bytes, dedup_saved;
+    int num_entries, num_urls, timers, radix_nodes, queue_length, stale_entries = 0;
+    int class_entries[PRIO_PINNED + 1] = {0};
+    size_t class_bytes[PRIO_PINNED + 1] = {0};
+    int hot_keys = 0, hot_replicas = 0;
+    unsigned long hot_hits;
+
+    pthread_mutex_lock(&wheel.mutex);
+    timers = wheel.pending;
+    pthread_mutex_unlock(&wheel.mutex);
+
+    // 분할별 값을 더함
+    cur_size = content_bytes = stored_bytes = dedup_saved = 0;
+    num_entries = num_urls = radix_nodes = queue_length = 0;
+    for (int p = 0; p < config.partitions; p++) {
+        cache_t *c = &cache_parts[p];
+        pthread_mutex_lock(&c->mutex);
+        cur_size += c->current_size;
+        num_entries += c->num_entries;
+        num_urls += c->num_urls;
+        radix_nodes += c->radix_nodes;
+        content_bytes += c->content_bytes;
+        stored_bytes += c->stored_bytes;
+        dedup_saved += c->dedup_saved;
+        queue_length += __atomic_load_n(&c->queue.length, __ATOMIC_RELAXED);
+        for (int i = 0; i < c->max_entries; i++) {
+            if (!c->entries[i].is_valid) continue;
+            if (c->entries[i].stale) stale_entries++;
+            class_entries[c->entries[i].priority]++;
+            class_bytes[c->entries[i].priority] += c->entries[i].charge;
+        }
+        pthread_mutex_unlock(&c->mutex);
+    }
+
+    stats_printf(body, sizeof(body), &len,
+                 "requests: %lu\n"
+                 "cache_hits: %lu\n"
+                 "cache_misses: %lu\n"
+                 "range_hits: %lu\n"
+                 "cache_entries: %d\n"
+                 "cache_bytes: %zu\n",
+                 stats.requests, stats.cache_hits, stats.cache_misses, stats.range_hits,
+                 num_entries, cur_size);
+    stats_printf(body, sizeof(body), &len,
+                 "gzip_compressed: %lu\n"
+                 "gzip_served: %lu\n"
+                 "gzip_in_bytes: %lu\n"
+                 "gzip_out_bytes: %lu\n"
+                 "gzip_ratio: %.3f\n"
+                 "gzip_cpu_usec: %lu\n",
+                 stats.gzip_compressed, stats.gzip_served, stats.gzip_in_bytes,
+                 stats.gzip_out_bytes,
+                 stats.gzip_in_bytes ? (double)stats.gzip_out_bytes / stats.gzip_in_bytes : 0.0,
+                 stats.gzip_cpu_usec);
+    stats_printf(body, sizeof(body), &len,
+                 "lz_enabled: %d\n"
+                 "lz_objects: %lu\n"
+                 "lz_raw_objects: %lu\n"
+                 "lz_content_bytes: %zu\n"
+                 "lz_stored_bytes: %zu\n"
+                 "lz_ratio: %.3f\n"
+                 "lz_hits: %lu\n"
+                 "lz_decompress_nsec_per_hit: %lu\n",
+                 config.cache_compress, stats.lz_objects, stats.lz_raw_objects,
+                 content_bytes, stored_bytes,
+                 content_bytes ? (double)stored_bytes / content_bytes : 0.0,
+                 stats.lz_hits, stats.lz_hits ? stats.lz_decompress_nsec / stats.lz_hits : 0);
+    stats_printf(body, sizeof(body), &len,
+                 "dedup_hits: %lu\n"
+                 "dedup_saved_bytes: %zu\n",
+                 stats.dedup_hits, dedup_saved);
+    stats_printf(body, sizeof(body), &len,
+                 "vary_urls: %d\n"
+                 "vary_variants_per_url: %.2f\n"
+                 "vary_hits: %lu\n",
+                 num_urls, num_urls ? (double)num_entries / num_urls : 0.0, stats.vary_hits);
+    stats_printf(body, sizeof(body), &len,
+                 "norm_rewrites: %lu\n"
+                 "norm_hits: %lu\n"
+                 "hit_ratio: %.3f\n"
+                 "hit_ratio_without_norm: %.3f\n",
+                 stats.norm_rewrites, stats.norm_hits,
+                 stats.requests ? (double)stats.cache_hits / stats.requests : 0.0,
+                 stats.requests ? (double)(stats.cache_hits - stats.norm_hits) / stats.requests : 0.0);
+    stats_printf(body, sizeof(body), &len,
+                 "ttl_expired: %lu\n"
+                 "client_timeouts: %lu\n"
+                 "upstream_timeouts: %lu\n"
+                 "timeouts_connect: %lu\n"
+                 "timeouts_first_byte: %lu\n"
+                 "timeouts_idle: %lu\n"
+                 "gateway_timeouts: %lu\n"
+                 "wheel_timers: %d\n"
+                 "wheel_cascades: %lu\n",
+                 stats.ttl_expired, stats.client_timeouts,
+                 stats.connect_timeouts + stats.first_byte_timeouts + stats.upstream_timeouts,
+                 stats.connect_timeouts, stats.first_byte_timeouts, stats.upstream_timeouts,
+                 stats.gateway_timeouts, timers, stats.wheel_cascades);
+    stats_printf(body, sizeof(body), &len,
+                 "purges: %lu\n"
+                 "bans: %lu\n"
+                 "invalidated_entries: %lu\n"
+                 "radix_nodes: %d\n",
+                 stats.purges, stats.bans, stats.invalidated, radix_nodes);
+    stats_printf(body, sizeof(body), &len,
+                 "negative_hits: %lu\n"
+                 "origin_failures: %lu\n"
+                 "origin_fail_hits: %lu\n",
+                 stats.negative_hits, stats.origin_failures, stats.origin_fail_hits);
+    stats_printf(body, sizeof(body), &len,
+                 "stale_entries: %d\n"
+                 "stale_served: %lu\n",
+                 stale_entries, stats.stale_served);
+    stats_printf(body, sizeof(body), &len,
+                 "origin_quota_bytes: %zu\n"
+                 "origin_quota_entries: %d\n"
+                 "quota_evictions: %lu\n"
+                 "quota_rejects: %lu\n",
+                 config.origin_bytes, config.origin_entries, stats.quota_evictions,
+                 stats.quota_rejects);
+    stats_printf(body, sizeof(body), &len,
+                 "pinned_entries: %d\n"
+                 "pinned_bytes: %zu\n"
+                 "normal_entries: %d\n"
+                 "low_entries: %d\n"
+                 "evictions_normal: %lu\n"
+                 "evictions_low: %lu\n",
+                 class_entries[PRIO_PINNED], class_bytes[PRIO_PINNED], class_entries[PRIO_NORMAL],
+                 class_entries[PRIO_LOW], stats.evictions[PRIO_NORMAL], stats.evictions[PRIO_LOW]);
+    stats_printf(body, sizeof(body), &len,
+                 "populate_queued: %lu\n"
+                 "populate_dropped: %lu\n"
+                 "populate_queue_length: %d\n",
+                 stats.populate_queued, stats.populate_dropped, queue_length);
+    stats_printf(body, sizeof(body), &len,
+                 "partitions: %d\n"
+                 "routed_requests: %lu\n",
+                 config.partitions, stats.routed_requests);
+
+    // 핫 객체: 아직 노화 때 옮겨 담지 않은 사본 히트까지 더함
+    pthread_mutex_lock(&hot.mutex);
+    hot_hits = stats.hot_hits;
+    for (int i = 0; i < config.hot; i++) {
+        if (hot.keys[i]) hot_keys++;
+        for (int c = 0; c < HOT_MAX_CPUS; c++) {
+            hot_replica_t *r = &hot_cores[c].slots[i];
+            if (r->data && !r->dead) hot_replicas++;
+            hot_hits += __atomic_load_n(&r->hits, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&hot.mutex);
+    stats_printf(body, sizeof(body), &len,
+                 "hot_keys: %d\n"
+                 "hot_replicas: %d\n"
+                 "hot_hits: %lu\n"
+                 "hot_promotions: %lu\n",
+                 hot_keys, hot_replicas, hot_hits, stats.hot_promotions);
+    stats_printf(body, sizeof(body), &len,
+                 "arena_pages: %s\n"
+                 "arena_fallbacks: %lu\n"
+                 "numa_nodes: %d\n"
+                 "numa_local_hits: %lu\n"
+                 "numa_remote_hits: %lu\n",
+                 arenas[0].base ? arenas[0].mode : "none", stats.arena_fallbacks, num_nodes,
+                 stats.numa_local_hits, stats.numa_remote_hits);
+    stats_printf(body, sizeof(body), &len,
+                 "peers: %d\n"
+                 "peer_requests: %lu\n"
+                 "peer_failures: %lu\n"
+                 "peer_served: %lu\n",
+                 num_peers, stats.peer_requests, stats.peer_failures, stats.peer_served);
+
+    // 노드별 아레나: 블록 사용량과 /proc/self/numa_maps로 본 실제 페이지 위치 (본문 버퍼가 차면 생략)
+    long pages[NUMA_MAX_NODES][NUMA_MAX_NODES];
+    numa_arena_pages(pages);
+    for (int n = 0; n < num_nodes; n++) {
+        long local = 0, remote = 0;
+        if (!arenas[n].base) continue;
+        for (int k = 0; k < NUMA_MAX_NODES; k++) {
+            if (k == n) local += pages[n][k];
+            else remote += pages[n][k];
+        }
+        pthread_mutex_lock(&block_pool_mutex);
+        stats_printf(body, sizeof(body), &len,
+                     "arena node%d: blocks_used=%d/%d bound=%d local_pages=%ld remote_pages=%ld\n", n,
+                     ARENA_BLOCKS - arenas[n].free_count, ARENA_BLOCKS, arenas[n].bound, local, remote);
+        pthread_mutex_unlock(&block_pool_mutex);
+    }
+
+    // 회로 차단기 (연결 대상별, 본문 버퍼가 차면 나머지는 생략)
+    static const char *breaker_states[] = {"closed", "open", "half-open"};
+    pthread_mutex_lock(&breakers_mutex);
+    stats_printf(body, sizeof(body), &len,
+                 "breakers: %d\n"
+                 "breaker_trips: %lu\n"
+                 "breaker_rejects: %lu\n"
+                 "breaker_evictions: %lu\n",
+                 num_breakers, stats.breaker_trips, stats.breaker_rejects, stats.breaker_evictions);
+    for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        for (breaker_t *b = breakers[i]; b && len + 512 < sizeof(body); b = b->next) {
+            stats_printf(body, sizeof(body), &len,
+                         "breaker %.200s:%s: state=%s failures=%d trips=%lu rejected=%lu probes=%lu "
+                         "probe_failures=%lu latency_p50_ms=%.1f latency_p%d_ms=%.1f\n",
+                         b->host, b->port, breaker_states[b->state], b->failures, b->trips, b->rejected,
+                         b->probes, b->probe_failures, latency_percentile(b, 50) / 1000.0,
+                         config.hedge ? config.hedge : 99,
+                         latency_percentile(b, config.hedge ? config.hedge : 99) / 1000.0);
+        }
+    }
+    pthread_mutex_unlock(&breakers_mutex);
+
+    stats_printf(body, sizeof(body), &len,
+                 "hedge_percentile: %d\n"
+                 "hedge_checked: %lu\n"
+                 "hedged: %lu\n"
+                 "hedge_rate: %.3f\n"
+                 "hedge_wins: %lu\n",
+                 config.hedge, stats.hedge_checked, stats.hedged,
+                 stats.hedge_checked ? (double)stats.hedged / stats.hedge_checked : 0.0, stats.hedge_wins);
+
+    // 백엔드별 부하와 지연 (본문 버퍼가 차면 나머지는 생략)
+    for (int p = 0; p < num_pools; p++) {
+        for (int i = 0; i < pools[p].num_backends; i++) {
+            backend_t *b = &pools[p].backends[i];
+            stats_printf(body, sizeof(body), &len,
+                         "backend %.200s:%s: origin=%.200s:%s inflight=%d requests=%lu failures=%lu "
+                         "latency_ewma_ms=%.3f\n",
+                         b->host, b->port, pools[p].host, pools[p].port,
+                         __atomic_load_n(&b->inflight, __ATOMIC_RELAXED), b->requests, b->failures,
+                         b->ewma_usec / 1000.0);
+        }
+    }
+
+    // 공유 메모리 캐시 (워커 프로세스 모드). 위의 다른 값은 이 요청을 받은 프로세스만의 값
+    if (shm) {
+        int shm_entries = 0, shm_blocks;
+        shm_lock();
+        for (int i = 0; i < SHM_ENTRIES; i++) {
+            if (shm->entries[i].state == SHM_READY) shm_entries++;
+        }
+        shm_blocks = SHM_BLOCKS - shm->free_blocks;
+        stats_printf(body, sizeof(body), &len,
+                     "worker_pid: %d\n"
+                     "shm_entries: %d\n"
+                     "shm_bytes: %zu\n"
+                     "shm_hits: %lu\n"
+                     "shm_stores: %lu\n"
+                     "shm_evictions: %lu\n"
+                     "worker_restarts: %lu\n"
+                     "shm_lock_recoveries: %lu\n"
+                     "shm_released_refs: %lu\n",
+                     getpid(), shm_entries, (size_t)shm_blocks * CACHE_BLOCK_SIZE, shm->hits,
+                     shm->stores, shm->evictions, shm->restarts, shm->recoveries, shm->released_refs);
+        shm_unlock();
+    }
+    // 오탐률: 실제로 없던 조회 중 필터가 걸러내지 못한 비율
+    stats_printf(body, sizeof(body), &len,
+                 "bloom_skips: %lu\n"
+                 "bloom_false_positives: %lu\n"
+                 "bloom_false_positive_rate: %.4f\n",
+                 stats.bloom_skips, stats.bloom_false_positives,
+                 stats.bloom_skips + stats.bloom_false_positives
+                     ? (double)stats.bloom_false_positives / (stats.bloom_skips + stats.bloom_false_positives)
+                     : 0.0);
+
+    // 원 서버별 점유량과 히트율 (분할마다 따로, 본문 버퍼가 차면 나머지는 생략)
+    for (int p = 0; p < config.partitions; p++) {
+        cache_t *c = &cache_parts[p];
+        pthread_mutex_lock(&c->mutex);
+        for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+            for (cache_origin_t *o = c->origins[i]; o && len + 512 < sizeof(body); o = o->next) {
+                stats_printf(body, sizeof(body), &len,
+                             "origin %.200s: partition=%d entries=%d bytes=%zu hits=%lu misses=%lu "
+                             "hit_ratio=%.3f\n",
+                             o->name, p, o->entries, o->bytes, o->hits, o->misses,
+                             o->hits + o->misses ? (double)o->hits / (o->hits + o->misses) : 0.0);
+            }
+        }
+        pthread_mutex_unlock(&c->mutex);
+    }
+
+    send_text(connfd, "200 OK", body);
+}
+
+/* 통계 본문에 덧붙임. 남은 공간에 다 들어가지 않으면 덧붙이지 않고 len은 버퍼 안에 머묾 */
+void stats_printf(char *body, size_t cap, size_t *len, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (*len + 1 >= cap) return;
+    va_start(ap, fmt);
+    n = vsnprintf(body + *len, cap - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= cap - *len) {
+        body[*len] = '\0';  // 잘린 줄은 남기지 않음
+        return;
+    }
+    *len += n;
+}
+
+/* 캐시 초기화 함수 */
+void cache_init(int max_entries, size_t max_size) {
+    cache->entries = (cache_entry_t *)Calloc(max_entries, sizeof(cache_entry_t));
+    cache->num_entries = 0;
+    cache->max_entries = max_entries;
+    cache->max_size = max_size;
+    cache->node = (cache - cache_parts) % num_nodes;  // 분할을 노드에 번갈아 배치
+    cache->current_size = 0;
+    cache->content_bytes = 0;
+    cache->stored_bytes = 0;
+    cache->dedup_saved = 0;
+    memset(cache->bodies, 0, sizeof(cache->bodies));
+    memset(cache->urls, 0, sizeof(cache->urls));
+    memset(cache->origins, 0, sizeof(cache->origins));
+    memset(cache->bloom, 0, sizeof(cache->bloom));
+    cache->num_urls = 0;
+    cache->radix_nodes = 0;
+    cache->radix = radix_new("", 0);
+    pthread_mutex_init(&cache->mutex, NULL);
+
+    for (int i = 0; i < max_entries; i++) {
+        cache->entries[i].is_valid = 0;
+        cache->entries[i].url = NULL;
+        cache->entries[i].headers = NULL;
+        cache->entries[i].body = NULL;
+        cache->entries[i].gz = NULL;
+        cache->entries[i].timestamp = 0;
+        cache->entries[i].readers = 0;
+        cache->entries[i].part = cache;
+        pthread_rwlock_init(&cache->entries[i].rwlock, NULL);
+        wheel_timer_init(&cache->entries[i].ttl_timer, cache_expire_entry, &cache->entries[i]);
+    }
+}
+
+/* 캐시 해제 함수 */
+void cache_free(void) {
+    pthread_mutex_lock(&cache->mutex);
+    for (int i = 0; i < cache->max_entries; i++) {
+        if (cache->entries[i].is_valid) {
+            cache_remove_entry(&cache->entries[i]);
+        }
+        pthread_rwlock_destroy(&cache->entries[i].rwlock);
+    }
+    for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        while (cache->origins[i]) {
+            cache_origin_t *o = cache->origins[i];
+            cache->origins[i] = o->next;
+            Free(o->name);
+            Free(o);
+        }
+    }
+    Free(cache->entries);
+    pthread_mutex_unlock(&cache->mutex);
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+/* 현재 시간 반환 */
+unsigned long get_timestamp(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* idx번째 블록의 길이 (마지막 블록은 더 짧을 수 있음) */
+size_t cache_block_len(size_t object_size, int idx) {
+    size_t off = (size_t)idx * CACHE_BLOCK_SIZE;
+    return object_size - off < CACHE_BLOCK_SIZE ? object_size - off : CACHE_BLOCK_SIZE;
+}
+
+/*
+ * idx번째 블록의 원본 데이터. 압축된 블록이면 tmp(CACHE_BLOCK_SIZE)에 풀어서 돌려주고
+ * nsec이 있으면 푸는 데 걸린 시간을 더한다. 본문을 가진 항목의 읽기 락을 잡은 상태여야 한다.
+ */
+const char *cache_block_data(cache_body_t *body, int idx, char *tmp, unsigned long *nsec) {
+    size_t len = cache_block_len(body->size, idx);
+    unsigned long t;
+
+    if (body->block_sizes[idx] == len) return body->blocks[idx];
+    t = nsec ? now_nsec() : 0;
+    if (lzb_decompress(body->blocks[idx], body->block_sizes[idx], tmp, len) != (ssize_t)len) {
+        app_error("cache block decompression failed");  // 캐시 메모리 손상
+    }
+    if (nsec) *nsec += now_nsec() - t;
+    return tmp;
+}
+
+/*
+ * 응답 캡처
+ *
+ * 미스 응답은 캐시 블록 크기의 버퍼 체인에 바로 읽어 들이고, 그 버퍼에서 클라이언트로 보낸다.
+ * 캐싱에 성공하면 블록이 그대로 캐시 본문이 되므로 중간 버퍼와 복사가 없다. 캐싱하지 않은
+ * 블록은 다음 미스에서 다시 쓰도록 풀에 모아 둔다.
+ */
+
+/*
+ * 캐시 블록 아레나
+ *
+ * 캐시 본문 블록은 하나의 연속 영역에서 잘라 쓴다. 히트가 많을 때 여러 본문을 오가며 생기는
+ * TLB 미스를 줄이려고 영역을 큰 페이지로 잡는다: 예약된 hugetlbfs 페이지(MAP_HUGETLB)가 있으면
+ * 그것을, 없으면 큰 페이지 경계에 맞춘 영역에 투명 큰 페이지(MADV_HUGEPAGE)를 요청하고,
+ * 그것도 안 되면 일반 페이지로 쓴다. 아레나가 비면 블록은 malloc으로 잡는다.
+ *
+ * NUMA 호스트에서는 노드마다 아레나를 따로 잡아 그 노드에 묶고(mbind), 캐시 분할도 노드에
+ * 번갈아 배치한다. 분할의 본문 블록은 그 노드 아레나에서 잡고 분할 워커도 그 노드의 CPU에
+ * 고정하므로, 워커가 보내는 히트는 같은 노드 메모리를 읽는다.
+ */
+
+/* /sys/devices/system/node에서 CPU별 노드를 읽음 (없으면 모든 CPU가 노드 0) */
+void numa_init(void) {
+    char path[MAXLINE], list[MAXLINE];
+    FILE *fp;
+
+    for (int n = 0; n < NUMA_MAX_NODES; n++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if (!(fp = fopen(path, "r"))) continue;
+        if (fgets(list, sizeof(list), fp)) {
+            // "0-3,8-11" 형식
+            for (char *tok = strtok(list, ",\n"); tok; tok = strtok(NULL, ",\n")) {
+                int first, last;
+                if (sscanf(tok, "%d-%d", &first, &last) != 2) last = first = atoi(tok);
+                for (int cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; cpu++) cpu_node[cpu] = n;
+            }
+            if (n + 1 > num_nodes) num_nodes = n + 1;
+        }
+        fclose(fp);
+    }
+    printf("NUMA nodes: %d\n", num_nodes);
+}
+
+/* 지금 실행 중인 CPU의 노드 */
+int numa_current_node(void) {
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu_node[cpu % NUMA_MAX_CPUS];
+}
+
+/* 노드 하나의 아레나 영역을 잡고 블록을 빈 목록에 넣음 */
+static void arena_map(arena_t *a, int node) {
+    size_t size = ARENA_SIZE + HUGE_PAGE_SIZE;
+    unsigned long nodemask = 1UL << node;
+    char *p, *aligned;
+
+    if (!config.no_huge_pages) {
+        p = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            a->base = p;
+            a->mode = "hugetlb";
+        }
+    }
+    if (!a->base) {
+        // 큰 페이지 하나만큼 더 잡아 경계에 맞추고 앞뒤 남는 부분은 돌려줌
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            printf("Cache arena for node %d unavailable (%s), using malloc\n", node, strerror(errno));
+            return;
+        }
+        aligned = (char *)(((unsigned long)p + HUGE_PAGE_SIZE - 1) & ~(unsigned long)(HUGE_PAGE_SIZE - 1));
+        if (aligned > p) munmap(p, aligned - p);
+        if (p + size > aligned + ARENA_SIZE) munmap(aligned + ARENA_SIZE, p + size - (aligned + ARENA_SIZE));
+        a->base = aligned;
+        if (config.no_huge_pages) {
+            madvise(a->base, ARENA_SIZE, MADV_NOHUGEPAGE);  // THP가 always여도 일반 페이지로
+            a->mode = "4k";
+        } else {
+            a->mode = madvise(a->base, ARENA_SIZE, MADV_HUGEPAGE) == 0 ? "thp" : "4k";
+        }
+    }
+    // 아직 페이지를 건드리기 전이므로 앞으로 할당되는 페이지가 이 노드에 놓임
+    // (libnuma 없이 mbind 시스템 콜을 직접 부름, 노드 메모리가 모자라면 다른 노드로 넘어감).
+    // 노드가 하나여도 묶어 두면 아레나가 이웃 매핑과 합쳐지지 않아 numa_maps에서 따로 보임
+    a->bound = syscall(SYS_mbind, a->base, ARENA_SIZE, MPOL_PREFERRED, &nodemask,
+                       sizeof(nodemask) * 8, 0) == 0;
+    // 낮은 주소부터 꺼내 쓰도록 거꾸로 넣음
+    for (int i = ARENA_BLOCKS - 1; i >= 0; i--) a->free[a->free_count++] = a->base + (size_t)i * CACHE_BLOCK_SIZE;
+    printf("Cache arena node %d: %d blocks of %d bytes, %s pages%s\n", node, ARENA_BLOCKS, CACHE_BLOCK_SIZE,
+           a->mode, a->bound ? ", bound" : "");
+}
+
+/* 노드마다 아레나를 잡음 (스레드 시작 전, 워커 프로세스마다) */
+void arena_init(void) {
+    for (int n = 0; n < num_nodes; n++) arena_map(&arenas[n], n);
+}
+
+/* 블록이 잘려 나온 아레나의 노드 (아레나 블록이 아니면 -1) */
+int block_arena(const char *block) {
+    for (int n = 0; n < num_nodes; n++) {
+        if (arenas[n].base && block >= arenas[n].base && block < arenas[n].base + ARENA_SIZE) return n;
+    }
+    return -1;
+}
+
+/* 아레나에서 잘라 준 블록인지 */
+int block_in_arena(const char *block) {
+    return block_arena(block) >= 0;
+}
+
+/*
+ * 빈 CACHE_BLOCK_SIZE 블록. 분할 모드에서는 지금 다루는 분할의 노드, 아니면 이 스레드가 도는
+ * 노드의 아레나를 먼저 쓰고, 다른 노드 아레나, 풀 순서로 재사용한다.
+ */
+char *block_get(void) {
+    int home = config.partitions > 1 ? cache->node : numa_current_node();
+    char *block = NULL;
+
+    pthread_mutex_lock(&block_pool_mutex);
+    for (int i = 0; i < num_nodes && !block; i++) {
+        arena_t *a = &arenas[(home + i) % num_nodes];
+        if (a->free_count > 0) block = a->free[--a->free_count];
+    }
+    if (!block && block_pool_count > 0) block = block_pool[--block_pool_count];
+    pthread_mutex_unlock(&block_pool_mutex);
+    if (!block && arenas[0].base) STAT_ADD(arena_fallbacks, 1);
+    return block ? block : Malloc(CACHE_BLOCK_SIZE);
+}
+
+/* 캐시 본문 블록 해제 (아레나 블록이면 그 아레나의 빈 목록으로, 압축본 등 크기가 다른 블록은 free) */
+void block_free(char *block) {
+    int n = block_arena(block);
+
+    if (n < 0) {
+        Free(block);
+        return;
+    }
+    pthread_mutex_lock(&block_pool_mutex);
+    arenas[n].free[arenas[n].free_count++] = block;
+    pthread_mutex_unlock(&block_pool_mutex);
+}
+
+/* /proc/self/numa_maps에서 아레나별로 노드마다 놓인 페이지 수 (pages[아레나 노드][실제 노드]) */
+void numa_arena_pages(long pages[NUMA_MAX_NODES][NUMA_MAX_NODES]) {
+    char line[MAXLINE];
+    FILE *fp;
+
+    memset(pages, 0, sizeof(long) * NUMA_MAX_NODES * NUMA_MAX_NODES);
+    if (!(fp = fopen("/proc/self/numa_maps", "r"))) return;
+    while (fgets(line, sizeof(line), fp)) {
+        // "<시작 주소> <정책> ... N0=<페이지> N1=<페이지> ..."
+        int n = block_arena((char *)strtoul(line, NULL, 16));
+        if (n < 0) continue;
+        for (char *q = strstr(line, " N"); q; q = strstr(q + 1, " N")) {
+            int node;
+            long count;
+            if (sscanf(q, " N%d=%ld", &node, &count) == 2 && node >= 0 && node < NUMA_MAX_NODES) {
+                pages[n][node] += count;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+/* 다 쓴 블록을 돌려줌 (아레나 블록은 아레나로, 그 밖에는 풀로, 풀이 차면 해제) */
+void block_put(char *block) {
+    if (block_in_arena(block)) {
+        block_free(block);
+        return;
+    }
+    pthread_mutex_lock(&block_pool_mutex);
+    if (block_pool_count < BLOCK_POOL_SIZE) {
+        block_pool[block_pool_count++] = block;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&block_pool_mutex);
+    if (block) Free(block);
+}
+
+/* 빈 체인. capture가 0이면 캐싱하지 않고 중계 버퍼로만 씀 */
+void chain_init(chain_t *chain, int capture) {
+    chain->num_blocks = 0;
+    chain->size = 0;
+    chain->capture = capture;
+}
+
+/* 다음에 읽어 들일 위치와 크기 (한 번에 MAXLINE까지, 필요하면 블록을 새로 붙임) */
+char *chain_space(chain_t *chain, size_t *avail) {
+    size_t used = chain->capture ? chain->size % CACHE_BLOCK_SIZE : 0;
+
+    if (chain->num_blocks == 0 || (chain->capture && used == 0 && chain->size > 0)) {
+        chain->blocks[chain->num_blocks++] = block_get();
+    }
+    *avail = CACHE_BLOCK_SIZE - used < MAXLINE ? CACHE_BLOCK_SIZE - used : MAXLINE;
+    return chain->blocks[chain->num_blocks - 1] + used;
+}
+
+/* 방금 읽은 n 바이트 반영. 최대 객체 크기를 넘으면 캡처를 멈추고 첫 블록만 남김 */
+void chain_commit(chain_t *chain, size_t n) {
+    chain->size += n;
+    if (chain->capture && chain->size > MAX_OBJECT_SIZE) {
+        chain->capture = 0;
+        while (chain->num_blocks > 1) block_put(chain->blocks[--chain->num_blocks]);
+    }
+}
+
+/* 남은 블록을 모두 풀로 돌려줌 (cache_add가 넘겨받은 블록은 NULL) */
+void chain_release(chain_t *chain) {
+    for (int i = 0; i < chain->num_blocks; i++) {
+        if (chain->blocks[i]) block_put(chain->blocks[i]);
+    }
+    chain->num_blocks = 0;
+}
+
+/*
+ * 본문 공유 (내용 주소 기반 중복 제거)
+ *
+ * 완성된 본문은 내용 해시로 cache->bodies 테이블에 등록되고, 같은 내용의 본문이
+ * 다시 들어오면 새로 저장하지 않고 기존 본문의 참조 카운트만 올린다.
+ * 등록된 본문은 읽기 전용이며 마지막 참조가 사라질 때 해제된다.
+ * 아래 함수들은 모두 cache->mutex를 잡은 상태에서 호출한다.
+ */
+
+/* 빈 본문 생성 (아직 캐시 크기에 반영되지 않음) */
+cache_body_t *body_new(size_t size) {
+    cache_body_t *body = (cache_body_t *)Calloc(1, sizeof(cache_body_t));
+    int n = (size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+
+    body->size = size;
+    body->num_blocks = n;
+    body->blocks = (char **)Calloc(n ? n : 1, sizeof(char *));
+    body->block_sizes = (unsigned int *)Calloc(n ? n : 1, sizeof(unsigned int));
+    body->lz_mode = -1;
+    body->refcnt = 1;
+    body->pins = 1;
+    return body;
+}
+
+/* 본문 메모리 해제 */
+void body_destroy(cache_body_t *body) {
+    for (int i = 0; i < body->num_blocks; i++) {
+        if (body->blocks[i]) block_free(body->blocks[i]);
+    }
+    Free(body->blocks);
+    Free(body->block_sizes);
+    Free(body);
+}
+
+/* 본문 내용의 64비트 FNV-1a 해시 */
+unsigned long body_hash(cache_body_t *body) {
+    char tmp[CACHE_BLOCK_SIZE];
+    unsigned long h = 14695981039346656037UL;
+
+    for (int i = 0; i < body->num_blocks; i++) {
+        const unsigned char *p = (const unsigned char *)cache_block_data(body, i, tmp, NULL);
+        size_t len = cache_block_len(body->size, i);
+        for (size_t k = 0; k < len; k++) h = (h ^ p[k]) * 1099511628211UL;
+    }
+    return h;
+}
+
+/* 두 본문의 내용이 같은지 (해시 충돌 확인용) */
+int body_equal(cache_body_t *a, cache_body_t *b) {
+    char tmp_a[CACHE_BLOCK_SIZE], tmp_b[CACHE_BLOCK_SIZE];
+
+    if (a->size != b->size) return 0;
+    for (int i = 0; i < a->num_blocks; i++) {
+        if (memcmp(cache_block_data(a, i, tmp_a, NULL), cache_block_data(b, i, tmp_b, NULL),
+                   cache_block_len(a->size, i))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * 완성된 본문을 공유 테이블에 등록. 같은 내용이 이미 있으면 그 본문의 참조를 늘려
+ * 돌려주고 body는 놓아준다 (body는 hash가 계산된 상태여야 함).
+ */
+cache_body_t *body_intern(cache_body_t *body) {
+    int bucket = body->hash % BODY_TABLE_SIZE;
+
+    for (cache_body_t *b = cache->bodies[bucket]; b; b = b->next) {
+        if (b->hash == body->hash && body_equal(b, body)) {
+            b->refcnt++;
+            cache->dedup_saved += b->stored_size;
+            STAT_ADD(dedup_hits, 1);
+            body_release(body);
+            return b;
+        }
+    }
+    body->shared = 1;
+    body->next = cache->bodies[bucket];
+    cache->bodies[bucket] = body;
+    return body;
+}
+
+/* 본문 참조 해제. 마지막 참조였으면 테이블에서 빼고 메모리 반환 */
+void body_release(cache_body_t *body) {
+    if (--body->refcnt > 0) {
+        cache->dedup_saved -= body->stored_size;
+        return;
+    }
+    if (body->shared) {
+        cache_body_t **pp = &cache->bodies[body->hash % BODY_TABLE_SIZE];
+        while (*pp != body) pp = &(*pp)->next;
+        *pp = body->next;
+    }
+    cache->current_size -= body->stored_size;
+    cache->content_bytes -= body->content_size;
+    cache->stored_bytes -= body->stored_size;
+    body_unpin(body);  // 보내는 중인 스레드가 있으면 그 스레드가 마지막에 해제
+}
+
+/* 본문 고정 해제. 캐시도 놓았고 보내는 스레드도 없으면 메모리 반환 (락 없이 호출) */
+void body_unpin(cache_body_t *body) {
+    if (__atomic_sub_fetch(&body->pins, 1, __ATOMIC_ACQ_REL) == 0) body_destroy(body);
+}
+
+/*
+ * URL 색인
+ *
+ * 캐시 키는 "URL" 또는 "URL 이름=값;..." (Vary 변형) 형태다. 키의 URL 부분 해시로
+ * cache->urls에서 URL 색인을 찾고, 그 안의 변형들 중 키 해시가 같은 항목을 고른다.
+ * 해시는 요청마다 canonicalize_url / make_cache_key에서 한 번만 계산된다.
+ * 아래 함수들은 모두 cache->mutex를 잡은 상태에서 호출한다.
+ */
+
+/* 64비트 FNV-1a 문자열 해시 */
+unsigned long str_hash(const char *s, size_t n) {
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char)s[i]) * 1099511628211UL;
+    return h;
+}
+
+/* URL(url의 앞 len 바이트, 해시 hash)에 해당하는 색인 찾기 */
+url_index_t *url_index_find(const char *url, size_t len, unsigned long hash) {
+    for (url_index_t *u = cache->urls[hash % URL_TABLE_SIZE]; u; u = u->next) {
+        if (u->hash == hash && !strncmp(u->url, url, len) && u->url[len] == '\0') return u;
+    }
+    return NULL;
+}
+
+/*
+ * key로 새 항목을 넣기 전에 같은 URL의 변형을 정리. 원 서버의 Vary 목록이 바뀌었으면
+ * 예전 목록으로 만든 변형은 모두 버리고, 변형 수가 가득 찼으면 가장 오래된 변형을 버린다.
+ */
+void url_index_prepare(cache_key_t *key, const char *names) {
+    url_index_t *u;
+
+    while ((u = url_index_find(key->str, key->url_len, key->url_hash)) && strcmp(u->vary, names)) {
+        cache_remove_entry(u->variants[0]);
+    }
+    while ((u = url_index_find(key->str, key->url_len, key->url_hash)) &&
+           u->num_variants >= MAX_VARIANTS) {
+        int oldest = 0;
+        for (int i = 1; i < u->num_variants; i++) {
+            if (u->variants[i]->timestamp < u->variants[oldest]->timestamp) oldest = i;
+        }
+        cache_remove_entry(u->variants[oldest]);
+    }
+}
+
+/* 새 항목을 URL 색인에 등록 (url_index_prepare로 자리를 만든 뒤 호출) */
+void url_index_link(cache_entry_t *entry, const char *names) {
+    size_t n = strcspn(entry->url, " ");
+    url_index_t *u = url_index_find(entry->url, n, entry->url_hash);
+
+    if (!u) {
+        u = (url_index_t *)Calloc(1, sizeof(url_index_t));
+        u->url = strndup(entry->url, n);
+        u->hash = entry->url_hash;
+        u->vary = strdup(names);
+        u->next = cache->urls[u->hash % URL_TABLE_SIZE];
+        cache->urls[u->hash % URL_TABLE_SIZE] = u;
+        cache->num_urls++;
+        radix_insert(u->url, u);
+        bloom_add(u->hash);
+        if (names[0]) bloom_add(url_vary_hash(u->hash));
+    }
+    u->variants[u->num_variants] = entry;
+    u->variant_hashes[u->num_variants] = entry->key_hash;
+    u->num_variants++;
+}
+
+/* 항목을 URL 색인에서 뺌. 마지막 변형이었으면 색인도 해제 */
+void url_index_unlink(cache_entry_t *entry) {
+    url_index_t *u = url_index_find(entry->url, strcspn(entry->url, " "), entry->url_hash), **pp;
+
+    for (int i = 0; i < u->num_variants; i++) {
+        if (u->variants[i] == entry) {
+            u->num_variants--;
+            u->variants[i] = u->variants[u->num_variants];
+            u->variant_hashes[i] = u->variant_hashes[u->num_variants];
+            break;
+        }
+    }
+    if (u->num_variants > 0) return;
+
+    for (pp = &cache->urls[u->hash % URL_TABLE_SIZE]; *pp != u; pp = &(*pp)->next)
+        ;
+    *pp = u->next;
+    cache->num_urls--;
+    radix_remove(u->url);
+    bloom_del(u->hash);
+    if (u->vary[0]) bloom_del(url_vary_hash(u->hash));
+    Free(u->url);
+    Free(u->vary);
+    Free(u);
+}
+
+/*
+ * URL 기수 트리 (radix tree)
+ *
+ * URL 색인을 정규화된 URL 문자열로 다시 한 번 모아 둔 압축 트라이. 간선마다 문자열
+ * 조각을 두고 자식은 첫 글자로 고르므로, 정확한 URL이든 접두사든 찾는 비용은 키
+ * 길이에 비례한다. BAN은 접두사에 해당하는 부분 트리만 훑는다.
+ * 아래 함수들은 모두 cache->mutex를 잡은 상태에서 호출한다.
+ */
+
+radix_node_t *radix_new(const char *label, size_t len) {
+    radix_node_t *node = (radix_node_t *)Calloc(1, sizeof(radix_node_t));
+    node->label = strndup(label, len);
+    node->len = len;
+    cache->radix_nodes++;
+    return node;
+}
+
+static void radix_free_node(radix_node_t *node) {
+    Free(node->label);
+    Free(node);
+    cache->radix_nodes--;
+}
+
+/* 첫 글자가 c인 자식 */
+static radix_node_t **radix_child(radix_node_t *node, char c) {
+    radix_node_t **pp = &node->child;
+    while (*pp && (*pp)->label[0] != c) pp = &(*pp)->sibling;
+    return pp;
+}
+
+/* key에 value를 등록 */
+void radix_insert(const char *key, url_index_t *value) {
+    radix_node_t *node = cache->radix;
+
+    while (*key) {
+        radix_node_t **pp = radix_child(node, *key), *c = *pp;
+        if (!c) {
+            c = radix_new(key, strlen(key));
+            c->sibling = node->child;
+            node->child = c;
+            node = c;
+            break;
+        }
+        size_t i = 0;
+        while (i < c->len && key[i] == c->label[i]) i++;
+        if (i < c->len) {
+            // 간선 중간에서 갈라지면 c를 둘로 나눔
+            radix_node_t *tail = radix_new(c->label + i, c->len - i);
+            tail->value = c->value;
+            tail->child = c->child;
+            c->value = NULL;
+            c->child = tail;
+            c->len = i;
+            c->label[i] = '\0';
+        }
+        node = c;
+        key += i;
+    }
+    node->value = value;
+}
+
+/* link가 가리키는 노드 아래에서 key의 값을 지우고, 필요 없어진 노드는 없애거나 합침 */
+static void radix_remove_at(radix_node_t **link, const char *key) {
+    radix_node_t *node = *link;
+
+    if (!*key) {
+        node->value = NULL;
+    } else {
+        radix_node_t **pp = radix_child(node, *key);
+        if (!*pp || strncmp((*pp)->label, key, (*pp)->len)) return;
+        radix_remove_at(pp, key + (*pp)->len);
+    }
+    if (link == &cache->radix || node->value) return;
+
+    if (!node->child) {
+        *link = node->sibling;
+        radix_free_node(node);
+    } else if (!node->child->sibling) {
+        // 자식이 하나뿐이면 간선을 이어 붙임
+        radix_node_t *c = node->child;
+        char *label = Malloc(node->len + c->len + 1);
+        memcpy(label, node->label, node->len);
+        memcpy(label + node->len, c->label, c->len + 1);
+        Free(c->label);
+        c->label = label;
+        c->len += node->len;
+        c->sibling = node->sibling;
+        *link = c;
+        radix_free_node(node);
+    }
+}
+
+void radix_remove(const char *key) {
+    radix_remove_at(&cache->radix, key);
+}
+
+/* prefix로 시작하는 키가 모여 있는 부분 트리의 루트 (없으면 NULL) */
+radix_node_t *radix_find_prefix(const char *prefix) {
+    radix_node_t *node = cache->radix;
+
+    while (*prefix) {
+        radix_node_t *c = *radix_child(node, *prefix);
+        size_t n = strlen(prefix);
+        if (!c) return NULL;
+        if (n <= c->len) return strncmp(c->label, prefix, n) ? NULL : c;
+        if (strncmp(c->label, prefix, c->len)) return NULL;
+        prefix += c->len;
+        node = c;
+    }
+    return node;
+}
+
+/* 부분 트리의 값을 out 배열에 모음 (배열은 필요하면 늘림) */
+void radix_collect(radix_node_t *node, url_index_t ***out, int *n, int *cap) {
+    if (node->value) {
+        if (*n == *cap) {
+            *cap = *cap ? *cap * 2 : 16;
+            *out = (url_index_t **)Realloc(*out, *cap * sizeof(url_index_t *));
+        }
+        (*out)[(*n)++] = node->value;
+    }
+    for (radix_node_t *c = node->child; c; c = c->sibling) radix_collect(c, out, n, cap);
+}
+
+/* URL 색인의 변형을 모두 제거 (마지막 변형과 함께 색인도 해제됨). 제거한 항목 수 반환 */
+int url_index_drop(url_index_t *u) {
+    int n = u->num_variants;
+    for (int i = n - 1; i >= 0; i--) cache_remove_entry(u->variants[i]);
+    return n;
+}
+
+/* key의 URL에 해당하는 모든 변형 제거. 제거한 항목 수 반환 */
+int cache_purge(cache_key_t *key) {
+    pthread_mutex_lock(&cache->mutex);
+    url_index_t *u = url_index_find(key->str, key->url_len, key->url_hash);
+    int n = u ? url_index_drop(u) : 0;
+    pthread_mutex_unlock(&cache->mutex);
+    return n;
+}
+
+/* prefix로 시작하는 URL의 항목을 모두 제거. 제거한 항목 수 반환 */
+int cache_ban(const char *prefix) {
+    url_index_t **found = NULL;
+    int n = 0, cap = 0, removed = 0;
+
+    pthread_mutex_lock(&cache->mutex);
+    radix_node_t *node = radix_find_prefix(prefix);
+    if (node) radix_collect(node, &found, &n, &cap);
+    for (int i = 0; i < n; i++) removed += url_index_drop(found[i]);
+    pthread_mutex_unlock(&cache->mutex);
+    if (found) Free(found);
+    return removed;
+}
+
+/* 키의 URL에 대한 Vary 헤더 이름 목록을 names에 복사 (모르면 빈 문자열) */
+void cache_url_vary(cache_key_t *key, char *names, size_t cap) {
+    // 한 번도 캐싱된 적 없거나 Vary 목록이 없는 URL이면 락 없이 끝냄
+    if (!bloom_maybe(key->url_hash) || !bloom_maybe(url_vary_hash(key->url_hash))) {
+        names[0] = '\0';
+        return;
+    }
+    pthread_mutex_lock(&cache->mutex);
+    url_index_t *u = url_index_find(key->str, key->url_len, key->url_hash);
+    snprintf(names, cap, "%s", u ? u->vary : "");
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ * 카운팅 블룸 필터
+ *
+ * 캐시에 있는 항목의 키 해시와 URL 색인의 URL 해시를 카운터 BLOOM_HASHES개씩에 더해 둔다.
+ * 조회는 카운터를 원자적으로 읽기만 하므로 락이 필요 없고, 하나라도 0이면 확실히 없다.
+ * 더하고 빼는 쪽은 cache->mutex를 잡은 상태에서 호출한다. 포화된 카운터(255)는 그대로 둔다.
+ */
+
+/* hash가 올리는 i번째 카운터 위치 (이중 해싱) */
+static unsigned bloom_slot(unsigned long hash, int i) {
+    return (unsigned)((hash + (unsigned long)i * ((hash >> 32) | 1)) % BLOOM_SIZE);
+}
+
+void bloom_add(unsigned long hash) {
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        unsigned char *c = &cache->bloom[bloom_slot(hash, i)];
+        if (*c < UCHAR_MAX) __atomic_fetch_add(c, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void bloom_del(unsigned long hash) {
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        unsigned char *c = &cache->bloom[bloom_slot(hash, i)];
+        if (*c > 0 && *c < UCHAR_MAX) __atomic_fetch_sub(c, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Vary 목록이 있는 URL을 필터에 따로 표시할 때 쓰는 해시 */
+unsigned long url_vary_hash(unsigned long url_hash) {
+    return url_hash * 0x9E3779B97F4A7C15UL;
+}
+
+/* hash가 캐시에 있을 수 있으면 1, 확실히 없으면 0 (락 없이 호출) */
+int bloom_maybe(unsigned long hash) {
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        if (!__atomic_load_n(&cache->bloom[bloom_slot(hash, i)], __ATOMIC_ACQUIRE)) return 0;
+    }
+    return 1;
+}
+
+/* 캐시 키에 해당하는 항목 찾기 (cache->mutex를 잡은 상태에서 호출) */
+cache_entry_t *cache_lookup(cache_key_t *key) {
+    if (!key->str[0]) return NULL;
+    url_index_t *u = url_index_find(key->str, key->url_len, key->url_hash);
+    if (!u) return NULL;
+
+    for (int i = 0; i < u->num_variants; i++) {
+        if (u->variant_hashes[i] == key->hash && !strcmp(u->variants[i]->url, key->str)) {
+            return u->variants[i];
+        }
+    }
+    return NULL;
+}
+
+/* 캐시에서 키에 해당하는 항목 찾기 (유예 구간의 만료 항목은 미스) */
+cache_entry_t *cache_find(cache_key_t *key) {
+    // 필터에 없으면 확실한 미스이므로 락을 잡지 않음
+    if (!key->str[0] || !bloom_maybe(key->hash)) {
+        STAT_ADD(bloom_skips, 1);
+        return NULL;
+    }
+    pthread_mutex_lock(&cache->mutex);
+    cache_entry_t *entry = cache_lookup(key);
+    if (!entry) STAT_ADD(bloom_false_positives, 1);
+    if (entry && entry->stale) entry = NULL;
+    if (entry) {
+        // 읽기 락 획득
+        pthread_rwlock_rdlock(&entry->rwlock);
+        // 타임스탬프 갱신
+        entry->timestamp = get_timestamp();
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return entry;
+}
+
+/* 원 서버 장애 때 대신 보낼 완전한 항목 찾기 (유예 구간의 만료 항목 포함, 오류 응답 제외) */
+cache_entry_t *cache_find_stale(cache_key_t *key) {
+    if (!bloom_maybe(key->hash)) return NULL;
+    pthread_mutex_lock(&cache->mutex);
+    cache_entry_t *entry = cache_lookup(key);
+    if (entry && (!entry->is_complete || entry->negative)) entry = NULL;
+    if (entry) pthread_rwlock_rdlock(&entry->rwlock);
+    pthread_mutex_unlock(&cache->mutex);
+    return entry;
+}
+
+/* 캐시 항목 읽기 완료 */
+void cache_read_complete(cache_entry_t *entry) {
+    pthread_rwlock_unlock(&entry->rwlock);
+}
+
+/* 캐시 항목 제거 (cache->mutex를 잡은 상태에서 호출) */
+void cache_remove_entry(cache_entry_t *entry) {
+    // 쓰기 락 획득
+    pthread_rwlock_wrlock(&entry->rwlock);
+
+    // 만료 타이머 해제 (이미 울려 실행 중이면 콜백이 is_valid로 확인함)
+    wheel_timer_del(&entry->ttl_timer, 0);
+
+    // 해당 항목의 메모리 해제 (공유 본문은 마지막 참조일 때만 해제됨)
+    if (config.hot) hot_drop(entry->key_hash);
+    bloom_del(entry->key_hash);
+    url_index_unlink(entry);
+    body_release(entry->body);
+    Free(entry->url);
+    Free(entry->headers);
+    if (entry->gz) {
+        cache->current_size -= entry->gz->size;
+        gzip_unpin(entry->gz);  // 보내는 중인 스레드가 있으면 그 스레드가 마지막에 해제
+    }
+
+    // 캐시 크기 갱신
+    cache->current_size -= entry->headers_size;
+    cache->num_entries--;
+    entry->origin->bytes -= entry->charge;
+    entry->origin->entries--;
+
+    // 캐시 항목 무효화
+    entry->url = NULL;
+    entry->headers = NULL;
+    entry->body = NULL;
+    entry->gz = NULL;
+    entry->is_valid = 0;
+
+    // 쓰기 락 해제
+    pthread_rwlock_unlock(&entry->rwlock);
+}
+
+/*
+ * 만료 타이머 콜백 (휠 스레드). 항목이 그 사이 바뀌었거나 읽는 중이면 건너뛰거나
+ * 한 틱 뒤에 다시 시도해서 휠 스레드가 오래 막히지 않게 한다.
+ * 완전한 정상 응답은 바로 지우지 않고 유예 구간(-g)으로 옮겼다가 그 시간이 지나면 지운다.
+ */
+void cache_expire_entry(wheel_timer_t *t) {
+    cache_entry_t *entry = (cache_entry_t *)t->arg;
+    unsigned long now = now_msec();
+
+    cache = entry->part;
+    pthread_mutex_lock(&cache->mutex);
+    if (entry->is_valid && entry->expires <= now && !entry->stale && config.grace > 0 &&
+        entry->is_complete && !entry->negative) {
+        printf("Expired %s (kept %lds for errors)\n", entry->url, config.grace);
+        entry->stale = 1;
+        if (config.hot) hot_drop(entry->key_hash);
+        entry->expires = now + config.grace * 1000;
+        wheel_timer_add(t, config.grace * 1000);
+        STAT_ADD(ttl_expired, 1);
+    } else if (entry->is_valid && entry->expires <= now) {
+        if (pthread_rwlock_trywrlock(&entry->rwlock) == 0) {
+            pthread_rwlock_unlock(&entry->rwlock);
+            printf("Expired %s\n", entry->url);
+            if (!entry->stale) STAT_ADD(ttl_expired, 1);
+            cache_remove_entry(entry);
+        } else {
+            wheel_timer_add(t, WHEEL_TICK_MS);
+        }
+    } else if (entry->is_valid && entry->expires > now) {
+        wheel_timer_add(t, entry->expires - now);  // 휠 틱 반올림으로 일찍 울린 경우
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ * 우선순위 클래스
+ *
+ * -p / -l 의 URL 패턴(fnmatch, 쉼표로 구분)으로 항목마다 클래스를 정한다. 제거할 항목은
+ * 유예 구간의 만료 항목, low, normal 순으로 고르고 같은 클래스 안에서는 LRU를 따른다.
+ * 고정(pinned) 항목은 LRU로 제거하지 않고 만료, PURGE / BAN, 같은 키의 새 응답으로만 바뀐다.
+ */
+
+/* list의 패턴 중 하나가 url과 맞는지 */
+int url_matches(const char *list, const char *url) {
+    char buf[MAXLINE], *tok, *save;
+
+    if (!list[0]) return 0;
+    strcpy(buf, list);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (!fnmatch(tok, url, 0)) return 1;
+    }
+    return 0;
+}
+
+/* 캐시 키의 URL 부분(len 바이트)으로 정한 우선순위 클래스 */
+int url_priority(const char *url, size_t len) {
+    char buf[MAXLINE];
+
+    if (!config.pin_urls[0] && !config.low_urls[0]) return PRIO_NORMAL;
+    snprintf(buf, sizeof(buf), "%.*s", (int)len, url);
+    if (url_matches(config.pin_urls, buf)) return PRIO_PINNED;
+    if (url_matches(config.low_urls, buf)) return PRIO_LOW;
+    return PRIO_NORMAL;
+}
+
+/* 제거할 항목의 인덱스 (클래스 순서, 같은 클래스면 LRU). origin이 있으면 그 원 서버 안에서만 */
+static int cache_lru_index(cache_origin_t *origin) {
+    unsigned long min_timestamp = ULONG_MAX;
+    int lru_index = -1, lru_rank = PRIO_PINNED;
+
+    // 가장 낮은 클래스에서 가장 오래 사용되지 않은 항목 찾기 (유예 구간 항목은 -1순위)
+    for (int i = 0; i < cache->max_entries; i++) {
+        cache_entry_t *e = &cache->entries[i];
+        int rank = e->stale ? -1 : e->priority;
+        if (!e->is_valid || rank > lru_rank || rank == PRIO_PINNED || (origin && e->origin != origin)) continue;
+        if (rank < lru_rank || e->timestamp < min_timestamp) {
+            min_timestamp = e->timestamp;
+            lru_index = i;
+            lru_rank = rank;
+        }
+    }
+    return lru_index;
+}
+
+/* 고른 항목을 제거하고 클래스별로 집계 (cache->mutex를 잡은 상태에서 호출) */
+static void cache_evict_index(int idx) {
+    STAT_ADD(evictions[cache->entries[idx].priority], 1);
+    cache_remove_entry(&cache->entries[idx]);
+}
+
+/* 우선순위 클래스와 LRU 정책에 따라 캐시에서 항목 제거. 제거할 항목이 없으면 -1 */
+int cache_evict_lru(size_t required_size) {
+    int lru_index = cache_lru_index(NULL);
+
+    if (lru_index == -1) return -1;
+    cache_evict_index(lru_index);
+    return 0;
+}
+
+/*
+ * 원 서버별 할당량
+ *
+ * 원 서버(캐시 키의 호스트[:포트]) 하나가 전체 캐시를 밀어내지 못하도록 항목 수와 바이트를
+ * 원 서버 단위로 센다. 새 항목이나 블록을 넣기 전에 그 원 서버의 할당량부터 맞추는데, 이때는
+ * 같은 원 서버의 항목만 LRU 순서로 제거한다. 그다음 전체 예산은 기존 cache_make_room이 맞춘다.
+ */
+
+/* URL의 원 서버 기록 (없으면 만듦, cache->mutex를 잡은 상태에서 호출) */
+cache_origin_t *cache_origin_get(const char *url) {
+    const char *host = strstr(url, "://");
+    host = host ? host + 3 : url;
+    size_t len = strcspn(host, "/ ");
+    unsigned long hash = str_hash(host, len);
+    cache_origin_t **pp = &cache->origins[hash % ORIGIN_TABLE_SIZE];
+
+    for (; *pp; pp = &(*pp)->next) {
+        if ((*pp)->hash == hash && !strncmp((*pp)->name, host, len) && !(*pp)->name[len]) return *pp;
+    }
+    cache_origin_t *o = (cache_origin_t *)Calloc(1, sizeof(cache_origin_t));
+    o->name = strndup(host, len);
+    o->hash = hash;
+    // 다 채운 뒤 체인 끝에 붙임 (락 없이 읽는 cache_origin_find가 반쯤 만든 기록을 보지 않도록)
+    __atomic_store_n(pp, o, __ATOMIC_RELEASE);
+    return o;
+}
+
+/* URL의 원 서버 기록을 락 없이 찾음 (기록은 끝에만 붙고 지워지지 않음). 없으면 NULL */
+cache_origin_t *cache_origin_find(const char *url) {
+    const char *host = strstr(url, "://");
+    host = host ? host + 3 : url;
+    size_t len = strcspn(host, "/ ");
+    unsigned long hash = str_hash(host, len);
+    cache_origin_t *o = __atomic_load_n(&cache->origins[hash % ORIGIN_TABLE_SIZE], __ATOMIC_ACQUIRE);
+
+    for (; o; o = __atomic_load_n(&o->next, __ATOMIC_ACQUIRE)) {
+        if (o->hash == hash && !strncmp(o->name, host, len) && !o->name[len]) return o;
+    }
+    return NULL;
+}
+
+/* 캐시 미스를 원 서버별로 집계 (처음 보는 원 서버일 때만 락을 잡음) */
+void cache_origin_miss(cache_key_t *key) {
+    if (!key->str[0]) return;
+    cache_origin_t *o = cache_origin_find(key->str);
+    if (!o) {
+        pthread_mutex_lock(&cache->mutex);
+        o = cache_origin_get(key->str);
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    __atomic_fetch_add(&o->misses, 1, __ATOMIC_RELAXED);
+}
+
+/* 항목이 차지하는 바이트를 원 서버 점유량에 더함 (cache->mutex를 잡은 상태에서 호출) */
+void cache_origin_charge(cache_entry_t *entry, size_t bytes) {
+    entry->charge += bytes;
+    entry->origin->bytes += bytes;
+}
+
+/*
+ * 원 서버의 할당량 안에 required_size 바이트(와 필요하면 항목 하나)가 들어가도록 같은 원 서버의
+ * 항목을 LRU로 제거. 객체가 할당량보다 크면 제거하지 않고 -1 (cache->mutex를 잡은 상태에서 호출)
+ */
+int cache_origin_make_room(cache_origin_t *origin, size_t required_size, int need_slot) {
+    if (config.origin_bytes && required_size > config.origin_bytes) {
+        STAT_ADD(quota_rejects, 1);
+        return -1;
+    }
+    while ((config.origin_bytes && origin->bytes + required_size > config.origin_bytes) ||
+           (need_slot && config.origin_entries && origin->entries >= config.origin_entries)) {
+        int victim = cache_lru_index(origin);
+        if (victim < 0) return -1;
+        cache_evict_index(victim);
+        STAT_ADD(quota_evictions, 1);
+    }
+    return 0;
+}
+
+/* required_size 바이트(와 필요하면 빈 슬롯)를 확보할 때까지 LRU 제거 */
+int cache_make_room(size_t required_size, int need_slot) {
+    while (cache->current_size + required_size > cache->max_size ||
+           (need_slot && cache->num_entries >= cache->max_entries)) {
+        if (cache_evict_lru(required_size) < 0) return -1;
+    }
+    return 0;
+}
+
+/* 항목으로 저장할 수 있는 응답인지 (만료 시간이 0이거나 Vary: *이면 저장하지 않음) */
+int entry_cacheable(cache_key_t *key, const char *headers) {
+    char names[MAXLINE];
+
+    return key->str[0] && entry_ttl(headers) != 0 && vary_names(headers, names, sizeof(names)) == 0;
+}
+
+/*
+ * 빈 슬롯에 새 항목을 만들고 쓰기 락을 잡은 채 반환 (cache->mutex를 잡은 상태에서 호출).
+ * body의 참조는 항목이 넘겨받는다. Vary: * 응답, 캐싱할 수 없는 응답이거나 키가 없으면 NULL.
+ */
+cache_entry_t *cache_new_entry(cache_key_t *key, const char *headers, cache_body_t *body) {
+    cache_entry_t *entry = NULL;
+    char names[MAXLINE];
+    long ttl = entry_ttl(headers);
+
+    if (!key->str[0] || ttl == 0 || vary_names(headers, names, sizeof(names)) < 0) return NULL;
+    url_index_prepare(key, names);
+
+    for (int i = 0; i < cache->max_entries; i++) {
+        if (!cache->entries[i].is_valid) {
+            entry = &cache->entries[i];
+            break;
+        }
+    }
+    if (!entry) return NULL;  // 빈 슬롯이 없음
+
+    // 쓰기 락 획득
+    pthread_rwlock_wrlock(&entry->rwlock);
+
+    // 새 항목 초기화
+    entry->url = strdup(key->str);
+    entry->url_hash = key->url_hash;
+    entry->key_hash = key->hash;
+    entry->raw_hash = key->raw_hash;
+    entry->headers = strdup(headers);
+    entry->headers_size = strlen(headers);
+    entry->body = body;
+    entry->is_complete = (body->content_size == body->size);
+    entry->gz_checked = 0;
+    entry->negative = (hdr_status(headers) != 200);
+    entry->stale = 0;
+    entry->origin = cache_origin_get(key->str);
+    entry->priority = url_priority(key->str, key->url_len);
+    entry->charge = 0;
+    entry->timestamp = get_timestamp();
+    entry->expires = now_msec() + ttl * 1000;
+    entry->is_valid = 1;
+    wheel_timer_add(&entry->ttl_timer, ttl * 1000);
+
+    // 캐시 상태 갱신
+    cache->current_size += entry->headers_size;
+    cache->num_entries++;
+    entry->origin->entries++;
+    cache_origin_charge(entry, entry->headers_size + body->stored_size);
+    url_index_link(entry, names);
+    bloom_add(entry->key_hash);
+    return entry;
+}
+
+/*
+ * 캐시에 새로운 항목 추가 (전체 본문). 체인의 블록은 복사하지 않고 본문 블록으로 넘겨받는다
+ * (압축해서 저장하면 원본 블록은 풀로 돌려줌). 체인은 빈 상태로 돌아간다.
+ * 본문 정리는 요청 스레드에서 하고, 락이 필요한 적재는 적재 스레드에 넘긴다.
+ */
+void cache_add(cache_key_t *key, char *headers, chain_t *chain) {
+    size_t content_size = chain->size;
+
+    if (!chain->capture || content_size > MAX_OBJECT_SIZE) {
+        return; // 최대 객체 크기 초과하면 캐시하지 않음
+    }
+
+    // 락을 잡기 전에 블록을 넘겨받고, 압축 저장이 켜져 있으면 미리 압축해 둠
+    cache_body_t *body = body_new(content_size);
+    size_t stored = 0;
+    int packed = 0;
+
+    if (config.cache_compress) {
+        for (int i = 0; i < body->num_blocks; i++) {
+            size_t len = cache_block_len(content_size, i), plen;
+            if ((body->blocks[i] = lzb_pack(chain->blocks[i], len, &plen))) {
+                body->block_sizes[i] = plen;
+                stored += plen;
+                packed++;
+            }
+        }
+        // 객체 전체로 봐서 충분히 줄지 않으면 원본으로 저장
+        if (packed && stored > LZB_KEEP_LIMIT(content_size)) {
+            for (int i = 0; i < body->num_blocks; i++) {
+                if (body->blocks[i]) block_free(body->blocks[i]);
+                body->blocks[i] = NULL;
+            }
+            packed = 0;
+        }
+        STAT_ADD(lz_objects, packed ? 1 : 0);
+        STAT_ADD(lz_raw_objects, packed ? 0 : 1);
+    }
+    stored = 0;
+    for (int i = 0; i < body->num_blocks; i++) {
+        if (!body->blocks[i]) {
+            // 받은 블록을 그대로 씀 (덜 찬 마지막 블록만 크기를 줄임, 아레나 블록은 그대로)
+            size_t len = cache_block_len(content_size, i);
+            body->blocks[i] = len < CACHE_BLOCK_SIZE && !block_in_arena(chain->blocks[i])
+                                  ? Realloc(chain->blocks[i], len)
+                                  : chain->blocks[i];
+            chain->blocks[i] = NULL;
+            body->block_sizes[i] = len;
+        }
+        stored += body->block_sizes[i];
+    }
+    chain_release(chain);  // 압축본을 저장한 블록과 남는 빈 블록은 풀로
+    body->lz_mode = packed ? 1 : 0;
+    body->content_size = content_size;
+    body->stored_size = stored;
+    body->hash = body_hash(body);
+
+    // 적재 스레드가 밀려 있으면 기다리지 않고 캐싱을 포기
+    if (__atomic_add_fetch(&cache->queue.length, 1, __ATOMIC_RELAXED) > POPULATE_QUEUE_MAX) {
+        __atomic_sub_fetch(&cache->queue.length, 1, __ATOMIC_RELAXED);
+        STAT_ADD(populate_dropped, 1);
+        body_destroy(body);
+        return;
+    }
+    cache_job_t *job = (cache_job_t *)Malloc(sizeof(cache_job_t));
+    job->type = JOB_INSERT;
+    job->key = *key;
+    job->headers = strdup(headers);
+    job->body = body;
+    job_push(&cache->queue, job);
+    V(&cache->queue.items);
+    STAT_ADD(populate_queued, 1);
+}
+
+/*
+ * 비동기 캐시 적재
+ *
+ * 요청 스레드는 완성된 객체를 대기열에 넣기만 하고 바로 돌아간다. 기존 항목 교체, 본문 공유,
+ * 할당량과 전체 예산에 맞춘 제거, 새 항목 등록처럼 cache->mutex가 필요한 일은 그 분할의 워커
+ * 하나가 순서대로 처리한다. 그래서 미스 직후의 같은 요청은 잠깐 동안 다시 미스일 수 있다.
+ */
+
+/* 작업을 대기열에 넣음 (여러 스레드가 동시에 호출해도 됨) */
+void job_push(job_queue_t *q, cache_job_t *job) {
+    job->next = NULL;
+    cache_job_t *prev = __atomic_exchange_n(&q->head, job, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, job, __ATOMIC_RELEASE);
+}
+
+/* 작업 하나를 꺼냄 (적재 스레드만 호출). 비었거나 넣는 중이면 NULL */
+cache_job_t *job_pop(job_queue_t *q) {
+    cache_job_t *tail = q->tail;
+    cache_job_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    // 마지막 작업: 생산자가 아직 next를 잇는 중이면 다음에 다시 시도
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) return NULL;
+    job_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* 분할 워커: 작업이 들어올 때마다 꺼내 처리. 분할 모드에서는 분할 노드의 코어 하나에 고정 */
+static void *populate_thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    cache = (cache_t *)vargp;
+    if (config.partitions > 1) {
+        // csapp.h와 _GNU_SOURCE가 충돌하므로 sched_setaffinity 시스템 콜을 직접 부름 (0 = 이 스레드)
+        unsigned long mask[NUMA_MAX_CPUS / (sizeof(long) * 8)] = {0};
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN), cpu, k, count = 0;
+
+        // 같은 노드의 분할끼리 그 노드의 CPU를 차례로 나눠 가짐
+        if (ncpu < 1 || ncpu > NUMA_MAX_CPUS) ncpu = ncpu < 1 ? 1 : NUMA_MAX_CPUS;
+        for (cpu = 0; cpu < ncpu; cpu++) count += cpu_node[cpu] == cache->node;
+        k = count ? (cache - cache_parts) / num_nodes % count : 0;
+        for (cpu = 0; cpu < ncpu && (cpu_node[cpu] != cache->node || k-- > 0); cpu++)
+            ;
+        if (cpu == ncpu) cpu = (cache - cache_parts) % ncpu;  // 노드에 온라인 CPU가 없음
+        mask[cpu / (sizeof(long) * 8)] |= 1UL << (cpu % (sizeof(long) * 8));
+        syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+    }
+    while (1) {
+        P(&cache->queue.items);
+        cache_job_t *job;
+        while (!(job = job_pop(&cache->queue))) sched_yield();  // 생산자가 잇는 중
+        __atomic_sub_fetch(&cache->queue.length, 1, __ATOMIC_RELAXED);
+        if (job->type == JOB_SERVE) {
+            // 요청 스레드가 기다리고 있으므로 끝나면 알림 (알린 뒤에는 job을 건드리지 않음)
+            job->served = hit_take(job->req, job->vary, &job->hit);
+            V(&job->done);
+            continue;
+        }
+        cache_insert(&job->key, job->headers, job->body);
+        Free(job->headers);
+        Free(job);
+    }
+    return NULL;
+}
+
+/* 분할마다 작업 대기열과 워커 시작 */
+void populate_init(void) {
+    pthread_t tid;
+
+    for (int i = 0; i < config.partitions; i++) {
+        job_queue_t *q = &cache_parts[i].queue;
+        q->stub.next = NULL;
+        q->head = q->tail = &q->stub;
+        q->length = 0;
+        Sem_init(&q->items, 0, 0);
+        Pthread_create(&tid, NULL, populate_thread, &cache_parts[i]);
+    }
+}
+
+/*
+ * 캐시 분할 (-w)
+ *
+ * 캐시를 URL 해시로 나눈 분할 여러 개로 두고, 분할마다 코어에 고정한 워커 하나가 그 분할을
+ * 맡는다. 요청 스레드는 URL을 맡은 분할의 워커에 조회를 넘기고(락 없는 대기열), 히트면 워커가
+ * 헤더 사본과 고정한 본문을 돌려주어 요청 스레드가 보낸다. 소켓 쓰기는 워커에서 하지 않으므로
+ * 느린 클라이언트가 분할 전체를 막지 않는다. 새 객체 적재도 같은 워커가 하므로 분할의 항목과
+ * 락은 거의 그 코어에서만 만진다. Vary 목록이 있는 URL은 블룸 필터에 따로 표시해 두어, 대부분의
+ * 요청은 Vary 목록을 찾을 때도 락을 잡지 않는다. 만료, PURGE / BAN, 통계, Range 요청은
+ * 여전히 분할 락을 잡고 직접 처리한다.
+ */
+
+/* URL 해시로 정한 캐시 분할 (분할 안 색인이 쓰는 아래쪽 비트와 겹치지 않게 위쪽 비트 사용) */
+cache_t *cache_part(unsigned long url_hash) {
+    return &cache_parts[(url_hash >> 32) % config.partitions];
+}
+
+/*
+ * 캐시 히트면 응답을 보내고 1. 분할 모드에서는 URL을 맡은 워커가 찾아 넘긴 히트를 이 스레드가
+ * 보낸다 (느린 클라이언트가 분할 워커를 붙잡지 않도록)
+ */
+int cache_serve(int connfd, request_t *req, const char *vary) {
+    cache_job_t job;
+
+    // 이 코어에 사본이 있는 핫 객체는 공유 항목을 건드리지 않고 바로 보냄
+    if (config.hot && hot_serve(connfd, req)) return 1;
+
+    // 분할하지 않았거나 확실한 미스면 워커를 거치지 않음
+    if (config.partitions == 1 || !req->key.str[0] || !bloom_maybe(req->key.hash)) {
+        return serve_hit(connfd, req, vary);
+    }
+    job.type = JOB_SERVE;
+    job.req = req;
+    job.vary = vary;
+    job.served = HIT_MISS;
+    Sem_init(&job.done, 0, 0);
+    __atomic_add_fetch(&cache->queue.length, 1, __ATOMIC_RELAXED);
+    job_push(&cache->queue, &job);
+    V(&cache->queue.items);
+    P(&job.done);
+    sem_destroy(&job.done);
+    STAT_ADD(routed_requests, 1);
+
+    if (job.served == HIT_READY) {
+        hit_send(connfd, &job.hit);
+        return 1;
+    }
+    if (job.served == HIT_DIRECT) return serve_hit(connfd, req, vary);
+    // 다른 워커 프로세스가 공유 메모리 캐시에 넣어 둔 객체
+    return shm && shm_serve(connfd, req);
+}
+
+/* 완성된 본문으로 항목을 만들어 캐시에 넣음 (적재 스레드). body의 참조는 넘겨받음 */
+void cache_insert(cache_key_t *key, char *headers, cache_body_t *body) {
+    // 워커 프로세스 모드면 다른 프로세스도 쓰도록 공유 메모리 캐시에도 넣음
+    if (shm) shm_store(key, headers, body);
+
+    pthread_mutex_lock(&cache->mutex);
+
+    // 같은 URL의 기존 항목(부분 항목 포함)은 새 항목으로 대체
+    cache_entry_t *old = cache_lookup(key);
+    if (old) cache_remove_entry(old);
+
+    // 저장할 수 없는 응답이면 공간을 만들기 전에 버림 (다른 항목을 내보내지 않도록)
+    if (!entry_cacheable(key, headers)) {
+        body_destroy(body);
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+
+    // 같은 내용의 본문이 이미 있으면 공유 (새 본문은 놓아주면서 크기 반영도 되돌려짐)
+    cache->current_size += body->stored_size;
+    cache->content_bytes += body->content_size;
+    cache->stored_bytes += body->stored_size;
+    cache_body_t *shared = body_intern(body);
+
+    // 필요한 경우 원 서버 할당량과 전체 공간 확보
+    cache_entry_t *entry = NULL;
+    if (cache_origin_make_room(cache_origin_get(key->str), strlen(headers) + shared->stored_size, 1) == 0 &&
+        cache_make_room(strlen(headers), 1) == 0) {
+        entry = cache_new_entry(key, headers, shared);
+    }
+    if (!entry) {
+        body_release(shared);
+        pthread_mutex_unlock(&cache->mutex);
         return; // 빈 슬롯이 없음
     }
 
-    // 쓰기 락 획득
-    pthread_rwlock_wrlock(&cache.entries[empty_slot].rwlock);
-    
-    // 새 항목 초기화
-    cache.entries[empty_slot].url = strdup(url);
-    cache.entries[empty_slot].content = Malloc(content_size);
-    memcpy(cache.entries[empty_slot].content, content, content_size);
-    cache.entries[empty_slot].content_size = content_size;
-    cache.entries[empty_slot].timestamp = get_timestamp();
-    cache.entries[empty_slot].is_valid = 1;
-    
-    // 캐시 상태 갱신
-    cache.current_size += content_size;
-    cache.num_entries++;
-    
-    // 쓰기 락 해제
-    pthread_rwlock_unlock(&cache.entries[empty_slot].rwlock);
-    pthread_mutex_unlock(&cache.mutex);
+    // 쓰기 락 해제
+    pthread_rwlock_unlock(&entry->rwlock);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/* Range 응답으로 받은 블록 하나를 캐시에 저장 (항목이 없으면 부분 항목 생성) */
+void cache_store_block(cache_key_t *key, const char *headers, size_t object_size, int idx,
+                       const char *data, size_t len) {
+    // 압축 저장이 켜져 있으면 락 밖에서 미리 압축 (사용 여부는 본문의 저장 방식으로 결정)
+    size_t plen = 0;
+    char *packed = config.cache_compress ? lzb_pack(data, len, &plen) : NULL;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    // 객체가 바뀌었거나 만료된 항목이면 버림
+    cache_entry_t *entry = cache_lookup(key);
+    if (entry && (entry->stale || !same_object(entry->headers, entry->body->size, headers, object_size))) {
+        cache_remove_entry(entry);
+        entry = NULL;
+    }
+    // 첫 블록에서 압축 효과가 없었던 객체는 이후 블록도 원본으로 저장
+    if (packed && entry && entry->body->lz_mode == 0) {
+        Free(packed);
+        packed = NULL;
+    }
+    size_t stored = packed ? plen : len;
+    // 이미 있는 블록이거나 객체당 최대 크기를 넘으면 저장하지 않음
+    if (entry && (entry->body->blocks[idx] || entry->body->content_size + len > MAX_OBJECT_SIZE)) {
+        pthread_mutex_unlock(&cache->mutex);
+        if (packed) Free(packed);
+        return;
+    }
+
+    // 원 서버 할당량과 전체 공간 확보 (이 과정에서 항목 자체가 제거될 수 있으므로 다시 찾음)
+    size_t required = stored + (entry ? 0 : strlen(headers));
+    if ((!entry && !entry_cacheable(key, headers)) ||
+        cache_origin_make_room(cache_origin_get(key->str), required, entry == NULL) < 0 ||
+        cache_make_room(required, entry == NULL) < 0) {
+        pthread_mutex_unlock(&cache->mutex);
+        if (packed) Free(packed);
+        return;
+    }
+    entry = cache_lookup(key);
+    if (entry) {
+        pthread_rwlock_wrlock(&entry->rwlock);
+    } else {
+        cache_body_t *body = body_new(object_size);
+        if (!(entry = cache_new_entry(key, headers, body))) {
+            body_destroy(body);
+            pthread_mutex_unlock(&cache->mutex);
+            if (packed) Free(packed);
+            return;
+        }
+    }
+
+    // 채우는 중인 본문은 항목 혼자 가지고 있으므로 바로 수정
+    cache_body_t *body = entry->body;
+    if (config.cache_compress && body->lz_mode < 0) {
+        body->lz_mode = packed ? 1 : 0;
+        STAT_ADD(lz_objects, packed ? 1 : 0);
+        STAT_ADD(lz_raw_objects, packed ? 0 : 1);
+    }
+    if (packed) {
+        body->blocks[idx] = packed;
+    } else {
+        body->blocks[idx] = len == CACHE_BLOCK_SIZE ? block_get() : Malloc(len);
+        memcpy(body->blocks[idx], data, len);
+    }
+    body->block_sizes[idx] = stored;
+    body->content_size += len;
+    body->stored_size += stored;
+    entry->timestamp = get_timestamp();
+    cache_origin_charge(entry, stored);
+    cache->current_size += stored;
+    cache->content_bytes += len;
+    cache->stored_bytes += stored;
+
+    // 마지막 블록까지 채워졌으면 같은 내용의 본문과 공유
+    if (body->content_size == body->size) {
+        entry->is_complete = 1;
+        body->hash = body_hash(body);
+        entry->body = body_intern(body);
+    }
+
+    pthread_rwlock_unlock(&entry->rwlock);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/* 압축 변형을 캐시 항목에 붙임. gz가 NULL이면 압축 효과가 없었다고만 기록 */
+void cache_attach_gzip(cache_key_t *key, const char *headers, char *gz_headers, char *gz,
+                       size_t gz_size) {
+    pthread_mutex_lock(&cache->mutex);
+
+    // 압축하는 동안 항목이 바뀌었거나 다른 스레드가 먼저 붙였으면 버림
+    cache_entry_t *entry = cache_lookup(key);
+    if (entry && gz && cache_origin_make_room(entry->origin, gz_size, 0) == 0 &&
+        (entry = cache_lookup(key)) && cache_make_room(gz_size, 0) == 0) {
+        entry = cache_lookup(key);  // 공간 확보 중 제거되었을 수 있음
+    } else if (gz) {
+        entry = NULL;
+    }
+    if (!entry || entry->gz_checked || strcmp(entry->headers, headers)) {
+        pthread_mutex_unlock(&cache->mutex);
+        if (gz) {
+            Free(gz_headers);
+            Free(gz);
+        }
+        return;
+    }
+
+    pthread_rwlock_wrlock(&entry->rwlock);
+    entry->gz_checked = 1;
+    if (gz) {
+        cache_gzip_t *v = (cache_gzip_t *)Malloc(sizeof(cache_gzip_t));
+        v->headers = gz_headers;
+        v->headers_size = strlen(gz_headers);
+        v->content = gz;
+        v->size = gz_size;
+        v->pins = 1;
+        entry->gz = v;
+        cache->current_size += gz_size;
+        cache_origin_charge(entry, gz_size);
+    }
+    pthread_rwlock_unlock(&entry->rwlock);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ * 핫 객체 복제 (-H)
+ *
+ * 히트의 일부만 골라 count-min 스케치에 기록하고, 추정치가 높은 키 N개를 핫 집합으로 둔다.
+ * 핫 집합의 키는 히트가 난 코어마다 헤더와 본문을 통째로 복사해 그 코어 전용 사본으로 둔다.
+ * 사본 히트는 이 코어의 사본 칸(참조 카운트, 히트 수)에만 쓰므로 공유 항목의 락이나 다른
+ * 코어의 캐시 라인을 건드리지 않는다. 원본이 지워지거나 만료되면 모든 코어의 사본을 무효화한다.
+ *
+ * 사본 칸은 dead 표시와 참조 카운트로 보호한다. 읽는 쪽은 refs를 먼저 올리고 dead를 확인하며,
+ * 바꾸는 쪽(hot.mutex)은 dead를 먼저 세우고 refs가 0일 때만 내용을 해제하거나 새로 채운다.
+ */
+
+/* 지금 실행 중인 코어의 사본 테이블 */
+static hot_core_t *hot_core(void) {
+    int cpu = sched_getcpu();
+    return &hot_cores[(cpu < 0 ? 0 : cpu) % HOT_MAX_CPUS];
+}
+
+/* 스케치 행 row에서 hash의 칸 */
+static unsigned *hot_counter(int row, unsigned long hash) {
+    static const unsigned long mult[HOT_ROWS] = {0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL,
+                                                 0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL};
+    return &hot.sketch[row][(hash * mult[row]) >> 54];  // 상위 10비트 (HOT_WIDTH)
+}
+
+/* 핫 집합에서 hash의 위치 (없으면 -1) */
+static int hot_index(unsigned long hash) {
+    for (int i = 0; i < config.hot; i++) {
+        if (__atomic_load_n(&hot.keys[i], __ATOMIC_RELAXED) == hash) return i;
+    }
+    return -1;
+}
+
+/* 사본 칸 비우기. 보내는 중이면 dead만 세우고 해제는 다음 교체로 미룸 (hot.mutex) */
+static int hot_clear(hot_replica_t *r) {
+    __atomic_store_n(&r->dead, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->refs, __ATOMIC_SEQ_CST)) return 0;
+    stats.hot_hits += __atomic_exchange_n(&r->hits, 0, __ATOMIC_RELAXED);
+    if (r->data) {
+        Free(r->key);
+        Free(r->data);
+        r->key = r->data = NULL;
+    }
+    __atomic_store_n(&r->hash, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* 핫 집합 i번 키의 모든 코어 사본 무효화 (hot.mutex) */
+static void hot_kill(int i) {
+    for (int c = 0; c < HOT_MAX_CPUS; c++) hot_clear(&hot_cores[c].slots[i]);
+}
+
+/* 스케치와 점수를 반으로 줄이고 사본 히트를 점수에 반영 (hot.mutex) */
+static void hot_age(void) {
+    for (int row = 0; row < HOT_ROWS; row++) {
+        for (int j = 0; j < HOT_WIDTH; j++) hot.sketch[row][j] >>= 1;
+    }
+    for (int i = 0; i < config.hot; i++) {
+        unsigned long hits = 0;
+        for (int c = 0; c < HOT_MAX_CPUS; c++) {
+            hits += __atomic_exchange_n(&hot_cores[c].slots[i].hits, 0, __ATOMIC_RELAXED);
+        }
+        stats.hot_hits += hits;
+        // 사본으로 보낸 히트는 스케치에 기록되지 않으므로 표본 비율로 환산해 더함
+        hot.score[i] = hot.score[i] / 2 + hits / HOT_SAMPLE;
+    }
+}
+
+/* 이 코어에 사본이 있으면 바로 보내고 1 */
+int hot_serve(int connfd, request_t *req) {
+    hot_core_t *core = hot_core();
+
+    for (int i = 0; i < config.hot; i++) {
+        hot_replica_t *r = &core->slots[i];
+        if (__atomic_load_n(&r->hash, __ATOMIC_RELAXED) != req->key.hash) continue;
+        __atomic_add_fetch(&r->refs, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&r->dead, __ATOMIC_SEQ_CST) && r->hash == req->key.hash &&
+            !strcmp(r->key, req->key.str) && !(r->gzip && accepts_gzip(req->accept_encoding))) {
+            rio_writen(connfd, r->data, r->len);
+            __atomic_add_fetch(&r->hits, 1, __ATOMIC_RELAXED);
+            // 사본 히트도 캐시 히트 (hot_hits는 그중 사본으로 보낸 몫)
+            STAT_ADD(cache_hits, 1);
+            __atomic_fetch_add(&r->origin->hits, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&r->refs, 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+        __atomic_sub_fetch(&r->refs, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* 공유 캐시 히트 기록. 핫 키가 되면 이 코어에 사본을 만듦 (entry는 읽기 락을 잡은 상태) */
+void hot_note(cache_entry_t *entry, request_t *req) {
+    unsigned long hash = entry->key_hash, est = ULONG_MAX;
+    size_t size = entry->body->size, len;
+    hot_replica_t *r;
+    char *data;
+    int i;
+
+    // xorshift32. 처음 쓰는 스레드는 시각(나노초)으로 시작
+    if (!hot_tick) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        hot_tick = (unsigned)ts.tv_nsec | 1;
+    }
+    hot_tick ^= hot_tick << 13;
+    hot_tick ^= hot_tick >> 17;
+    hot_tick ^= hot_tick << 5;
+    if (hot_tick % HOT_SAMPLE) return;
+
+    // 스케치에 기록하고 행들의 최솟값으로 빈도 추정
+    for (int row = 0; row < HOT_ROWS; row++) {
+        unsigned n = __atomic_add_fetch(hot_counter(row, hash), 1, __ATOMIC_RELAXED);
+        if (n < est) est = n;
+    }
+    if (__atomic_add_fetch(&hot.samples, 1, __ATOMIC_RELAXED) % HOT_AGE == 0) {
+        pthread_mutex_lock(&hot.mutex);
+        hot_age();
+        pthread_mutex_unlock(&hot.mutex);
+    }
+    if (est < HOT_THRESHOLD) return;
+
+    // 이미 이 코어에 사본이 있으면 끝 (hot_serve가 gzip 때문에 건너뛴 경우)
+    i = hot_index(hash);
+    if (i >= 0) {
+        r = &hot_core()->slots[i];
+        if (__atomic_load_n(&r->hash, __ATOMIC_RELAXED) == hash && !__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE)) return;
+    }
+
+    // 락 밖에서 헤더와 블록을 이어 붙인 사본 준비
+    len = entry->headers_size + size;
+    data = Malloc(len);
+    memcpy(data, entry->headers, entry->headers_size);
+    for (int b = 0; b < entry->body->num_blocks; b++) {
+        char *dst = data + entry->headers_size + (size_t)b * CACHE_BLOCK_SIZE;
+        const char *src = cache_block_data(entry->body, b, dst, NULL);
+        if (src != dst) memcpy(dst, src, cache_block_len(size, b));
+    }
+
+    pthread_mutex_lock(&hot.mutex);
+    i = hot_index(hash);
+    if (i < 0) {
+        // 빈 자리나 점수가 가장 낮은 키 자리를 차지
+        int victim = 0;
+        for (int j = 1; j < config.hot; j++) {
+            if (!hot.keys[victim]) break;
+            if (!hot.keys[j] || hot.score[j] < hot.score[victim]) victim = j;
+        }
+        if (!hot.keys[victim] || hot.score[victim] < est) {
+            hot_kill(victim);
+            __atomic_store_n(&hot.keys[victim], hash, __ATOMIC_RELAXED);
+            hot.score[victim] = est;
+            i = victim;
+            STAT_ADD(hot_promotions, 1);
+            printf("Hot object %s\n", req->key.str);
+        }
+    }
+    // 만료로 유예 구간에 들어간 항목은 hot_drop이 이미 지나갔을 수 있으므로 복제하지 않음
+    r = i >= 0 ? &hot_core()->slots[i] : NULL;
+    if (r && !entry->stale && hot_clear(r)) {
+        r->key = strdup(req->key.str);
+        r->data = data;
+        r->len = len;
+        r->origin = entry->origin;
+        r->gzip = entry->gz ||
+                  (!entry->gz_checked && gzip_compressible(entry->headers, size));
+        __atomic_store_n(&r->hash, hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->dead, 0, __ATOMIC_RELEASE);
+        data = NULL;
+        STAT_ADD(hot_replicas, 1);
+    }
+    pthread_mutex_unlock(&hot.mutex);
+    if (data) Free(data);
+}
+
+/* 캐시 항목이 지워지거나 만료될 때 그 키의 사본을 모든 코어에서 무효화 */
+void hot_drop(unsigned long hash) {
+    int i;
+
+    if (hot_index(hash) < 0) return;  // 대부분은 락 없이 끝남
+    pthread_mutex_lock(&hot.mutex);
+    if ((i = hot_index(hash)) >= 0) {
+        hot_kill(i);
+        hot.keys[i] = 0;
+        hot.score[i] = 0;
+    }
+    pthread_mutex_unlock(&hot.mutex);
+}
+
+/*
+ * 워커 프로세스와 공유 메모리 캐시 (-P)
+ *
+ * 한 워커 프로세스가 unix_error 등으로 죽어도 프록시 전체가 멈추지 않도록 감시 프로세스가
+ * 워커 프로세스 N개를 fork하고 죽으면 다시 띄운다. 워커 프로세스는 지금까지처럼 스레드로
+ * 요청을 처리하고 자기 로컬 캐시를 가진다. 그 아래에 fork 전에 잡은 MAP_SHARED 영역의
+ * 공유 캐시를 두어, 한 프로세스가 받아 온 완성된 객체를 다른 프로세스도 히트로 보낸다.
+ *
+ * 공유 영역에는 주소가 아닌 항목/블록 번호만 저장하므로 어느 프로세스에서도 그대로 쓸 수
+ * 있다. 표는 PTHREAD_PROCESS_SHARED + robust 뮤텍스 하나로 보호하고, 본문은 참조 카운트를
+ * 올린 뒤 락 없이 보낸다. 참조는 워커 프로세스별로도 기록해 두어, 보내던 중에 워커가 죽으면
+ * 감시 프로세스가 그 몫을 풀어 항목이 영영 묶이지 않게 한다. PURGE / BAN은 공유 캐시에서 지우고 기록에 남겨, 다른 프로세스가
+ * 다음 요청에서 자기 로컬 캐시에도 반영한다.
+ */
+
+/* 공유 캐시 락. 락을 잡은 채 죽은 워커가 있으면 이어서 씀 (표 갱신은 짧은 필드 대입뿐) */
+void shm_lock(void) {
+    if (pthread_mutex_lock(&shm->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shm->mutex);
+        shm->recoveries++;
+        printf("Recovered shared cache lock from a dead worker\n");
+    }
+}
+
+void shm_unlock(void) {
+    pthread_mutex_unlock(&shm->mutex);
+}
+
+/* 항목의 블록을 빈 목록으로 돌려주고 자리 비우기 (shm 락) */
+static void shm_free_entry(shm_entry_t *e) {
+    int b = e->first;
+
+    while (b >= 0) {
+        int next = shm->next[b];
+        shm->next[b] = shm->free_block;
+        shm->free_block = b;
+        shm->free_blocks++;
+        b = next;
+    }
+    e->first = -1;
+    e->num_blocks = 0;
+    e->state = SHM_FREE;
+}
+
+/* 항목 지우기. 보내는 중이면 마지막 참조가 풀릴 때 해제 (shm 락) */
+static void shm_kill(shm_entry_t *e) {
+    e->state = SHM_DEAD;
+    if (e->refs == 0) shm_free_entry(e);
+}
+
+/* 빈 블록 need개와 빈 자리 하나가 생길 때까지 만료 항목, 그다음 LRU 항목 제거 (shm 락) */
+static shm_entry_t *shm_make_room(int need) {
+    unsigned long now = now_msec();
+
+    while (1) {
+        shm_entry_t *slot = NULL, *victim = NULL;
+        for (int i = 0; i < SHM_ENTRIES; i++) {
+            shm_entry_t *e = &shm->entries[i];
+            if (e->state == SHM_FREE && !slot) slot = e;
+            if (e->state != SHM_READY || e->refs) continue;
+            if (e->expires <= now) {
+                victim = e;
+                break;
+            }
+            if (!victim || e->last_used < victim->last_used) victim = e;
+        }
+        if (slot && shm->free_blocks >= need) return slot;
+        if (!victim) return NULL;
+        if (victim->expires > now) shm->evictions++;
+        shm_kill(victim);
+    }
+}
+
+/* 공유 영역을 잡고 초기화 (fork 전에 한 번) */
+void shm_init(void) {
+    pthread_mutexattr_t attr;
+
+    shm = mmap(NULL, sizeof(shm_cache_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) unix_error("mmap error");
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shm->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    // 모든 블록을 빈 목록에 연결 (mmap 영역은 0으로 채워져 있음)
+    for (int b = 0; b < SHM_BLOCKS; b++) shm->next[b] = b + 1 < SHM_BLOCKS ? b + 1 : -1;
+    shm->free_block = 0;
+    shm->free_blocks = SHM_BLOCKS;
+    for (int i = 0; i < SHM_ENTRIES; i++) shm->entries[i].first = -1;
+}
+
+/* slot번 워커 프로세스 띄우기 (워커 프로세스에서는 0) */
+static pid_t prefork_spawn(int slot) {
+    pid_t pid;
+
+    fflush(stdout);  // 버퍼에 남은 로그가 자식에서 또 찍히지 않게
+    if ((pid = Fork()) == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);  // 감시 프로세스가 끝나면 같이 끝남
+        worker_slot = slot;
+        printf("Worker process %d started\n", getpid());
+        return 0;
+    }
+    return pid;
+}
+
+/*
+ * 죽은 워커 프로세스가 보내는 중이던 항목의 참조를 풀고, 복사하던 항목은 버림 (감시 프로세스).
+ * 풀지 않으면 그 항목은 밀려나지도 해제되지도 않아 공유 캐시가 계속 줄어든다.
+ */
+static void shm_release_worker(int slot) {
+    int released = 0;
+
+    shm_lock();
+    for (int i = 0; i < SHM_ENTRIES; i++) {
+        shm_entry_t *e = &shm->entries[i];
+        int n = e->worker_refs[slot];
+        if (n == 0) continue;
+        e->refs -= n;
+        e->worker_refs[slot] = 0;
+        released += n;
+        if (e->state == SHM_FILLING) {
+            shm_kill(e);  // 본문 복사가 끝나지 않았음
+        } else if (e->refs == 0 && e->state == SHM_DEAD) {
+            shm_free_entry(e);
+        }
+    }
+    shm->released_refs += released;
+    shm_unlock();
+    if (released) printf("Released %d shared cache references held by worker %d\n", released, slot);
+}
+
+/* 워커 프로세스 procs개를 띄우고 죽으면 다시 띄움. 워커 프로세스에서만 돌아옴 */
+void prefork(int procs) {
+    pid_t pids[MAX_PROCS];
+    int status, slot;
+    pid_t pid;
+
+    shm_init();
+    printf("Shared cache: %d entries, %d blocks (%zu bytes)\n", SHM_ENTRIES, SHM_BLOCKS,
+           sizeof(shm_cache_t));
+    for (int i = 0; i < procs; i++) {
+        if ((pids[i] = prefork_spawn(i)) == 0) return;
+    }
+    while (1) {
+        if ((pid = waitpid(-1, &status, 0)) < 0) {
+            if (errno == EINTR) continue;
+            unix_error("waitpid error");
+        }
+        for (slot = 0; slot < procs && pids[slot] != pid; slot++)
+            ;
+        if (slot == procs) continue;  // 워커가 아님
+        printf("Worker process %d exited (%s %d), restarting\n", pid,
+               WIFSIGNALED(status) ? "signal" : "status",
+               WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+        shm_release_worker(slot);
+        __atomic_add_fetch(&shm->restarts, 1, __ATOMIC_RELAXED);
+        usleep(100000);  // 바로 죽는 워커가 감시 프로세스를 바쁘게 돌리지 않게
+        if ((pids[slot] = prefork_spawn(slot)) == 0) return;
+    }
+}
+
+/* 공유 캐시에 있으면 보내고 1 */
+int shm_serve(int connfd, request_t *req) {
+    shm_entry_t *e = NULL;
+    unsigned long now = now_msec();
+    int b;
+
+    if (!req->key.str[0]) return 0;
+    shm_lock();
+    for (int i = 0; i < SHM_ENTRIES; i++) {
+        shm_entry_t *c = &shm->entries[i];
+        if (c->state != SHM_READY || c->hash != req->key.hash || strcmp(c->key, req->key.str)) continue;
+        if (c->expires <= now) {
+            shm_kill(c);
+            break;
+        }
+        e = c;
+        e->refs++;
+        e->worker_refs[worker_slot]++;
+        e->last_used = now;
+        shm->hits++;
+        break;
+    }
+    shm_unlock();
+    if (!e) return 0;
+
+    // 참조가 있는 동안 블록과 연결은 바뀌지 않음
+    printf("Shared cache hit for %s\n", req->key.str);
+    if (rio_writen(connfd, e->headers, e->headers_size) == e->headers_size) {
+        b = e->first;
+        for (int i = 0; i < e->num_blocks && b >= 0; i++, b = shm->next[b]) {
+            size_t len = cache_block_len(e->size, i);
+            if (rio_writen(connfd, shm->data[b], len) != len) break;
+        }
+    }
+
+    shm_lock();
+    e->worker_refs[worker_slot]--;
+    if (--e->refs == 0 && e->state == SHM_DEAD) shm_free_entry(e);
+    shm_unlock();
+    return 1;
+}
+
+/* 완성된 객체를 공유 캐시에 넣음 (같은 키는 교체, 복사는 락 밖에서) */
+void shm_store(cache_key_t *key, const char *headers, cache_body_t *body) {
+    size_t hlen = strlen(headers);
+    long ttl = entry_ttl(headers);
+    int nb = body->num_blocks, b;
+    shm_entry_t *e;
+
+    if (!key->str[0] || ttl == 0 || hlen >= MAXBUF || body->content_size != body->size ||
+        nb > SHM_BLOCKS / 4) {
+        return;
+    }
+
+    shm_lock();
+    for (int i = 0; i < SHM_ENTRIES; i++) {
+        shm_entry_t *c = &shm->entries[i];
+        if ((c->state == SHM_READY || c->state == SHM_FILLING) && c->hash == key->hash &&
+            !strcmp(c->key, key->str)) {
+            shm_kill(c);
+        }
+    }
+    if (!(e = shm_make_room(nb))) {
+        shm_unlock();
+        return;
+    }
+    // 빈 목록 앞에서 nb개를 떼어 항목에 연결
+    e->first = nb ? shm->free_block : -1;
+    for (int i = 0; i < nb; i++) {
+        b = shm->free_block;
+        shm->free_block = shm->next[b];
+        if (i == nb - 1) shm->next[b] = -1;
+    }
+    shm->free_blocks -= nb;
+    e->num_blocks = nb;
+    e->state = SHM_FILLING;
+    e->hash = key->hash;
+    strcpy(e->key, key->str);
+    e->url_len = key->url_len;
+    memcpy(e->headers, headers, hlen + 1);
+    e->headers_size = hlen;
+    e->size = body->size;
+    e->expires = now_msec() + ttl * 1000;
+    e->last_used = now_msec();
+    e->refs = 1;  // 복사하는 동안 PURGE / BAN이 블록을 해제하지 못하게
+    memset(e->worker_refs, 0, sizeof(e->worker_refs));
+    e->worker_refs[worker_slot] = 1;
+    shm_unlock();
+
+    // FILLING 항목의 블록은 이 스레드만 만짐
+    b = e->first;
+    for (int i = 0; i < nb; i++, b = shm->next[b]) {
+        const char *src = cache_block_data(body, i, shm->data[b], NULL);
+        if (src != shm->data[b]) memcpy(shm->data[b], src, cache_block_len(body->size, i));
+    }
+
+    shm_lock();
+    e->refs--;
+    e->worker_refs[worker_slot]--;
+    if (e->state == SHM_FILLING) {
+        e->state = SHM_READY;
+        shm->stores++;
+    } else {
+        shm_free_entry(e);  // 복사하는 사이 PURGE / BAN 되었음
+    }
+    shm_unlock();
+}
+
+/* 공유 캐시에서 url(ban이면 접두사)을 지우고 다른 프로세스에 알릴 기록을 남김 */
+int shm_invalidate(const char *url, int ban) {
+    size_t len = strlen(url);
+    shm_inval_t *rec;
+    int n = 0;
+
+    shm_lock();
+    for (int i = 0; i < SHM_ENTRIES; i++) {
+        shm_entry_t *e = &shm->entries[i];
+        if (e->state != SHM_READY && e->state != SHM_FILLING) continue;
+        if (ban ? strncmp(e->key, url, len) : (e->url_len != len || strncmp(e->key, url, len))) continue;
+        if (e->state == SHM_READY) n++;
+        shm_kill(e);
+    }
+    rec = &shm->log[(shm->inval_seq + 1) % SHM_LOG];
+    rec->seq = shm->inval_seq + 1;
+    if (len < sizeof(rec->url)) {
+        rec->ban = ban;
+        memcpy(rec->url, url, len + 1);
+    } else {
+        // 기록에 다 담지 못하는 URL은 잘라 남기지 않고 다른 프로세스의 로컬 캐시를 모두 비우게 함
+        rec->ban = 1;
+        rec->url[0] = '\0';
+    }
+    __atomic_store_n(&shm->inval_seq, rec->seq, __ATOMIC_RELEASE);
+    shm_unlock();
+    return n;
+}
+
+/* 아직 반영하지 않은 무효화 기록을 이 프로세스의 로컬 캐시에 반영 */
+void shm_sync(void) {
+    cache_t *saved = cache;
+    shm_inval_t rec;
+    unsigned long seq;
+
+    if (__atomic_load_n(&shm->inval_seq, __ATOMIC_ACQUIRE) == __atomic_load_n(&shm_seen, __ATOMIC_ACQUIRE)) {
+        return;  // 대부분은 여기서 끝남
+    }
+    pthread_mutex_lock(&shm_seen_mutex);
+    seq = shm_seen;
+    for (;;) {
+        // 기록 하나를 shm 락 안에서 복사하고, 로컬 캐시는 락을 풀고 고침 (다른 프로세스를 세우지 않게)
+        shm_lock();
+        if (shm->inval_seq == seq) {
+            shm_unlock();
+            break;
+        }
+        if (shm->inval_seq - seq > SHM_LOG) {
+            // 기록이 덮어써질 만큼 밀렸으면 로컬 캐시를 모두 비움
+            seq = shm->inval_seq;
+            rec.ban = 1;
+            rec.url[0] = '\0';
+        } else {
+            shm_inval_t *src = &shm->log[++seq % SHM_LOG];
+            rec.ban = src->ban;
+            strcpy(rec.url, src->url);
+        }
+        shm_unlock();
+        if (rec.ban) {
+            for (int i = 0; i < config.partitions; i++) {
+                cache = &cache_parts[i];
+                cache_ban(rec.url);
+            }
+        } else {
+            cache_key_t key;
+            key.url_len = strlen(rec.url);
+            memcpy(key.str, rec.url, key.url_len + 1);
+            key.url_hash = key.hash = str_hash(key.str, key.url_len);
+            cache = cache_part(key.url_hash);
+            cache_purge(&key);
+        }
+        __atomic_store_n(&shm_seen, seq, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&shm_seen_mutex);
+    cache = saved;
+}
+
+/* FNV 해시의 비트를 고루 섞음 (비슷한 문자열의 상위 비트가 몰리지 않게, murmur3 마무리 단계) */
+static unsigned long ring_mix(unsigned long h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* 해시 링 정렬용 비교 함수 */
+static int ring_cmp(const void *a, const void *b) {
+    unsigned long x = ((const ring_point_t *)a)->hash, y = ((const ring_point_t *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * 자신과 피어 목록("host:port,...")으로 해시 링을 만듦. 피어마다 PEER_VNODES개의
+ * 가상 노드를 "host:port#i"의 해시 위치에 올리므로, 모든 인스턴스가 같은 목록을 쓰면
+ * 같은 링이 되고 피어 하나가 빠지거나 늘어도 그 피어 몫의 URL만 옮겨 간다.
+ */
+void peer_init(const char *list, const char *self) {
+    char buf[MAXLINE * 2], name[MAXLINE], *tok, *save, *colon;
+    int n;
+
+    snprintf(buf, sizeof(buf), "%s,%s", self, list);
+    for (tok = strtok_r(buf, ", ", &save); tok; tok = strtok_r(NULL, ", ", &save)) {
+        int dup = 0;
+        if (!(colon = strrchr(tok, ':')) || colon == tok || !colon[1] ||
+            strlen(colon + 1) >= sizeof(peers[0].port) || colon - tok > PEER_HOST_MAX) {
+            fprintf(stderr, "Invalid peer address (need host:port): %s\n", tok);
+            exit(1);
+        }
+        *colon = '\0';
+        for (int i = 0; i < num_peers; i++) {
+            if (!strcasecmp(peers[i].host, tok) && !strcmp(peers[i].port, colon + 1)) dup = 1;
+        }
+        if (dup) continue;
+        if (num_peers == MAX_PEERS) {
+            fprintf(stderr, "Too many peers (max %d)\n", MAX_PEERS);
+            exit(1);
+        }
+        snprintf(peers[num_peers].host, sizeof(peers[num_peers].host), "%s", tok);
+        strcpy(peers[num_peers].port, colon + 1);
+        num_peers++;
+    }
+    peer_self = 0;  // 자기 주소를 맨 앞에 넣었음
+
+    for (int p = 0; p < num_peers; p++) {
+        for (int i = 0; i < PEER_VNODES; i++) {
+            n = snprintf(name, sizeof(name), "%s:%s#%d", peers[p].host, peers[p].port, i);
+            peer_ring[peer_ring_size].hash = ring_mix(str_hash(name, n));
+            peer_ring[peer_ring_size].peer = p;
+            peer_ring_size++;
+        }
+    }
+    qsort(peer_ring, peer_ring_size, sizeof(ring_point_t), ring_cmp);
+    printf("Peer ring: %d peers, %d points (self %s:%s)\n", num_peers, peer_ring_size,
+           peers[peer_self].host, peers[peer_self].port);
+}
+
+/* URL 해시를 맡은 피어: 링에서 해시 위치 다음에 오는 첫 가상 노드 */
+int peer_owner(unsigned long hash) {
+    int lo = 0, hi = peer_ring_size;
+
+    hash = ring_mix(hash);
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (peer_ring[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    return peer_ring[lo == peer_ring_size ? 0 : lo].peer;
+}
+
+/*
+ * 요청 URL을 맡은 피어에 연결하고 req->peer에 기록. 피어를 쓰지 않거나, 자신이 맡은 URL이거나,
+ * 다른 피어가 넘긴 요청이거나, 최근 연결에 실패한 피어면 -1 (원 서버로 직접)
+ */
+int connect_peer(request_t *req) {
+    peer_t *peer;
+    int p, fd;
+
+    if (!num_peers || req->from_peer) return -1;
+    // 절대 URI가 요청 줄에 다 들어가지 않으면 원 서버에서 직접 받음
+    if (strlen(req->hostname) > PEER_HOST_MAX || strlen(req->path) > PEER_PATH_MAX) return -1;
+    if ((p = peer_owner(req->key.url_hash)) == peer_self) return -1;
+    peer = &peers[p];
+    if (__atomic_load_n(&peer->down_until, __ATOMIC_RELAXED) > now_msec()) return -1;
+
+    req->peer = p;
+    if ((fd = open_clientfd_timeout(peer->host, peer->port, config.connect_timeout * 1000)) < 0) {
+        peer_failed(req);
+        return -1;
+    }
+    STAT_ADD(peer_requests, 1);
+    deadline_start(&upstream_deadline, fd, config.first_byte_timeout * 1000, &stats.first_byte_timeouts);
+    return fd;
+}
+
+/* 피어가 응답하지 않음: PEER_RETRY_MS 동안 그 피어를 건너뛰고 이 요청은 원 서버로 */
+void peer_failed(request_t *req) {
+    peer_t *peer = &peers[req->peer];
+
+    printf("Peer %s:%s failed, going to the origin.\n", peer->host, peer->port);
+    __atomic_store_n(&peer->down_until, now_msec() + PEER_RETRY_MS, __ATOMIC_RELAXED);
+    STAT_ADD(peer_failures, 1);
+    req->peer = -1;
+}
+
+/* "origin[:port]=host:port,..." 형식의 백엔드 묶음 추가 (형식이 틀리면 종료) */
+void pool_add(const char *spec) {
+    char buf[MAXLINE], *list, *tok, *save, *colon;
+    backend_pool_t *pool;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    if (num_pools == MAX_POOLS || !(list = strchr(buf, '=')) || list == buf) {
+        fprintf(stderr, "Invalid backend pool (need origin[:port]=host:port,...): %s\n", spec);
+        exit(1);
+    }
+    *list++ = '\0';
+    pool = &pools[num_pools];
+    if ((colon = strrchr(buf, ':'))) *colon = '\0';
+    snprintf(pool->host, sizeof(pool->host), "%s", buf);
+    snprintf(pool->port, sizeof(pool->port), "%s", colon && colon[1] ? colon + 1 : "80");
+
+    for (tok = strtok_r(list, ", ", &save); tok; tok = strtok_r(NULL, ", ", &save)) {
+        backend_t *b = &pool->backends[pool->num_backends];
+        if (pool->num_backends == MAX_BACKENDS || !(colon = strrchr(tok, ':')) || colon == tok ||
+            !colon[1] || strlen(colon + 1) >= sizeof(b->port)) {
+            fprintf(stderr, "Invalid backend %s (need host:port, max %d per origin)\n", tok, MAX_BACKENDS);
+            exit(1);
+        }
+        *colon = '\0';
+        snprintf(b->host, sizeof(b->host), "%s", tok);
+        strcpy(b->port, colon + 1);
+        b->breaker = breaker_get(b->host, b->port);
+        b->breaker->always_probe = 1;
+        pool->num_backends++;
+    }
+    if (!pool->num_backends) {
+        fprintf(stderr, "Backend pool for %s has no backends\n", pool->host);
+        exit(1);
+    }
+    num_pools++;
+}
+
+/* 요청의 원 서버에 해당하는 백엔드 묶음 (없으면 NULL) */
+backend_pool_t *pool_find(request_t *req) {
+    for (int p = 0; p < num_pools; p++) {
+        if (!strcasecmp(pools[p].host, req->hostname) && !strcmp(pools[p].port, req->port)) {
+            return &pools[p];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * 두 백엔드를 무작위로 뽑아 보내는 중인 요청이 적은 쪽을 고름 (power of two choices).
+ * 회로가 열린 백엔드와 이 요청이 이미 시도한 백엔드(tried 비트)는 후보에서 빼고,
+ * 요청 수가 같으면 지연 평균이 낮은 쪽. 후보가 없으면 NULL
+ */
+backend_t *backend_pick(backend_pool_t *pool, unsigned tried) {
+    int ready[MAX_BACKENDS], n = 0, i, j;
+    backend_t *a, *b;
+
+    for (i = 0; i < pool->num_backends; i++) {
+        if (!(tried & (1u << i)) && breaker_ready(pool->backends[i].breaker)) ready[n++] = i;
+    }
+    if (n == 0) return NULL;
+    if (n == 1) return &pool->backends[ready[0]];
+    if (!backend_seed) backend_seed = (unsigned)now_nsec() ^ (unsigned)pthread_self();
+    i = rand_r(&backend_seed) % n;
+    j = rand_r(&backend_seed) % (n - 1);
+    if (j >= i) j++;
+    a = &pool->backends[ready[i]];
+    b = &pool->backends[ready[j]];
+
+    int fa = __atomic_load_n(&a->inflight, __ATOMIC_RELAXED);
+    int fb = __atomic_load_n(&b->inflight, __ATOMIC_RELAXED);
+    if (fa != fb) return fa < fb ? a : b;
+    return a->ewma_usec <= b->ewma_usec ? a : b;
+}
+
+/*
+ * 묶음에서 tried 비트에 없는 백엔드를 골라 연결. 연결에 실패하면 그 백엔드의 실패로 세고 아직
+ * 시도하지 않은 백엔드 중에서 다시 고름. 모두 실패하면 open_clientfd의 마지막 반환값,
+ * 시도할 수 있는 백엔드가 없으면 (회로가 모두 열림) BREAKER_OPEN_RC.
+ * 연결하는 사이 watchfd에 응답이 오면 실패로 세지 않고 ANSWERED_RC
+ */
+int backend_connect(backend_pool_t *pool, unsigned tried, int watchfd, long timeout_ms) {
+    int fd = BREAKER_OPEN_RC;
+    backend_t *b;
+    int allow;
+
+    while ((b = backend_pick(pool, tried))) {
+        tried |= 1u << (b - pool->backends);
+        if (!(allow = breaker_allow(b->breaker))) continue;  // 다른 요청이 먼저 시험 요청을 가져감
+        __atomic_fetch_add(&b->inflight, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&b->requests, 1, __ATOMIC_RELAXED);
+        if ((fd = open_clientfd_watch(b->host, b->port, timeout_ms, watchfd)) >= 0) {
+            upstream_track(b->breaker, b, allow == BREAKER_TRIAL);
+            return fd;
+        }
+        __atomic_fetch_sub(&b->inflight, 1, __ATOMIC_RELAXED);
+        if (fd == ANSWERED_RC) {
+            __atomic_fetch_sub(&b->requests, 1, __ATOMIC_RELAXED);
+            breaker_cancel(b->breaker, allow == BREAKER_TRIAL);
+            return fd;
+        }
+        printf("Connection to backend %s:%s failed.\n", b->host, b->port);
+        __atomic_fetch_add(&b->failures, 1, __ATOMIC_RELAXED);
+        breaker_result(b->breaker, 0, allow == BREAKER_TRIAL);
+    }
+    return fd;
+}
+
+/* 연결한 대상을 이 스레드에 기록 (응답 헤더와 연결 종료 때 결과를 반영) */
+void upstream_track(breaker_t *breaker, backend_t *backend, int trial) {
+    upstream_breaker = breaker;
+    upstream_backend = backend;
+    upstream_start = now_nsec();
+    upstream_trial = trial;
+}
+
+/* 응답 헤더를 다 받음: 걸린 시간을 백엔드 지연 평균에, 성공 여부를 회로 차단기에 반영 */
+void upstream_response(int status) {
+    backend_t *b = upstream_backend;
+    unsigned long usec, old;
+
+    if (!upstream_start) return;
+    usec = (now_nsec() - upstream_start) / 1000;
+    upstream_start = 0;
+    if (b) {
+        old = __atomic_load_n(&b->ewma_usec, __ATOMIC_RELAXED);
+        old = old ? old - (old >> BACKEND_EWMA_SHIFT) + (usec >> BACKEND_EWMA_SHIFT) : usec;
+        __atomic_store_n(&b->ewma_usec, old, __ATOMIC_RELAXED);
+    }
+    if (upstream_breaker) {
+        latency_record(upstream_breaker, usec);
+        int slow = config.breaker_latency > 0 && usec > (unsigned long)config.breaker_latency * 1000;
+        breaker_result(upstream_breaker, status < 500 && !slow, upstream_trial);
+        upstream_trial = 0;
+    }
+}
+
+/* 이 스레드의 추적 상태를 u로 옮기고 비움 */
+void upstream_save(upstream_t *u) {
+    u->breaker = upstream_breaker;
+    u->backend = upstream_backend;
+    u->start = upstream_start;
+    u->trial = upstream_trial;
+    upstream_breaker = NULL;
+    upstream_backend = NULL;
+    upstream_start = 0;
+    upstream_trial = 0;
+}
+
+/* u에 담아 둔 추적 상태를 되돌림 */
+void upstream_restore(upstream_t *u) {
+    upstream_breaker = u->breaker;
+    upstream_backend = u->backend;
+    upstream_start = u->start;
+    upstream_trial = u->trial;
+}
+
+/*
+ * 연결을 닫음: 응답 헤더 전에 끊겼으면 실패로 세고, 보내는 중인 요청 수에서 뺌. 결과 없이 닫는
+ * 시험 요청(hedge에서 진 쪽)은 시험 기회만 돌려줌
+ */
+void upstream_done(void) {
+    if (upstream_start && upstream_breaker) {
+        breaker_result(upstream_breaker, 0, upstream_trial);
+    } else {
+        breaker_cancel(upstream_breaker, upstream_trial);
+    }
+    if (upstream_backend) __atomic_fetch_sub(&upstream_backend->inflight, 1, __ATOMIC_RELAXED);
+    else breaker_put(upstream_breaker);  // 백엔드의 차단기는 지우지 않으므로 원 서버 것만
+    upstream_breaker = NULL;
+    upstream_backend = NULL;
+    upstream_start = 0;
+    upstream_trial = 0;
+}
+
+/*
+ * host:port의 회로 차단기 (없으면 닫힌 상태로 만듦). 다 쓰면 breaker_put으로 돌려줌.
+ * 표가 차 있고 지울 수 있는 차단기도 없으면 NULL
+ */
+breaker_t *breaker_get(const char *host, const char *port) {
+    breaker_t **pp, *b;
+
+    pthread_mutex_lock(&breakers_mutex);
+    pp = &breakers[origin_bucket(host, port)];
+    for (b = *pp; b; b = b->next) {
+        if (!strcasecmp(b->host, host) && !strcmp(b->port, port)) break;
+    }
+    if (!b && (num_breakers < MAX_BREAKERS || breaker_evict())) {
+        b = (breaker_t *)Calloc(1, sizeof(breaker_t));
+        snprintf(b->host, sizeof(b->host), "%s", host);
+        snprintf(b->port, sizeof(b->port), "%s", port);
+        b->next = *pp;
+        *pp = b;
+        num_breakers++;
+    }
+    if (b) {
+        b->users++;
+        b->last_used = now_msec();
+    }
+    pthread_mutex_unlock(&breakers_mutex);
+    return b;
+}
+
+/* breaker_get으로 받은 차단기를 돌려줌 (NULL이면 무시) */
+void breaker_put(breaker_t *b) {
+    if (!b) return;
+    pthread_mutex_lock(&breakers_mutex);
+    b->users--;
+    pthread_mutex_unlock(&breakers_mutex);
+}
+
+/*
+ * 닫혀 있고 실패도 쓰는 요청도 없는 원 서버 차단기 중 가장 오래 쓰지 않은 것을 지움.
+ * 열린 차단기와 백엔드 차단기는 상태 확인 스레드가 락 밖에서 쓰므로 지우지 않음.
+ * 지웠으면 1. breakers_mutex를 잡은 상태에서 호출
+ */
+int breaker_evict(void) {
+    breaker_t **victim = NULL, *b;
+
+    for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        for (breaker_t **pp = &breakers[i]; *pp; pp = &(*pp)->next) {
+            b = *pp;
+            if (b->state != BREAKER_CLOSED || b->failures || b->users || b->always_probe) continue;
+            if (!victim || b->last_used < (*victim)->last_used) victim = pp;
+        }
+    }
+    if (!victim) return 0;
+    b = *victim;
+    *victim = b->next;
+    Free(b);
+    num_breakers--;
+    STAT_ADD(breaker_evictions, 1);
+    return 1;
+}
+
+/* 요청을 보낼 수 있는 상태인지 (락 없이 보는 값, 고르기용) */
+int breaker_ready(breaker_t *b) {
+    int state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+    return state == BREAKER_CLOSED || (state == BREAKER_HALF_OPEN && !b->trial);
+}
+
+/* 연결해도 되는지. 열려 있으면 0, 반쯤 열려 있으면 시험 요청 하나만 BREAKER_TRIAL로 통과 */
+int breaker_allow(breaker_t *b) {
+    int ok = 1;
+
+    if (config.breaker_failures <= 0) return 1;
+    pthread_mutex_lock(&breakers_mutex);
+    if (b->state == BREAKER_OPEN || (b->state == BREAKER_HALF_OPEN && b->trial)) {
+        ok = 0;
+        b->rejected++;
+    } else if (b->state == BREAKER_HALF_OPEN) {
+        b->trial = 1;
+        ok = BREAKER_TRIAL;
+    }
+    pthread_mutex_unlock(&breakers_mutex);
+    if (!ok) STAT_ADD(breaker_rejects, 1);
+    return ok;
+}
+
+/*
+ * 요청 결과 반영: 연속 실패가 한도에 닿거나 시험 요청이 실패하면 열고, 시험 요청이 성공하면 닫음.
+ * 반쯤 열린 상태를 바꾸는 것은 시험 요청(trial)의 결과뿐 (그 전에 보낸 요청의 결과는 세기만 함)
+ */
+void breaker_result(breaker_t *b, int ok, int trial) {
+    int tripped = 0;
+
+    if (config.breaker_failures <= 0 || !b) return;
+    pthread_mutex_lock(&breakers_mutex);
+    if (ok) {
+        b->failures = 0;
+        if (trial && b->state == BREAKER_HALF_OPEN) b->state = BREAKER_CLOSED;
+    } else {
+        b->failures++;
+        if ((trial && b->state == BREAKER_HALF_OPEN) ||
+            (b->state == BREAKER_CLOSED && b->failures >= config.breaker_failures)) {
+            b->state = BREAKER_OPEN;
+            b->trips++;
+            tripped = 1;
+        }
+    }
+    if (trial) b->trial = 0;
+    pthread_mutex_unlock(&breakers_mutex);
+    if (tripped) {
+        printf("Circuit opened for %s:%s after %d failures.\n", b->host, b->port, b->failures);
+        STAT_ADD(breaker_trips, 1);
+    }
+}
+
+/* 결과 없이 시험 기회만 돌려줌 (hedge에서 그만둔 연결, 시험 요청이 아니었으면 할 일 없음) */
+void breaker_cancel(breaker_t *b, int trial) {
+    if (!trial || !b) return;
+    pthread_mutex_lock(&breakers_mutex);
+    b->trial = 0;
+    pthread_mutex_unlock(&breakers_mutex);
+}
+
+/* 상태 확인 스레드 시작 */
+void health_init(void) {
+    pthread_t tid;
+    Pthread_create(&tid, NULL, health_thread, NULL);
+}
+
+/*
+ * HEALTH_INTERVAL_MS마다 열린 회로와 백엔드에 TCP 연결만 해 봄. 열린 회로는 연결되면
+ * 반쯤 열어 다음 요청 하나로 판단하고, 닫힌 백엔드는 연결되지 않으면 실패로 셈
+ */
+void *health_thread(void *vargp) {
+    breaker_t *targets[MAX_PROBES];
+    int n, fd;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(HEALTH_INTERVAL_MS * 1000);
+
+        // 확인할 대상을 모아 두고 락 밖에서 연결 (열린 차단기와 백엔드 차단기는 지워지지 않음)
+        n = 0;
+        pthread_mutex_lock(&breakers_mutex);
+        for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+            for (breaker_t *b = breakers[i]; b && n < MAX_PROBES; b = b->next) {
+                if (b->state == BREAKER_OPEN || (b->always_probe && b->state == BREAKER_CLOSED)) {
+                    targets[n++] = b;
+                }
+            }
+        }
+        pthread_mutex_unlock(&breakers_mutex);
+
+        for (int i = 0; i < n; i++) {
+            breaker_t *b = targets[i];
+            int closed;
+            if ((fd = open_clientfd_timeout(b->host, b->port, HEALTH_INTERVAL_MS)) >= 0) Close(fd);
+            pthread_mutex_lock(&breakers_mutex);
+            b->probes++;
+            if (fd < 0) b->probe_failures++;
+            if (fd >= 0 && b->state == BREAKER_OPEN) {
+                printf("Health probe reached %s:%s, circuit half-open.\n", b->host, b->port);
+                b->state = BREAKER_HALF_OPEN;
+                b->trial = 0;
+            }
+            closed = (b->state == BREAKER_CLOSED);
+            pthread_mutex_unlock(&breakers_mutex);
+            if (fd < 0 && closed) breaker_result(b, 0, 0);
+        }
+    }
+    return NULL;
+}
+
+/* 응답 헤더까지 걸린 시간을 대상의 분포에 기록 (LATENCY_AGE마다 반으로 줄여 최근 값을 따라감) */
+void latency_record(breaker_t *b, unsigned long usec) {
+    int k = 63 - __builtin_clzl(usec | 1);
+
+    if (k >= LATENCY_BUCKETS) k = LATENCY_BUCKETS - 1;
+    pthread_mutex_lock(&breakers_mutex);
+    b->latency_hist[k]++;
+    if (++b->latency_count >= LATENCY_AGE) {
+        b->latency_count = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            b->latency_hist[i] /= 2;
+            b->latency_count += b->latency_hist[i];
+        }
+    }
+    pthread_mutex_unlock(&breakers_mutex);
+}
+
+/*
+ * 분포의 pct 백분위 (마이크로초, 구간 안에서는 선형 보간). 표본이 HEDGE_MIN_SAMPLES보다
+ * 적으면 -1. breakers_mutex를 잡은 상태에서 호출
+ */
+int latency_percentile(breaker_t *b, int pct) {
+    unsigned target, cum = 0;
+
+    if (b->latency_count < HEDGE_MIN_SAMPLES) return -1;
+    target = (b->latency_count * pct + 99) / 100;
+    for (int k = 0; k < LATENCY_BUCKETS; k++) {
+        if (cum + b->latency_hist[k] >= target) {
+            unsigned long lo = 1UL << k;
+            return lo + lo * (target - cum) / b->latency_hist[k];
+        }
+        cum += b->latency_hist[k];
+    }
+    return 1 << LATENCY_BUCKETS;
+}
+
+/* 이 대상에 두 번째 요청을 보내기까지 기다릴 시간 (밀리초, 아직 모르면 -1) */
+int hedge_delay(breaker_t *b) {
+    int usec;
+
+    pthread_mutex_lock(&breakers_mutex);
+    usec = latency_percentile(b, config.hedge);
+    pthread_mutex_unlock(&breakers_mutex);
+    return usec < 0 ? -1 : (usec + 999) / 1000;
+}
+
+/*
+ * 첫 연결이 hedge 지연(그 대상 응답 시간의 config.hedge 백분위) 안에 응답을 보내기 시작하지 않으면
+ * 같은 요청을 한 번 더 보냄 (묶음이면 보내는 중인 요청이 적은 다른 백엔드, 아니면 같은 원 서버의
+ * 새 연결). 두 번째 연결을 맺는 사이 첫 연결에 응답이 오면 그만둠. 먼저 응답이 오기 시작한 연결을
+ * 돌려주고 다른 연결은 닫아 취소.
+ * 첫 바이트 제한은 첫 연결 때부터 잰 것을 이어 씀: 두 연결 모두 남은 시간 안에 응답하지 않으면
+ * 돌려준 연결의 제한이 바로 울려 504가 됨 (timeouts_first_byte)
+ */
+int hedge_request(request_t *req, int serverfd, const char *request_hdrs) {
+    upstream_t first, second;
+    struct pollfd fds[2];
+    unsigned long waited, begin = upstream_start;
+    long limit = config.first_byte_timeout * 1000, left, connect_ms;
+    int delay, fd2, winner;
+
+    if (!config.hedge || req->peer >= 0 || !upstream_breaker) return serverfd;
+    STAT_ADD(hedge_checked, 1);
+    if ((delay = hedge_delay(upstream_breaker)) < 0) return serverfd;
+    fds[0].fd = serverfd;
+    fds[0].events = POLLIN;
+    if (poll(fds, 1, delay) != 0) return serverfd;  // 제때 응답이 옴 (오류는 읽으면서 처리)
+
+    // 두 번째 연결: 첫 연결의 추적 상태와 시간 제한을 잠시 빼 둠.
+    // 묶음이면 첫 백엔드는 빼고 고르고, 연결은 남은 첫 바이트 시간 안에서 첫 연결을 지켜보며 기다림
+    deadline_stop(&upstream_deadline);
+    upstream_save(&first);
+    connect_ms = config.connect_timeout * 1000;
+    left = limit - (long)((now_nsec() - begin) / 1000000);
+    if (limit && (!connect_ms || left < connect_ms)) connect_ms = left > 0 ? left : 1;
+    fd2 = connect_origin_watch(req, first.backend, serverfd, connect_ms);
+    if (fd2 >= 0 && rio_writen(fd2, (void *)request_hdrs, strlen(request_hdrs)) < 0) {
+        close_origin(fd2);
+        fd2 = -1;
+    }
+    if (fd2 < 0) {
+        upstream_restore(&first);
+        left = limit - (long)((now_nsec() - begin) / 1000000);
+        deadline_start(&upstream_deadline, serverfd, limit ? (left > 0 ? left : 1) : 0,
+                       &stats.first_byte_timeouts);
+        return serverfd;
+    }
+    STAT_ADD(hedged, 1);
+    printf("Hedged request for %s after %d ms\n", req->url_key, delay);
+    deadline_stop(&upstream_deadline);
+    upstream_save(&second);
+
+    // 먼저 응답이 오는 쪽 (동시에 오거나 남은 시간 안에 둘 다 없으면 첫 연결)
+    fds[1].fd = fd2;
+    fds[1].events = POLLIN;
+    fds[0].revents = fds[1].revents = 0;
+    left = limit - (long)((now_nsec() - begin) / 1000000);
+    poll(fds, 2, limit ? (left > 0 ? (int)left : 0) : -1);
+    winner = (!fds[0].revents && fds[1].revents);
+
+    // 진 쪽은 실패로 세지 않고 닫음. 첫 요청이 졌으면 기다린 시간만큼은 걸렸다고 기록
+    if (winner) {
+        waited = (now_nsec() - first.start) / 1000;
+        first.start = 0;
+        if (first.breaker) latency_record(first.breaker, waited);  // 닫으면 차단기를 돌려주므로 그 전에
+        upstream_restore(&first);
+        close_origin(serverfd);
+        upstream_restore(&second);
+        serverfd = fd2;
+        STAT_ADD(hedge_wins, 1);
+    } else {
+        second.start = 0;
+        upstream_restore(&second);
+        close_origin(fd2);
+        upstream_restore(&first);
+    }
+    // 남은 시간만 다시 걸음 (다 썼으면 1밀리초: 곧 울려 시간 초과로 셈)
+    left = limit - (long)((now_nsec() - begin) / 1000000);
+    deadline_start(&upstream_deadline, serverfd, limit ? (left > 0 ? left : 1) : 0, &stats.first_byte_timeouts);
+    return serverfd;
 }